@@ -2,28 +2,42 @@
 ; we now need to switch to long mode and enable paging
 ; to execute 64 bit instructions, a 64 bit GDT is required
 ; we then far jump to enable long mode
+; until then paging is disabled, so this code is linked at its physical address
+; the rest of the kernel is linked at physical address + KERNEL_OFFSET (higher half)
 
 global start
+global stack_top
+global gdt64_pointer
+global boot_tsc
+global kernel_main_tsc
 
-section .text
+KERNEL_OFFSET equ 0xffffffff80000000
+
+section .boot.text progbits alloc exec nowrite align=16
 bits 32
 
 %include "utils/screen.asm"
 
 start:
-    mov esp, stack_top  ; Update the stack pointer
+    mov esp, stack_top - KERNEL_OFFSET  ; Update the stack pointer (physical address)
     mov edi, ebx        ; Move Multiboot info pointer (stored in ebx at startup) to edi, to read it from kernel_main
 
     clear_screen
 
     call check_multiboot
+
+    ; the TSC is saved for the self-tests, once eax (the multiboot magic) has been checked
+    rdtsc
+    mov [boot_tsc - KERNEL_OFFSET], eax
+    mov [boot_tsc - KERNEL_OFFSET + 4], edx
+
     call check_cpuid
     call check_long_mode
 
     call set_up_page_tables
     call enable_paging
 
-    lgdt [gdt64.pointer]
+    lgdt [gdt64_boot_pointer - KERNEL_OFFSET]
 
     extern long_mode_start
     jmp gdt64.code:long_mode_start
@@ -95,58 +109,62 @@ error:
     hlt
 
 set_up_page_tables:
-    ; map pml4 table recursively
-    mov eax, pml4_table
-    or eax, 0b11 ; present + writable
-    mov [pml4_table + 511 * 8], eax
-
     ; map first pml4 entry to pdp table
-    mov eax, pdp_table
+    mov eax, pdp_table - KERNEL_OFFSET
     or eax, 0b11 ; present + writable
-    mov [pml4_table], eax
+    mov [pml4_table - KERNEL_OFFSET], eax
 
-    ; map first pdp entry to pd table
-    mov eax, pd_table
+    ; the same pdp table is used by the 256th entry (0xffff800000000000)
+    ; so the kernel can reach the first GiB of physical memory through the direct map
+    mov [pml4_table - KERNEL_OFFSET + 256 * 8], eax
+
+    ; the last entry maps the higher half pdp table, used by the kernel (0xffffffff80000000)
+    mov eax, pdp_table_high - KERNEL_OFFSET
     or eax, 0b11 ; present + writable
-    mov [pdp_table], eax
+    mov [pml4_table - KERNEL_OFFSET + 511 * 8], eax
 
     ; the first gigabyte of memory will be identity mapped
+    ; using a single 1GiB page if the cpu supports it
+    mov eax, 0x80000001    ; argument for extended processor info
+    cpuid
+    test edx, 1 << 26      ; test if 1GiB pages are supported
+    jz .identity_map_1st_GiB
+
+    mov dword [pdp_table - KERNEL_OFFSET], 0b10000011 ; present + writable + huge, starting at address 0
+    jmp .map_kernel
+
+    ; otherwise use 512 2MiB pages
 .identity_map_1st_GiB:
 
-    ; map each pd table entry to the respective pt table address
+    ; map first pdp entry to pd table
+    mov eax, pd_table - KERNEL_OFFSET
+    or eax, 0b11 ; present + writable
+    mov [pdp_table - KERNEL_OFFSET], eax
+
+    ; map each pd table entry to a 2MiB frame
     mov ecx, 0  ; counter variable
 
 .map_pd_table:
 
-    mov eax, 4096       ; the size of a pt table
-    mul ecx             ; multiply the size by a counter, to get the index of the nth table
-    add eax, pt_table   ; add the offset of the first pt_table
-    or eax, 0b11        ; present + writable
-    mov [pd_table + ecx * 8], eax
+    mov eax, 0x200000   ; the size of a huge page
+    mul ecx             ; start address of ecx-th page
+    or eax, 0b10000011  ; present + writable + huge
+    mov [pd_table - KERNEL_OFFSET + ecx * 8], eax
 
     inc ecx             ; increase counter
     cmp ecx, 512        ; check if all the table entries have been mapped
     jne .map_pd_table
 
-    ; identity map each entry of each pt table to a 4KiB frame
-    mov ecx, 0          ; counter variable
-
-.map_512_pt_tables:
-
-    mov eax, 0x1000
-    mul ecx             ; start address of ecx-th page
-    or eax, 0b11        ; present + writable
-    mov [pt_table + ecx * 8], eax   ; map ecx-th entry (the pt tables are declared in a contiguous memory region)
-
-    inc ecx             ; increase counter
-    cmp ecx, 512 * 512  ; if counter == 512 * 512, each entry of each pt table is mapped
-    jne .map_512_pt_tables   ; else map the next entry
+    ; the 510th higher half pdp entry (0xffffffff80000000) maps the first GiB too
+.map_kernel:
+    mov eax, [pdp_table - KERNEL_OFFSET]
+    mov [pdp_table_high - KERNEL_OFFSET + 510 * 8], eax
 
     ret
 
 enable_paging:
     ; load pml4 to cr3 register (cpu uses this to access the Pml4 table)
-    mov eax, pml4_table
+    mov eax, pml4_table - KERNEL_OFFSET
     mov cr3, eax
 
     ; enable PAE-flag in cr4 (Physical Address Extension)
@@ -168,20 +186,26 @@ enable_paging:
     ret
 
 section .bss
+; TSC values when the boot code started and when it called kernel_main
+boot_tsc:
+    resq 1
+kernel_main_tsc:
+    resq 1
+
 align 4096
 pml4_table:
     resb 4096
 pdp_table:
     resb 4096
+pdp_table_high:
+    resb 4096
 pd_table:
     resb 4096
-pt_table:
-    resb 4096 * 512   ; Reserve space for 512 page tables
 stack_bottom:
-    resb 4096 * 4     ; Reserve 16 KiBytes for the kernel stack
+    resb 4096 * 16    ; Reserve 64 KiBytes for the kernel stack
 stack_top:
 
-section .data
+section .boot.rodata progbits alloc noexec nowrite align=4
     MSG_NO_MULTIBOOT                db "Multiboot not supported", 0
     MSG_NO_CPUID                    db "Cpuid not supported", 0
     MSG_NO_LONG_MODE                db "Long mode not supported", 0
@@ -191,6 +215,10 @@ gdt64:
     dq 0 ; zero entry
 .code: equ $ - gdt64 ; new
     dq (1<<43) | (1<<44) | (1<<47) | (1<<53) ; code segment
-.pointer:
-    dw $ - gdt64 - 1
+gdt64_end:
+gdt64_boot_pointer: ; loaded before paging is enabled
+    dw gdt64_end - gdt64 - 1
+    dq gdt64 - KERNEL_OFFSET
+gdt64_pointer: ; loaded once the kernel runs in the higher half
+    dw gdt64_end - gdt64 - 1
     dq gdt64
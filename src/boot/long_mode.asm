@@ -1,9 +1,25 @@
 global long_mode_start
 
-section .text
+section .boot.text progbits alloc exec nowrite align=16
 bits 64
 
+; We are still running at the physical address of the boot code
+; jump to the kernel, that is linked in the higher half
 long_mode_start:
+    mov rax, higher_half_start
+    jmp rax
+
+section .text
+bits 64
+
+higher_half_start:
+    ; the stack and the gdt were set up with their physical addresses
+    ; reload them with the higher half ones, the identity map is removed by the kernel
+    extern stack_top
+    extern gdt64_pointer
+    mov rsp, stack_top
+    lgdt [gdt64_pointer]
+
     ; load 0 into all data segment registers
     mov ax, 0
     mov ss, ax
@@ -16,7 +32,17 @@ long_mode_start:
     ; mov rax, 0x2f592f412f4b2f4f
     ; mov qword [0xb8000], rax
 
+    ; the time spent in the boot code is printed by the self-tests, rdtsc leaves edi alone
+    extern kernel_main_tsc
+    rdtsc
+    mov [kernel_main_tsc], eax
+    mov [kernel_main_tsc + 4], edx
+
+    ; the multiboot info pointer (edi) is a physical address
     extern kernel_main
     call kernel_main
 
+    ; interrupts are enabled, so wait for them instead of running past the end
+.halt:
     hlt
+    jmp .halt
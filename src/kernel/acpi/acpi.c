@@ -0,0 +1,69 @@
+#include "acpi.h"
+#include "../log.h"
+#include "../mm/multiboot2.h"
+#include "../mm/paging/page.h"
+#include <stddef.h>
+
+
+#define ACPI_1_RSDP_SIZE 20 // the checksum only covers the ACPI 1.0 fields
+
+static inline bool is_checksum_valid(const void* table, size_t length);
+static inline bool is_signature(const acpi_sdt_header_t* header, const char signature[4]);
+
+
+static const acpi_rsdp_t* rsdp;
+
+
+// required to use the other functions
+// init_multiboot_info has to be called before, the RSDP is copied by the bootloader
+void init_acpi() {
+    rsdp = get_acpi_rsdp();
+    if (rsdp == (void*)-1) PANIC("ACPI RSDP not found");
+    if (!is_checksum_valid(rsdp, ACPI_1_RSDP_SIZE)) PANIC("ACPI RSDP checksum is not valid");
+
+    DEBUG("ACPI initialized (revision = %d)\n", rsdp->revision);
+}
+
+// Returns the first table with the signature or -1 if there is none
+// The tables are read through the direct map
+const acpi_sdt_header_t* find_acpi_table(const char signature[4]) {
+
+    // the XSDT holds 64 bit addresses, the RSDT 32 bit ones
+    bool                     extended = rsdp->revision >= 2 && rsdp->xsdt_address != 0;
+    const acpi_sdt_header_t* root     = PHYS_TO_VIRT(
+        extended ? rsdp->xsdt_address : (uint64_t)rsdp->rsdt_address
+    );
+    const uint8_t* entries       = (const uint8_t*)(root + 1);
+    size_t         entry_size    = extended ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t         entries_count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+
+    for (size_t i = 0; i < entries_count; i++) {
+        // the entries are not aligned
+        uint64_t address = 0;
+        for (size_t byte = 0; byte < entry_size; byte++)
+            address |= (uint64_t)entries[i * entry_size + byte] << (byte * 8);
+
+        const acpi_sdt_header_t* header = PHYS_TO_VIRT(address);
+        if (is_signature(header, signature) && is_checksum_valid(header, header->length))
+            return header;
+    }
+
+    DEBUG(
+        "ACPI table %c%c%c%c not found\n", signature[0], signature[1], signature[2], signature[3]
+    );
+    return (void*)-1;
+}
+
+
+// All the bytes of a table, checksum included, add up to 0
+static inline bool is_checksum_valid(const void* table, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) sum += ((const uint8_t*)table)[i];
+    return sum == 0;
+}
+
+static inline bool is_signature(const acpi_sdt_header_t* header, const char signature[4]) {
+    for (size_t i = 0; i < 4; i++)
+        if (header->signature[i] != signature[i]) return false;
+    return true;
+}
@@ -0,0 +1,44 @@
+/*
+** More information on the ACPI tables here:
+** https://uefi.org/specs/ACPI/6.5/05_ACPI_Software_Programming_Model.html
+*/
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+typedef struct __attribute__((packed)) {
+    char     signature[8]; // "RSD PTR "
+    uint8_t  checksum;
+    char     oem_id[6];
+    uint8_t  revision; // 0 for ACPI 1.0, 2 for ACPI 2.0 and later
+    uint32_t rsdt_address;
+
+    // ACPI 2.0
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} acpi_rsdp_t;
+
+// Every system description table starts with this header
+typedef struct __attribute__((packed)) {
+    char     signature[4];
+    uint32_t length; // header included
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} acpi_sdt_header_t;
+
+
+void                     init_acpi();
+const acpi_sdt_header_t* find_acpi_table(const char signature[4]);
+
+#endif
@@ -0,0 +1,87 @@
+#include "madt.h"
+#include "../cpu/cpu.h"
+#include "../log.h"
+#include "acpi.h"
+#include <stdbool.h>
+
+
+// MADT entry types
+#define MADT_LOCAL_APIC                  0
+#define MADT_LOCAL_APIC_ADDRESS_OVERRIDE 5
+
+#define MADT_LOCAL_APIC_ENABLED 0x1
+
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header; // signature "APIC"
+    uint32_t          local_apic_address;
+    uint32_t          flags;
+    uint8_t           entries[];
+} madt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t length;
+} madt_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  type;
+    uint8_t  length;
+    uint8_t  processor_id;
+    uint8_t  apic_id;
+    uint32_t flags;
+} madt_local_apic_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  type;
+    uint8_t  length;
+    uint16_t reserved;
+    uint64_t address;
+} madt_local_apic_address_override_t;
+
+
+static const madt_t* madt;
+
+
+// required to use the other functions
+// init_acpi has to be called before
+void init_madt() {
+    madt = (const madt_t*)find_acpi_table("APIC");
+    if (madt == (void*)-1) PANIC("ACPI MADT not found");
+}
+
+// Returns the physical address of the local APICs (every cpu sees its own at the same address)
+const void* get_local_apic_address() {
+    uint64_t address = madt->local_apic_address;
+
+    const uint8_t* entry = madt->entries;
+    const uint8_t* end   = (const uint8_t*)madt + madt->header.length;
+    for (; entry < end; entry += ((const madt_entry_t*)entry)->length)
+        if (((const madt_entry_t*)entry)->type == MADT_LOCAL_APIC_ADDRESS_OVERRIDE)
+            address = ((const madt_local_apic_address_override_t*)entry)->address;
+
+    return (void*)address;
+}
+
+// Copies the ids of the usable local APICs (one for each cpu) into the first parameter
+// The array must hold MAX_CPUS ids, the cpus after them are not used
+size_t get_local_apic_ids(uint32_t apic_ids[]) {
+    size_t apic_ids_size = 0;
+
+    const uint8_t* entry = madt->entries;
+    const uint8_t* end   = (const uint8_t*)madt + madt->header.length;
+    for (; entry < end; entry += ((const madt_entry_t*)entry)->length) {
+        if (((const madt_entry_t*)entry)->type != MADT_LOCAL_APIC) continue;
+
+        const madt_local_apic_t* local_apic = (const madt_local_apic_t*)entry;
+        if ((local_apic->flags & MADT_LOCAL_APIC_ENABLED) == 0) continue;
+
+        if (apic_ids_size == MAX_CPUS) {
+            LOG("Cpus after the first %d will not be used\n", MAX_CPUS);
+            break;
+        }
+        apic_ids[apic_ids_size++] = local_apic->apic_id;
+    }
+
+    DEBUG("MADT: %d cpus (local apic = %p)\n", apic_ids_size, get_local_apic_address());
+    return apic_ids_size;
+}
@@ -0,0 +1,12 @@
+#ifndef ACPI_MADT_H
+#define ACPI_MADT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+void        init_madt();
+const void* get_local_apic_address();
+size_t      get_local_apic_ids(uint32_t apic_ids[]);
+
+#endif
@@ -0,0 +1,107 @@
+#include "apic.h"
+#include "../drivers/pic.h"
+#include "../log.h"
+#include "../mm/vma/vmalloc.h"
+#include "cpu.h"
+#include "idt.h"
+
+
+// Local APIC registers, as offsets from its base address
+#define APIC_ID_REGISTER       0x20
+#define APIC_EOI_REGISTER      0xb0
+#define APIC_SPURIOUS_REGISTER 0xf0
+#define APIC_ICR_LOW_REGISTER  0x300 // writing it sends the interrupt
+#define APIC_ICR_HIGH_REGISTER 0x310
+#define APIC_TIMER_REGISTER    0x320 // local vector table entry of the timer
+#define APIC_INITIAL_COUNT     0x380
+#define APIC_CURRENT_COUNT     0x390
+#define APIC_DIVIDE_REGISTER   0x3e0
+#define APIC_REGISTERS_SIZE    0x400
+
+#define APIC_SOFTWARE_ENABLE 0x100
+
+// Interrupt command register fields
+#define APIC_ICR_FIXED           0x0
+#define APIC_ICR_INIT            0x500
+#define APIC_ICR_STARTUP         0x600
+#define APIC_ICR_DELIVERY_STATUS 0x1000 // the previous interrupt has not been accepted yet
+#define APIC_ICR_ASSERT          0x4000
+#define APIC_ICR_DESTINATION(id) ((uint32_t)(id) << 24)
+
+#define APIC_TIMER_PERIODIC  0x20000
+#define APIC_TIMER_DIVIDE_16 0x3
+
+static inline uint32_t read_register(uint32_t offset);
+static inline void     write_register(uint32_t offset, uint32_t value);
+static inline void     send_ipi(uint32_t apic_id, uint32_t command);
+static inline void     handle_spurious_interrupt(interrupt_frame_t* frame);
+
+
+// Every cpu sees its own local APIC at the same address
+static volatile uint8_t* apic_registers;
+
+
+// required to use the other functions
+// The registers are mapped once, enable_apic has to be called on every cpu
+// The legacy PICs are disabled, the local APICs replace them
+void init_apic(const void* physical_address) {
+    disable_pic();
+
+    apic_registers = map_mmio(physical_address, APIC_REGISTERS_SIZE);
+    if (apic_registers == NULL) PANIC("Cannot map the local APIC registers");
+
+    set_interrupt_handler(APIC_SPURIOUS_VECTOR, handle_spurious_interrupt);
+
+    DEBUG("Local APIC mapped (registers = %p)\n", apic_registers);
+}
+
+// Enables the local APIC of the running cpu
+void enable_apic() {
+    write_register(APIC_SPURIOUS_REGISTER, APIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+uint32_t get_apic_id() { return read_register(APIC_ID_REGISTER) >> 24; }
+
+// Resets the cpu, it then waits for a startup interrupt
+void send_init_ipi(uint32_t apic_id) { send_ipi(apic_id, APIC_ICR_INIT | APIC_ICR_ASSERT); }
+
+// The cpu starts in real mode at page * PAGE_SIZE (page is below 256, so under 1MiB)
+void send_startup_ipi(uint32_t apic_id, uint8_t page) {
+    send_ipi(apic_id, APIC_ICR_STARTUP | APIC_ICR_ASSERT | page);
+}
+
+// Interrupts the cpu with the vector, it is handled like any other interrupt
+void send_fixed_ipi(uint32_t apic_id, uint8_t vector) {
+    send_ipi(apic_id, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector);
+}
+
+// Signals the end of the interrupt being handled
+void send_apic_eoi() { write_register(APIC_EOI_REGISTER, 0); }
+
+// Sends the vector to the running cpu when the count reaches 0 (and reloads it if periodic)
+void start_apic_timer(uint8_t vector, uint32_t count, bool periodic) {
+    write_register(APIC_DIVIDE_REGISTER, APIC_TIMER_DIVIDE_16);
+    write_register(APIC_TIMER_REGISTER, vector | (periodic ? APIC_TIMER_PERIODIC : 0));
+    write_register(APIC_INITIAL_COUNT, count);
+}
+
+uint32_t get_apic_timer_count() { return read_register(APIC_CURRENT_COUNT); }
+
+
+static inline uint32_t read_register(uint32_t offset) {
+    return *(volatile uint32_t*)(apic_registers + offset);
+}
+
+static inline void write_register(uint32_t offset, uint32_t value) {
+    *(volatile uint32_t*)(apic_registers + offset) = value;
+}
+
+static inline void send_ipi(uint32_t apic_id, uint32_t command) {
+    write_register(APIC_ICR_HIGH_REGISTER, APIC_ICR_DESTINATION(apic_id));
+    write_register(APIC_ICR_LOW_REGISTER, command);
+
+    while ((read_register(APIC_ICR_LOW_REGISTER) & APIC_ICR_DELIVERY_STATUS) != 0) cpu_relax();
+}
+
+// Spurious interrupts are not real ones, they must not be acknowledged
+static inline void handle_spurious_interrupt(interrupt_frame_t* frame) { (void)frame; }
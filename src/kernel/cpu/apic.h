@@ -0,0 +1,26 @@
+#ifndef CPU_APIC_H
+#define CPU_APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Spurious interrupts are delivered to the last vector, they need no EOI
+#define APIC_SPURIOUS_VECTOR 0xff
+
+// The timer counts down at the bus frequency divided by APIC_TIMER_DIVIDER
+#define APIC_TIMER_DIVIDER   16
+#define APIC_TIMER_MAX_COUNT 0xffffffff
+
+
+void     init_apic(const void* physical_address);
+void     enable_apic();
+uint32_t get_apic_id();
+void     send_init_ipi(uint32_t apic_id);
+void     send_startup_ipi(uint32_t apic_id, uint8_t page);
+void     send_fixed_ipi(uint32_t apic_id, uint8_t vector);
+void     send_apic_eoi();
+void     start_apic_timer(uint8_t vector, uint32_t count, bool periodic);
+uint32_t get_apic_timer_count();
+
+#endif
@@ -1,11 +1,36 @@
 #include "cpu.h"
 #include "../log.h"
+#include "percpu.h"
+#include "tlb.h"
+#include <stddef.h>
 
 
 #define EFER_MSR 0xC0000080
 
 #define NXE_BIT           0x800
 #define WRITE_PROTECT_BIT 0x10000
+#define INTERRUPT_FLAG    0x200
+#define PGE_BIT           0x80
+#define PCIDE_BIT         0x20000
+
+// CPUID.80000001H:EDX[26] 1GiB pages
+#define CPUID_1GIB_PAGES_BIT 0x4000000
+// CPUID.01H:EDX[13] global pages
+#define CPUID_PGE_BIT 0x2000
+// CPUID.01H:ECX[17] process-context identifiers
+#define CPUID_PCID_BIT 0x20000
+// CPUID.(EAX=07H, ECX=0H):EBX[10] INVPCID instruction
+#define CPUID_INVPCID_BIT 0x400
+
+// INVPCID invalidation types
+#define INVPCID_ADDRESS        0
+#define INVPCID_SINGLE_CONTEXT 1
+#define INVPCID_ALL_CONTEXTS   2 // global entries included
+
+static inline void invpcid(uint64_t type, uint16_t pcid, void* virtual_page_addr);
+
+// Set by enable_pcid when both PCIDs and INVPCID can be used
+static bool invpcid_enabled = false;
 
 inline uint64_t read_cr0() {
     uint64_t value;
@@ -15,6 +40,13 @@ inline uint64_t read_cr0() {
 
 inline void write_cr0(uint64_t value) { __asm__ volatile("mov %0, %%cr0" ::"r"(value) : "memory"); }
 
+// Holds the address that caused the last page fault
+inline uint64_t read_cr2() {
+    uint64_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
 inline uint64_t read_cr3() {
     uint64_t value;
     __asm__ volatile("mov %%cr3, %0" : "=r"(value));
@@ -23,14 +55,42 @@ inline uint64_t read_cr3() {
 
 inline void write_cr3(uint64_t value) { __asm__ volatile("mov %0, %%cr3" ::"r"(value) : "memory"); }
 
+inline uint64_t read_cr4() {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+inline void write_cr4(uint64_t value) { __asm__ volatile("mov %0, %%cr4" ::"r"(value) : "memory"); }
+
 inline void flush_tlb_page(void* virtual_page_addr) {
     DEBUG("Flusing TLB for page %p\n", virtual_page_addr);
     __asm__ volatile("invlpg (%0)" ::"r"(virtual_page_addr) : "memory");
 }
 
+// Flushes the TLB entries of the running address space (INVPCID avoids reloading CR3)
+// Global pages are not flushed
 inline void flush_tlb() {
+    DEBUG("Flushing TLB (non global entries)\n");
+    if (invpcid_enabled) invpcid(INVPCID_SINGLE_CONTEXT, read_cr3() & CR3_PCID_MASK, 0);
+    else write_cr3(read_cr3());
+}
+
+// Flushes every TLB entry, of every PCID, global pages included
+inline void flush_tlb_all() {
     DEBUG("Flushing entire TLB\n");
-    write_cr3(read_cr3());
+    if (invpcid_enabled) {
+        invpcid(INVPCID_ALL_CONTEXTS, 0, 0);
+        return;
+    }
+
+    // toggling CR4.PGE flushes the global entries too
+    uint64_t cr4 = read_cr4();
+    if ((cr4 & PGE_BIT) != 0) {
+        write_cr4(cr4 & ~PGE_BIT);
+        write_cr4(cr4);
+    }
+    else write_cr3(read_cr3());
 }
 
 inline uint64_t read_msr(uint32_t msr_addr) {
@@ -51,6 +111,81 @@ inline void write_msr(uint32_t msr_addr, uint64_t msr_value) {
     __asm__ volatile("wrmsr" ::"r"(high), "r"(low), "r"(msr) :);
 }
 
+inline cpuid_registers_t cpuid(uint32_t leaf, uint32_t subleaf) {
+    cpuid_registers_t registers;
+
+    __asm__ volatile("cpuid"
+                     : "=a"(registers.eax),
+                       "=b"(registers.ebx),
+                       "=c"(registers.ecx),
+                       "=d"(registers.edx)
+                     : "a"(leaf), "c"(subleaf));
+
+    return registers;
+}
+
+// Returns the index of the running cpu, read from its per-cpu data (see percpu.h)
+inline uint32_t get_cpu_id() {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(cpu_t, id)));
+    return id;
+}
+
+// Returns the local APIC id the cpu had at reset
+inline uint32_t get_initial_apic_id() { return cpuid(1, 0).ebx >> 24; }
+
+// Checks if table3 entries can map 1GiB pages
+inline bool has_1gib_pages() {
+    return cpuid(0x80000000, 0).eax >= 0x80000001
+        && (cpuid(0x80000001, 0).edx & CPUID_1GIB_PAGES_BIT) != 0;
+}
+
+inline bool has_global_pages() { return (cpuid(1, 0).edx & CPUID_PGE_BIT) != 0; }
+
+inline bool has_pcid() { return (cpuid(1, 0).ecx & CPUID_PCID_BIT) != 0; }
+
+inline bool has_invpcid() {
+    return cpuid(0, 0).eax >= 7 && (cpuid(7, 0).ebx & CPUID_INVPCID_BIT) != 0;
+}
+
+inline uint8_t read_port_byte(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void write_port_byte(uint16_t port, uint8_t value) {
+    __asm__ volatile("outb %0, %1" ::"a"(value), "Nd"(port));
+}
+
+// Returns the time stamp counter, it counts at a constant rate (see get_tsc_frequency)
+inline uint64_t read_tsc() {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (uint64_t)high << 32 | low;
+}
+
+// Hint for busy wait loops
+// The TLB shootdowns are answered while waiting, the sender may wait for this cpu to get a lock
+inline void cpu_relax() {
+    __asm__ volatile("pause" ::: "memory");
+    answer_tlb_shootdown();
+}
+
+// Disables interrupts and returns the previous flags register, to pass to restore_interrupts
+inline uint64_t disable_interrupts() {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags)::"memory");
+    return rflags;
+}
+
+inline void enable_interrupts() { __asm__ volatile("sti" ::: "memory"); }
+
+// Enables interrupts again if they were enabled before disable_interrupts
+inline void restore_interrupts(uint64_t rflags) {
+    if ((rflags & INTERRUPT_FLAG) != 0) __asm__ volatile("sti" ::: "memory");
+}
+
 inline void enable_nxe_bit() {
     DEBUG("Enabling NXE bit in EFER register\n");
     write_msr(EFER_MSR, read_msr(EFER_MSR) | NXE_BIT);
@@ -60,3 +195,45 @@ inline void enable_write_protect_bit() {
     DEBUG("Enabling write protect bit in CR0 register\n");
     write_cr0(read_cr0() | WRITE_PROTECT_BIT);
 }
+
+// Global pages keep their TLB entries when CR3 is written
+inline void enable_global_pages() {
+    if (!has_global_pages()) return;
+
+    DEBUG("Enabling PGE bit in CR4 register\n");
+    write_cr4(read_cr4() | PGE_BIT);
+}
+
+// Enables process-context identifiers if the cpu supports them (together with INVPCID)
+// CR3 must hold PCID 0 when this is called
+inline bool enable_pcid() {
+    if (!has_pcid() || !has_invpcid()) return false;
+
+    DEBUG("Enabling PCIDE bit in CR4 register\n");
+    write_cr4(read_cr4() | PCIDE_BIT);
+    invpcid_enabled = true;
+
+    return true;
+}
+
+// Invalidates the TLB entry of a page tagged with the pcid (it does not need to be running)
+inline void invalidate_pcid_page(uint16_t pcid, void* virtual_page_addr) {
+    if (invpcid_enabled) invpcid(INVPCID_ADDRESS, pcid, virtual_page_addr);
+    else flush_tlb_page(virtual_page_addr);
+}
+
+// Invalidates all the (non global) TLB entries tagged with the pcid
+inline void invalidate_pcid(uint16_t pcid) {
+    if (invpcid_enabled) invpcid(INVPCID_SINGLE_CONTEXT, pcid, 0);
+    else flush_tlb();
+}
+
+
+static inline void invpcid(uint64_t type, uint16_t pcid, void* virtual_page_addr) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor = {.pcid = pcid, .address = (uint64_t)virtual_page_addr};
+
+    __asm__ volatile("invpcid %0, %1" ::"m"(descriptor), "r"(type) : "memory");
+}
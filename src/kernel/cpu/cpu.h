@@ -1,19 +1,61 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 
+// Maximum number of cpus the kernel keeps per-cpu state for (the others are not started)
+#define MAX_CPUS 16
+
+// With PCIDs enabled the low bits of CR3 hold the PCID of the running address space
+#define CR3_ADDRESS_MASK 0x000ffffffffff000
+#define CR3_PCID_MASK    0xfff
+#define CR3_NO_FLUSH     0x8000000000000000 // keep the TLB entries of the new PCID
+
+typedef struct {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} cpuid_registers_t;
+
 uint64_t read_cr0();
 void     write_cr0(uint64_t value);
+uint64_t read_cr2();
 uint64_t read_cr3();
 void     write_cr3(uint64_t value);
+uint64_t read_cr4();
+void     write_cr4(uint64_t value);
 uint64_t read_msr(uint32_t msr_addr);
 void     write_msr(uint32_t msr_addr, uint64_t msr_value);
 
+cpuid_registers_t cpuid(uint32_t leaf, uint32_t subleaf);
+uint32_t          get_cpu_id();
+uint32_t          get_initial_apic_id();
+bool              has_1gib_pages();
+bool              has_global_pages();
+bool              has_pcid();
+bool              has_invpcid();
+
+uint8_t read_port_byte(uint16_t port);
+void    write_port_byte(uint16_t port, uint8_t value);
+void    cpu_relax();
+
+uint64_t read_tsc();
+uint64_t disable_interrupts();
+void     enable_interrupts();
+void     restore_interrupts(uint64_t rflags);
+
 void flush_tlb_page(void* virtual_page_addr);
 void flush_tlb();
+void flush_tlb_all();
 void enable_nxe_bit();
 void enable_write_protect_bit();
+void enable_global_pages();
+bool enable_pcid();
+
+void invalidate_pcid_page(uint16_t pcid, void* virtual_page_addr);
+void invalidate_pcid(uint16_t pcid);
 
 #endif
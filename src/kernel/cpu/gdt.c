@@ -0,0 +1,69 @@
+#include "gdt.h"
+#include "../log.h"
+#include "cpu.h"
+#include <stddef.h>
+
+
+#define IST_STACKS 2
+
+// Long mode code segment: executable, code/data, present, 64 bit
+#define CODE_SEGMENT_DESCRIPTOR ((1ull << 43) | (1ull << 44) | (1ull << 47) | (1ull << 53))
+
+// Available 64 bit TSS, present
+#define TSS_DESCRIPTOR_TYPE 0x89
+
+typedef struct __attribute__((packed)) {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} tss_t;
+
+// null, kernel code, tss (it takes two entries)
+typedef struct __attribute__((packed)) {
+    uint64_t null;
+    uint64_t kernel_code;
+    uint64_t tss_low;
+    uint64_t tss_high;
+} gdt_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t limit;
+    uint64_t base;
+} gdt_pointer_t;
+
+
+// Every cpu has its own tss (a busy tss cannot be loaded by another cpu) and interrupt stacks
+static tss_t   tss[MAX_CPUS];
+static gdt_t   gdt[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_STACKS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+
+// required to use interrupt stacks, on the running cpu (init_percpu has to be called before)
+// Replaces the boot gdt, the kernel code selector does not change so CS does not need a reload
+void init_gdt() {
+    uint32_t cpu = get_cpu_id();
+
+    for (size_t i = 0; i < IST_STACKS; i++)
+        tss[cpu].ist[i] = (uint64_t)&ist_stacks[cpu][i][IST_STACK_SIZE]; // the stacks grow down
+    tss[cpu].iomap_base = sizeof(tss_t);
+
+    uint64_t base  = (uint64_t)&tss[cpu];
+    uint64_t limit = sizeof(tss_t) - 1;
+
+    gdt[cpu].null        = 0;
+    gdt[cpu].kernel_code = CODE_SEGMENT_DESCRIPTOR;
+    gdt[cpu].tss_low     = (limit & 0xffff) | ((base & 0xffffff) << 16)
+                     | ((uint64_t)TSS_DESCRIPTOR_TYPE << 40) | (((limit >> 16) & 0xf) << 48)
+                     | (((base >> 24) & 0xff) << 56);
+    gdt[cpu].tss_high = base >> 32;
+
+    gdt_pointer_t pointer = {.limit = sizeof(gdt_t) - 1, .base = (uint64_t)&gdt[cpu]};
+    __asm__ volatile("lgdt %0" ::"m"(pointer) : "memory");
+    __asm__ volatile("ltr %0" ::"r"((uint16_t)TSS_SELECTOR) : "memory");
+
+    DEBUG("GDT initialized (cpu = %d, tss = %p)\n", cpu, &tss[cpu]);
+}
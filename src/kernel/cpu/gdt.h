@@ -0,0 +1,20 @@
+#ifndef CPU_GDT_H
+#define CPU_GDT_H
+
+#include <stdint.h>
+
+
+#define KERNEL_CODE_SELECTOR 0x08
+#define TSS_SELECTOR         0x10
+
+// Interrupt stack table indexes, these interrupts always switch to their own stack
+// A stack overflow would otherwise fault again while pushing the interrupt frame
+#define IST_DOUBLE_FAULT 1
+#define IST_PAGE_FAULT   2
+
+#define IST_STACK_SIZE (4 * 0x1000) // 16KiB
+
+
+void init_gdt();
+
+#endif
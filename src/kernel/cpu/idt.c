@@ -0,0 +1,148 @@
+#include "idt.h"
+#include "../log.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include <stddef.h>
+
+
+// Interrupt gate, present, ring 0 (interrupts stay disabled while the handler runs)
+#define INTERRUPT_GATE 0x8e
+
+typedef struct __attribute__((packed)) {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  ist;
+    uint8_t  flags;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} idt_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t limit;
+    uint64_t base;
+} idt_pointer_t;
+
+static inline void set_idt_entry(uint8_t vector, uint64_t stub, uint8_t ist);
+
+void interrupt_dispatch(interrupt_frame_t* frame);
+
+
+// Defined in interrupts.asm
+extern const uint64_t interrupt_stubs[IDT_ENTRIES];
+
+static const char* exception_names[EXCEPTIONS_NUMBER] = {
+    "Division error",
+    "Debug",
+    "Non-maskable interrupt",
+    "Breakpoint",
+    "Overflow",
+    "Bound range exceeded",
+    "Invalid opcode",
+    "Device not available",
+    "Double fault",
+    "Coprocessor segment overrun",
+    "Invalid TSS",
+    "Segment not present",
+    "Stack-segment fault",
+    "General protection fault",
+    "Page fault",
+    "Reserved",
+    "x87 floating-point exception",
+    "Alignment check",
+    "Machine check",
+    "SIMD floating-point exception",
+    "Virtualization exception",
+    "Control protection exception",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Hypervisor injection exception",
+    "VMM communication exception",
+    "Security exception",
+    "Reserved",
+};
+
+static idt_entry_t         idt[IDT_ENTRIES];
+static interrupt_handler_t handlers[IDT_ENTRIES];
+
+
+// required to handle cpu exceptions and interrupts
+// init_gdt has to be called before, the double and page fault handlers use interrupt stacks
+void init_idt() {
+    for (size_t vector = 0; vector < IDT_ENTRIES; vector++)
+        set_idt_entry(vector, interrupt_stubs[vector], 0);
+
+    set_idt_entry(DOUBLE_FAULT_VECTOR, interrupt_stubs[DOUBLE_FAULT_VECTOR], IST_DOUBLE_FAULT);
+    set_idt_entry(PAGE_FAULT_VECTOR, interrupt_stubs[PAGE_FAULT_VECTOR], IST_PAGE_FAULT);
+
+    load_idt();
+    DEBUG("IDT initialized (idt = %p)\n", idt);
+}
+
+// The idt is shared, the other cpus only load it (after their own init_gdt)
+void load_idt() {
+    idt_pointer_t pointer = {.limit = sizeof(idt) - 1, .base = (uint64_t)idt};
+    __asm__ volatile("lidt %0" ::"m"(pointer) : "memory");
+}
+
+// The handler is called with the registers saved when the interrupt happened
+void set_interrupt_handler(uint8_t vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+// Called by the interrupt stubs
+// Exceptions without a handler dump the registers and panic, other interrupts are only reported
+void interrupt_dispatch(interrupt_frame_t* frame) {
+    interrupt_handler_t handler = handlers[frame->vector];
+    if (handler != NULL) {
+        handler(frame);
+        return;
+    }
+
+    if (frame->vector >= EXCEPTIONS_NUMBER) {
+        LOG("Unhandled interrupt %d on cpu %d\n", frame->vector, get_cpu_id());
+
+        // spurious interrupts must not be acknowledged, the EOI would end another interrupt
+        if (frame->vector != APIC_SPURIOUS_VECTOR) send_apic_eoi();
+        return;
+    }
+
+    print_interrupt_frame(frame);
+    PANIC("Unhandled exception %d (%s)\n", frame->vector, exception_names[frame->vector]);
+}
+
+// Dumps the registers saved by the interrupt stub, used before panicking
+void print_interrupt_frame(const interrupt_frame_t* frame) {
+    printf(
+        "Vector %d (%s) on cpu %d, error code = %p\n",
+        frame->vector,
+        frame->vector < EXCEPTIONS_NUMBER ? exception_names[frame->vector] : "interrupt",
+        get_cpu_id(),
+        frame->error_code
+    );
+    printf("rip = %p cs = %p rflags = %p\n", frame->rip, frame->cs, frame->rflags);
+    printf("rsp = %p ss = %p\n", frame->rsp, frame->ss);
+    printf("rax = %p rbx = %p rcx = %p\n", frame->rax, frame->rbx, frame->rcx);
+    printf("rdx = %p rsi = %p rdi = %p\n", frame->rdx, frame->rsi, frame->rdi);
+    printf("rbp = %p r8  = %p r9  = %p\n", frame->rbp, frame->r8, frame->r9);
+    printf("r10 = %p r11 = %p r12 = %p\n", frame->r10, frame->r11, frame->r12);
+    printf("r13 = %p r14 = %p r15 = %p\n", frame->r13, frame->r14, frame->r15);
+    printf("cr2 = %p cr3 = %p\n", read_cr2(), read_cr3());
+}
+
+
+static inline void set_idt_entry(uint8_t vector, uint64_t stub, uint8_t ist) {
+    idt[vector] = (idt_entry_t){
+        .offset_low  = stub & 0xffff,
+        .selector    = KERNEL_CODE_SELECTOR,
+        .ist         = ist,
+        .flags       = INTERRUPT_GATE,
+        .offset_mid  = (stub >> 16) & 0xffff,
+        .offset_high = stub >> 32,
+    };
+}
@@ -0,0 +1,32 @@
+#ifndef CPU_IDT_H
+#define CPU_IDT_H
+
+#include <stdint.h>
+
+
+#define IDT_ENTRIES 256
+
+// Cpu exceptions use the first 32 vectors
+#define EXCEPTIONS_NUMBER         32
+#define DOUBLE_FAULT_VECTOR       8
+#define GENERAL_PROTECTION_VECTOR 13
+#define PAGE_FAULT_VECTOR         14
+
+// Registers saved by the interrupt stubs (see interrupts.asm), in reverse push order
+typedef struct {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code; // 0 if the exception does not push one
+    uint64_t rip, cs, rflags, rsp, ss;
+} interrupt_frame_t;
+
+typedef void (*interrupt_handler_t)(interrupt_frame_t* frame);
+
+
+void init_idt();
+void load_idt();
+void set_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
+void print_interrupt_frame(const interrupt_frame_t* frame);
+
+#endif
@@ -0,0 +1,76 @@
+; Interrupt entry points, one for each of the 256 vectors
+; every stub pushes the same frame (see interrupt_frame_t in idt.h) and calls interrupt_dispatch
+
+global interrupt_stubs
+
+section .text
+bits 64
+
+extern interrupt_dispatch
+
+; The cpu pushes an error code only for some exceptions, a 0 is pushed for the other vectors
+%macro interrupt_stub 1
+interrupt_stub_%+%1:
+%if %1 != 8 && %1 != 10 && %1 != 11 && %1 != 12 && %1 != 13 && %1 != 14 && %1 != 17 && %1 != 21 && %1 != 29 && %1 != 30
+    push 0          ; error code
+%endif
+    push %1         ; vector
+    jmp interrupt_common
+%endmacro
+
+%assign vector 0
+%rep 256
+    interrupt_stub vector
+%assign vector vector + 1
+%endrep
+
+interrupt_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    ; the cpu aligned the stack before pushing its frame, 22 qwords keep it aligned to 16 bytes
+    mov rdi, rsp    ; interrupt_frame_t*
+    cld
+    call interrupt_dispatch
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    add rsp, 16     ; vector and error code
+    iretq
+
+section .rodata
+
+; Addresses of the stubs, indexed by vector
+interrupt_stubs:
+%assign vector 0
+%rep 256
+    dq interrupt_stub_%+vector
+%assign vector vector + 1
+%endrep
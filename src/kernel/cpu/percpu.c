@@ -0,0 +1,32 @@
+#include "percpu.h"
+#include "../log.h"
+#include "cpu.h"
+
+
+#define GS_BASE_MSR 0xC0000101
+
+
+static cpu_t cpus[MAX_CPUS];
+
+
+// required to use the other functions (and get_cpu_id) on the running cpu
+// Each cpu calls it once, before anything that uses per-cpu state (like the frame caches)
+void init_percpu(uint32_t id, uint32_t apic_id, void* stack_top) {
+    if (id >= MAX_CPUS) PANIC("Cpu id (%d) exceeds maximum allowed (%d)", id, MAX_CPUS);
+
+    cpus[id] = (cpu_t){
+        .self      = &cpus[id],
+        .id        = id,
+        .apic_id   = apic_id,
+        .stack_top = stack_top,
+    };
+    write_msr(GS_BASE_MSR, (uint64_t)&cpus[id]);
+}
+
+cpu_t* get_cpu(uint32_t id) { return &cpus[id]; }
+
+cpu_t* get_running_cpu() {
+    cpu_t* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
@@ -0,0 +1,32 @@
+#ifndef CPU_PERCPU_H
+#define CPU_PERCPU_H
+
+#include <stdint.h>
+
+
+struct thread_t;
+
+// Data owned by a single cpu, the GS base of every cpu points to its own block
+typedef struct cpu_t {
+    struct cpu_t* self; // at gs:0, so the block address can be read without rdmsr
+    uint32_t      id;   // index in the cpus array, 0 is the bootstrap cpu
+    uint32_t      apic_id;
+    void*         stack_top;
+    uint64_t      ticks; // timer interrupts received
+
+    // Physical address of the table4 loaded by switch_address_space, NULL before the first switch
+    const void* table4;
+
+    // Scheduler state (see scheduler.c), thread is NULL until the cpu runs the scheduler
+    struct thread_t* thread;
+    struct thread_t* idle_thread;
+    struct thread_t* previous_thread; // the thread switched away from, until finish_switch
+    uint64_t         slice_start;     // ticks when the running thread was switched to
+} cpu_t;
+
+
+void   init_percpu(uint32_t id, uint32_t apic_id, void* stack_top);
+cpu_t* get_cpu(uint32_t id);
+cpu_t* get_running_cpu();
+
+#endif
@@ -0,0 +1,171 @@
+#include "smp.h"
+#include "../acpi/acpi.h"
+#include "../acpi/madt.h"
+#include "../drivers/pit.h"
+#include "../lib/mem.h"
+#include "../log.h"
+#include "../mm/paging/page.h"
+#include "../mm/paging/paging.h"
+#include "../mm/vma/vmalloc.h"
+#include "../sched/scheduler.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "percpu.h"
+#include "timer.h"
+#include "tlb.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// No cpu is being started (see starting_cpu)
+#define NO_STARTING_CPU UINT32_MAX
+
+// Read by the trampoline (see smp_trampoline_data in trampoline.asm)
+typedef struct __attribute__((packed)) {
+    uint64_t table4;
+    uint64_t stack_top;
+    uint64_t entry;
+    uint64_t cpu_id;
+} trampoline_data_t;
+
+static inline bool start_cpu(uint32_t id, uint32_t apic_id);
+static void        ap_main(uint32_t id, void* stack_top);
+
+
+// Defined in trampoline.asm
+extern const uint8_t smp_trampoline_start[];
+extern const uint8_t smp_trampoline_data[];
+extern const uint8_t smp_trampoline_end[];
+
+static size_t cpus_number = 1;
+
+// Id of the cpu being started, the cpu takes it (sets NO_STARTING_CPU) before touching anything
+// On timeout the bootstrap cpu tries to take it back, only one of them can succeed
+static uint32_t starting_cpu = NO_STARTING_CPU;
+
+// Set by the starting cpu once it is initialized
+static bool cpu_started;
+
+
+// Starts the other cpus listed in the ACPI MADT, one at a time
+// init_mm has to be called before, every cpu gets a kernel stack and runs in the kernel table4
+// The local APIC timer is started on every cpu, interrupts stay disabled on the bootstrap cpu
+void init_smp() {
+    init_acpi();
+    init_madt();
+
+    uint32_t apic_ids[MAX_CPUS];
+    size_t   apic_ids_size = get_local_apic_ids(apic_ids);
+
+    init_apic(get_local_apic_address());
+    enable_apic();
+    get_running_cpu()->apic_id = get_apic_id();
+
+    // the cpus flush each other's TLB when pages are unmapped
+    init_tlb_shootdown();
+    enable_tlb_shootdown();
+
+    // the other cpus reuse the calibration
+    init_timer();
+
+    // the trampoline switches on paging while running from its physical address
+    page_t trampoline_page = {.fields.address = SMP_TRAMPOLINE_ADDRESS / PAGE_SIZE};
+    map_page_to_frame(trampoline_page, 0, (void*)SMP_TRAMPOLINE_ADDRESS, allocate_frame);
+    memcpy(
+        PHYS_TO_VIRT(SMP_TRAMPOLINE_ADDRESS),
+        smp_trampoline_start,
+        smp_trampoline_end - smp_trampoline_start
+    );
+
+    for (size_t i = 0; i < apic_ids_size; i++)
+        if (apic_ids[i] != get_running_cpu()->apic_id && start_cpu(cpus_number, apic_ids[i]))
+            cpus_number++;
+
+    // the frame goes back to the frame allocator once every cpu dropped the mapping
+    unmap_page(trampoline_page, deallocate_frame, true);
+
+    LOG("%d cpus online\n", cpus_number);
+}
+
+size_t get_cpus_number() { return cpus_number; }
+
+
+// INIT-SIPI-SIPI sequence, returns false if the cpu did not start before the timeout
+// A cpu that did not start in time is sent an INIT again, so it waits for a startup interrupt
+// instead of running the trampoline while it is reused for the next cpu (or freed)
+static inline bool start_cpu(uint32_t id, uint32_t apic_id) {
+    void* stack_top = allocate_kernel_stack();
+    if (stack_top == NULL) PANIC("Cannot allocate the stack of cpu %d", id);
+
+    trampoline_data_t* data = PHYS_TO_VIRT(
+        SMP_TRAMPOLINE_ADDRESS + (smp_trampoline_data - smp_trampoline_start)
+    );
+    *data = (trampoline_data_t){
+        .table4    = read_cr3() & CR3_ADDRESS_MASK,
+        .stack_top = (uint64_t)stack_top,
+        .entry     = (uint64_t)ap_main,
+        .cpu_id    = id,
+    };
+    __atomic_store_n(&cpu_started, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&starting_cpu, id, __ATOMIC_RELEASE);
+
+    DEBUG("Starting cpu %d (apic id = %d)\n", id, apic_id);
+    send_init_ipi(apic_id);
+    pit_wait(SMP_INIT_DELAY);
+
+    // the second startup interrupt is ignored if the first one worked
+    for (size_t i = 0; i < 2 && !__atomic_load_n(&cpu_started, __ATOMIC_ACQUIRE); i++) {
+        send_startup_ipi(apic_id, SMP_TRAMPOLINE_ADDRESS / PAGE_SIZE);
+        pit_wait(SMP_STARTUP_DELAY);
+    }
+
+    for (size_t waited = 0; waited < SMP_STARTUP_TIMEOUT; waited += SMP_STARTUP_DELAY) {
+        if (__atomic_load_n(&cpu_started, __ATOMIC_ACQUIRE)) return true;
+        pit_wait(SMP_STARTUP_DELAY);
+    }
+
+    // the cpu took its id just now, it is past the trampoline and finishes its initialization
+    uint32_t expected = id;
+    if (!__atomic_compare_exchange_n(
+            &starting_cpu, &expected, NO_STARTING_CPU, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+        )) {
+        while (!__atomic_load_n(&cpu_started, __ATOMIC_ACQUIRE)) pit_wait(SMP_STARTUP_DELAY);
+        return true;
+    }
+
+    // the stack is leaked, the cpu may have started using it before the INIT
+    send_init_ipi(apic_id);
+    pit_wait(SMP_INIT_DELAY);
+    LOG("Cpu with apic id %d did not start\n", apic_id);
+    return false;
+}
+
+// Called by the trampoline on the new cpu's kernel stack
+// The paging bits enabled by remap_kernel on the bootstrap cpu are enabled here too
+static void ap_main(uint32_t id, void* stack_top) {
+    // the bootstrap cpu gave up on this cpu, the trampoline data may already be another cpu's
+    uint32_t expected = id;
+    if (!__atomic_compare_exchange_n(
+            &starting_cpu, &expected, NO_STARTING_CPU, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+        ))
+        halt_forever();
+
+    init_percpu(id, get_apic_id(), stack_top);
+    init_gdt();
+    load_idt();
+
+    enable_write_protect_bit();
+    enable_global_pages();
+    enable_pcid();
+    enable_apic();
+    enable_tlb_shootdown();
+    start_timer();
+
+    LOG("Cpu %d online (apic id = %d)\n", id, get_running_cpu()->apic_id);
+    __atomic_store_n(&cpu_started, true, __ATOMIC_RELEASE);
+
+    // the cpu runs the threads in its run queue or steals them from the other cpus
+    run_scheduler();
+}
@@ -0,0 +1,20 @@
+#ifndef CPU_SMP_H
+#define CPU_SMP_H
+
+#include <stddef.h>
+
+
+// Application processors start executing the trampoline copied here (see trampoline.asm)
+// The frame is kept out of the frame allocator
+#define SMP_TRAMPOLINE_ADDRESS 0x8000
+
+// Waits after sending the startup interrupts (the timeout is for each cpu)
+#define SMP_INIT_DELAY      10000  // 10ms
+#define SMP_STARTUP_DELAY   200    // 200us
+#define SMP_STARTUP_TIMEOUT 100000 // 100ms
+
+
+void   init_smp();
+size_t get_cpus_number();
+
+#endif
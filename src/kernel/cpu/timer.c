@@ -0,0 +1,79 @@
+#include "timer.h"
+#include "../drivers/pit.h"
+#include "../log.h"
+#include "apic.h"
+#include "cpu.h"
+#include "percpu.h"
+#include <stddef.h>
+
+
+#define MICROSECONDS 1000000
+#define NANOSECONDS  1000000000
+
+static inline void handle_tick(interrupt_frame_t* frame);
+
+
+// Local APIC timer counts in a tick, it is the same on every cpu
+static uint32_t       apic_timer_ticks;
+static uint64_t       tsc_frequency;
+static tick_handler_t tick_handler;
+
+
+// required to use the other functions
+// Measures the local APIC timer and TSC rates against the PIT, then starts the bootstrap cpu timer
+// init_apic has to be called before, interrupts must be disabled during the calibration
+void init_timer() {
+    set_interrupt_handler(TIMER_VECTOR, handle_tick);
+
+    // counting down from the maximum, the timer does not reach 0 during the calibration
+    uint64_t tsc_start = read_tsc();
+    start_apic_timer(TIMER_VECTOR, APIC_TIMER_MAX_COUNT, false);
+    pit_wait(TIMER_CALIBRATION_TIME);
+    uint32_t apic_elapsed = APIC_TIMER_MAX_COUNT - get_apic_timer_count();
+    uint64_t tsc_elapsed  = read_tsc() - tsc_start;
+
+    apic_timer_ticks = (uint64_t)apic_elapsed * MICROSECONDS / TIMER_CALIBRATION_TIME
+                     / TIMER_FREQUENCY;
+    tsc_frequency = tsc_elapsed * MICROSECONDS / TIMER_CALIBRATION_TIME;
+    if (apic_timer_ticks == 0) PANIC("Local APIC timer calibration failed");
+
+    DEBUG(
+        "Timer calibrated (apic timer ticks = %d, tsc frequency = %d KHz)\n",
+        apic_timer_ticks,
+        tsc_frequency / 1000
+    );
+    start_timer();
+}
+
+// Starts the periodic timer of the running cpu, init_timer has to be called before
+void start_timer() { start_apic_timer(TIMER_VECTOR, apic_timer_ticks, true); }
+
+// The handler runs with interrupts disabled, on the stack of the interrupted code
+void set_tick_handler(tick_handler_t handler) { tick_handler = handler; }
+
+// Returns the ticks since the bootstrap cpu timer was started
+uint64_t get_ticks() { return __atomic_load_n(&get_cpu(0)->ticks, __ATOMIC_RELAXED); }
+
+// Returns the ticks received by the running cpu
+uint64_t get_cpu_ticks() { return get_running_cpu()->ticks; }
+
+uint64_t get_tsc_frequency() { return tsc_frequency; }
+
+// Returns the nanoseconds since the cpu was reset, with the precision of the TSC
+uint64_t get_time_ns() { return tsc_to_ns(read_tsc()); }
+
+// Converts TSC cycles to nanoseconds, returns 0 until init_timer has measured the TSC frequency
+uint64_t tsc_to_ns(uint64_t tsc) {
+    if (tsc_frequency == 0) return 0;
+
+    // split so that tsc * NANOSECONDS does not overflow
+    return tsc / tsc_frequency * NANOSECONDS + tsc % tsc_frequency * NANOSECONDS / tsc_frequency;
+}
+
+
+static inline void handle_tick(interrupt_frame_t* frame) {
+    __atomic_add_fetch(&get_running_cpu()->ticks, 1, __ATOMIC_RELAXED);
+    send_apic_eoi();
+
+    if (tick_handler != NULL) tick_handler(frame);
+}
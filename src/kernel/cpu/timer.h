@@ -0,0 +1,26 @@
+#ifndef CPU_TIMER_H
+#define CPU_TIMER_H
+
+#include "idt.h"
+#include <stdint.h>
+
+
+// Every cpu gets a local APIC timer interrupt TIMER_FREQUENCY times per second
+#define TIMER_VECTOR           0x20 // first vector after the exceptions
+#define TIMER_FREQUENCY        1000 // 1ms ticks
+#define TIMER_CALIBRATION_TIME 10000 // 10ms, measured with the PIT
+
+// Called on every tick of every cpu, after the interrupt has been acknowledged
+typedef void (*tick_handler_t)(interrupt_frame_t* frame);
+
+
+void     init_timer();
+void     start_timer();
+void     set_tick_handler(tick_handler_t handler);
+uint64_t get_ticks();
+uint64_t get_cpu_ticks();
+uint64_t get_tsc_frequency();
+uint64_t get_time_ns();
+uint64_t tsc_to_ns(uint64_t tsc);
+
+#endif
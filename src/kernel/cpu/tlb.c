@@ -0,0 +1,145 @@
+#include "tlb.h"
+#include "../log.h"
+#include "../mm/paging/addrspace.h"
+#include "../sync/spinlock.h"
+#include "apic.h"
+#include "cpu.h"
+#include "idt.h"
+#include "percpu.h"
+
+
+// A flush asked by a cpu to the other ones, shootdown_lock lets one request run at a time
+typedef struct {
+    uint8_t* start;
+    size_t   pages;  // above FLUSH_TLB_THRESHOLD every entry of the address space is flushed
+    bool     global; // kernel pages, they are cached by every cpu, whatever its address space
+    uint64_t table4; // physical address of the address space the pages belong to
+    uint16_t pcid;
+} tlb_request_t;
+
+static inline void send_request(const tlb_request_t* new_request);
+static inline void flush_request(const tlb_request_t* request);
+static inline void handle_shootdown(interrupt_frame_t* frame);
+
+
+// Cpus getting the shootdowns (see enable_tlb_shootdown), one bit for each cpu id
+static uint64_t online_cpus;
+
+// A set bit marks a cpu that has not flushed the current request yet
+static uint64_t      pending_cpus;
+static tlb_request_t request;
+static spinlock_t    shootdown_lock = SPINLOCK_INIT;
+
+// Set while the cpu flushes: the flush functions print, and waiting for the tty lock can reach
+// answer_tlb_shootdown again (see cpu_relax)
+static bool answering[MAX_CPUS];
+
+
+// required to send shootdowns to the other cpus
+// init_apic has to be called before, enable_tlb_shootdown has to be called on every cpu
+void init_tlb_shootdown() {
+    set_interrupt_handler(TLB_SHOOTDOWN_VECTOR, handle_shootdown);
+    DEBUG("TLB shootdown handler set (vector = %p)\n", TLB_SHOOTDOWN_VECTOR);
+}
+
+// The running cpu gets the shootdowns from now on, its local APIC has to be enabled
+// The whole TLB is flushed after joining, the requests sent before may have missed the cpu
+void enable_tlb_shootdown() {
+    __atomic_or_fetch(&online_cpus, 1ull << get_cpu_id(), __ATOMIC_SEQ_CST);
+    flush_tlb_all();
+}
+
+// Invalidates pages of the running address space (or global ones) on every cpu
+// When it returns no cpu can use the old entries, so the frames they pointed to can be freed
+void shootdown_tlb_pages(void* start, size_t pages, bool global) {
+    uint64_t cr3 = read_cr3();
+    send_request(&(tlb_request_t){
+        .start  = start,
+        .pages  = pages,
+        .global = global,
+        .table4 = cr3 & CR3_ADDRESS_MASK,
+        .pcid   = cr3 & CR3_PCID_MASK,
+    });
+}
+
+// Invalidates every non global entry of the address space on every cpu, even if it is not running
+void shootdown_address_space(const void* table4, uint16_t pcid) {
+    send_request(&(tlb_request_t){.pages = SIZE_MAX, .table4 = (uint64_t)table4, .pcid = pcid});
+}
+
+// Flushes the request sent to the running cpu, if there is one
+// Called by the interrupt handler and by cpu_relax: the sender may wait with interrupts disabled
+// for a lock held by a cpu that spins with interrupts disabled too
+void answer_tlb_shootdown() {
+    if (__atomic_load_n(&pending_cpus, __ATOMIC_ACQUIRE) == 0) return;
+
+    uint64_t rflags = disable_interrupts();
+    uint32_t id     = get_cpu_id();
+    uint64_t bit    = 1ull << id;
+
+    if (!answering[id] && (__atomic_load_n(&pending_cpus, __ATOMIC_ACQUIRE) & bit) != 0) {
+        answering[id] = true;
+        flush_request(&request);
+        answering[id] = false;
+
+        // the request can be replaced as soon as the bit is cleared
+        __atomic_and_fetch(&pending_cpus, ~bit, __ATOMIC_RELEASE);
+    }
+
+    restore_interrupts(rflags);
+}
+
+
+// Flushes the running cpu, then interrupts the other online cpus and waits for all of them
+static inline void send_request(const tlb_request_t* new_request) {
+    // the requests of the other cpus are answered while waiting for the lock (see cpu_relax)
+    uint64_t rflags  = spin_lock_irqsave(&shootdown_lock);
+    uint64_t targets = __atomic_load_n(&online_cpus, __ATOMIC_SEQ_CST) & ~(1ull << get_cpu_id());
+
+    flush_request(new_request);
+
+    if (targets != 0) {
+        request = *new_request;
+        __atomic_store_n(&pending_cpus, targets, __ATOMIC_SEQ_CST);
+
+        for (uint32_t id = 0; id < MAX_CPUS; id++)
+            if ((targets & (1ull << id)) != 0)
+                send_fixed_ipi(get_cpu(id)->apic_id, TLB_SHOOTDOWN_VECTOR);
+
+        while (__atomic_load_n(&pending_cpus, __ATOMIC_ACQUIRE) != 0) cpu_relax();
+    }
+
+    spin_unlock_irqrestore(&shootdown_lock, rflags);
+}
+
+static inline void flush_request(const tlb_request_t* request) {
+    bool flush_all = request->pages > FLUSH_TLB_THRESHOLD;
+
+    // invlpg drops global entries too, a non global flush would leave them in the TLB
+    if (request->global) {
+        if (flush_all) flush_tlb_all();
+        else
+            for (size_t i = 0; i < request->pages; i++)
+                flush_tlb_page(request->start + i * PAGE_SIZE);
+    }
+    else if ((read_cr3() & CR3_ADDRESS_MASK) == request->table4) {
+        if (flush_all) flush_tlb();
+        else
+            for (size_t i = 0; i < request->pages; i++)
+                flush_tlb_page(request->start + i * PAGE_SIZE);
+    }
+    // the entries tagged with a PCID outlive the switch to another address space
+    else if (request->pcid != KERNEL_PCID) {
+        if (flush_all) invalidate_pcid(request->pcid);
+        else
+            for (size_t i = 0; i < request->pages; i++)
+                invalidate_pcid_page(request->pcid, request->start + i * PAGE_SIZE);
+    }
+}
+
+static inline void handle_shootdown(interrupt_frame_t* frame) {
+    (void)frame;
+
+    answer_tlb_shootdown();
+    send_apic_eoi();
+}
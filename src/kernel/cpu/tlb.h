@@ -0,0 +1,22 @@
+#ifndef CPU_TLB_H
+#define CPU_TLB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Other cpus are asked to flush their TLB with an interrupt on this vector
+#define TLB_SHOOTDOWN_VECTOR 0xfe // right below the spurious vector
+
+// Above this number of pages the TLB is flushed instead of single pages
+#define FLUSH_TLB_THRESHOLD 32
+
+
+void init_tlb_shootdown();
+void enable_tlb_shootdown();
+void shootdown_tlb_pages(void* start, size_t pages, bool global);
+void shootdown_address_space(const void* table4, uint16_t pcid);
+void answer_tlb_shootdown();
+
+#endif
@@ -0,0 +1,101 @@
+; Application processors start here, in real mode, after the startup interrupt
+; the code is copied to TRAMPOLINE_ADDRESS (below 1MiB) by start_cpus (see smp.c)
+; it switches to long mode with the kernel table4 and jumps to the higher half
+; the trampoline page is identity mapped in the kernel table4 while cpus are starting
+
+global smp_trampoline_start
+global smp_trampoline_data
+global smp_trampoline_end
+
+TRAMPOLINE_ADDRESS equ 0x8000 ; SMP_TRAMPOLINE_ADDRESS in smp.h
+
+; Address of a trampoline label once it is copied
+%define TRAMPOLINE(label) (label - smp_trampoline_start + TRAMPOLINE_ADDRESS)
+
+CODE64_SELECTOR equ 0x08 ; the same as KERNEL_CODE_SELECTOR
+CODE32_SELECTOR equ 0x10
+DATA32_SELECTOR equ 0x18
+
+; it is never executed in place
+section .rodata
+
+bits 16
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMPOLINE(trampoline_gdt_pointer)]
+
+    ; enable protected mode
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword CODE32_SELECTOR:TRAMPOLINE(trampoline_protected_mode)
+
+bits 32
+trampoline_protected_mode:
+    mov ax, DATA32_SELECTOR
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; enable PAE-flag in cr4 (Physical Address Extension)
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    mov eax, [TRAMPOLINE(smp_trampoline_data.table4)]
+    mov cr3, eax
+
+    ; set the long mode bit and the no execute bit in the EFER MSR
+    ; the kernel pages are marked no execute, without NXE the bit would be reserved
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, (1 << 8) | (1 << 11)
+    wrmsr
+
+    ; enable paging in the cr0 register
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+
+    jmp CODE64_SELECTOR:TRAMPOLINE(trampoline_long_mode)
+
+bits 64
+trampoline_long_mode:
+    ; load 0 into all data segment registers, the kernel gdt has no data segments
+    xor eax, eax
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [TRAMPOLINE(smp_trampoline_data.stack_top)]
+    mov rdi, [TRAMPOLINE(smp_trampoline_data.cpu_id)]
+    mov rsi, rsp
+    mov rax, [TRAMPOLINE(smp_trampoline_data.entry)]
+    call rax
+
+    hlt
+
+align 8
+trampoline_gdt:
+    dq 0 ; zero entry
+    dq (1<<43) | (1<<44) | (1<<47) | (1<<53) ; 64 bit code segment
+    dq 0x00cf9a000000ffff ; 32 bit code segment, 4GiB
+    dq 0x00cf92000000ffff ; 32 bit data segment, 4GiB
+trampoline_gdt_end:
+trampoline_gdt_pointer:
+    dw trampoline_gdt_end - trampoline_gdt - 1
+    dd TRAMPOLINE(trampoline_gdt)
+
+; Filled in before each cpu is started (see trampoline_data_t in smp.c)
+align 8
+smp_trampoline_data:
+.table4:    dq 0 ; physical address, below 4GiB
+.stack_top: dq 0
+.entry:     dq 0 ; called with the cpu id and the stack top
+.cpu_id:    dq 0
+smp_trampoline_end:
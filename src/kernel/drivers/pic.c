@@ -0,0 +1,49 @@
+#include "pic.h"
+#include "../cpu/cpu.h"
+#include "../cpu/idt.h"
+
+
+#define PIC_MASTER_COMMAND_PORT 0x20
+#define PIC_MASTER_DATA_PORT    0x21
+#define PIC_SLAVE_COMMAND_PORT  0xa0
+#define PIC_SLAVE_DATA_PORT     0xa1
+
+// Initialization command words
+#define PIC_ICW1_INIT      0x11 // initialization, ICW4 follows
+#define PIC_ICW3_SLAVE_IRQ 0x4  // the slave is connected to irq 2 of the master
+#define PIC_ICW3_SLAVE_ID  0x2
+#define PIC_ICW4_8086      0x1
+#define PIC_MASK_ALL       0xff
+
+#define PIC_EOI            0x20
+#define PIC_SPURIOUS_IRQ   7 // the lowest priority irq of each PIC, raised when an irq goes away
+
+static inline void handle_spurious_irq(interrupt_frame_t* frame);
+
+
+// Remaps the PICs away from the exception vectors and masks all their interrupts
+// Interrupts are then delivered by the local APICs, only spurious irqs can still come from the PICs
+void disable_pic() {
+    write_port_byte(PIC_MASTER_COMMAND_PORT, PIC_ICW1_INIT);
+    write_port_byte(PIC_SLAVE_COMMAND_PORT, PIC_ICW1_INIT);
+    write_port_byte(PIC_MASTER_DATA_PORT, PIC_MASTER_VECTOR);
+    write_port_byte(PIC_SLAVE_DATA_PORT, PIC_SLAVE_VECTOR);
+    write_port_byte(PIC_MASTER_DATA_PORT, PIC_ICW3_SLAVE_IRQ);
+    write_port_byte(PIC_SLAVE_DATA_PORT, PIC_ICW3_SLAVE_ID);
+    write_port_byte(PIC_MASTER_DATA_PORT, PIC_ICW4_8086);
+    write_port_byte(PIC_SLAVE_DATA_PORT, PIC_ICW4_8086);
+
+    write_port_byte(PIC_MASTER_DATA_PORT, PIC_MASK_ALL);
+    write_port_byte(PIC_SLAVE_DATA_PORT, PIC_MASK_ALL);
+
+    set_interrupt_handler(PIC_MASTER_VECTOR + PIC_SPURIOUS_IRQ, handle_spurious_irq);
+    set_interrupt_handler(PIC_SLAVE_VECTOR + PIC_SPURIOUS_IRQ, handle_spurious_irq);
+}
+
+
+// Spurious irqs are not in service, so they get no EOI (and the local APIC did not deliver them)
+// The master did see a real irq from the slave though, when the slave sends a spurious one
+static inline void handle_spurious_irq(interrupt_frame_t* frame) {
+    if (frame->vector == PIC_SLAVE_VECTOR + PIC_SPURIOUS_IRQ)
+        write_port_byte(PIC_MASTER_COMMAND_PORT, PIC_EOI);
+}
@@ -0,0 +1,12 @@
+#ifndef PIC_H
+#define PIC_H
+
+
+// The legacy 8259 PICs are not used, but they can still raise spurious interrupts
+// They are moved to these vectors, so they do not look like cpu exceptions
+#define PIC_MASTER_VECTOR 0xe0
+#define PIC_SLAVE_VECTOR  0xe8
+
+void disable_pic();
+
+#endif
@@ -0,0 +1,37 @@
+#include "pit.h"
+#include "../cpu/cpu.h"
+
+
+#define PIT_CHANNEL2_PORT 0x42
+#define PIT_COMMAND_PORT  0x43
+#define PIT_GATE_PORT     0x61 // keyboard controller port B, it also drives channel 2
+
+// Channel 2, low and high byte, mode 0 (the output goes high when the count reaches 0)
+#define PIT_CHANNEL2_ONE_SHOT 0xb0
+
+#define PIT_GATE    0x1
+#define PIT_SPEAKER 0x2
+#define PIT_OUTPUT  0x20
+
+// The counter is 16 bits wide (about 54ms)
+#define PIT_MAX_WAIT 50000
+
+
+// Busy waits using channel 2, interrupts are not needed
+void pit_wait(uint32_t microseconds) {
+    while (microseconds > 0) {
+        uint32_t wait  = microseconds < PIT_MAX_WAIT ? microseconds : PIT_MAX_WAIT;
+        uint16_t count = (uint64_t)wait * PIT_FREQUENCY / 1000000;
+
+        // the count starts when the gate goes high, the speaker stays off
+        uint8_t gate = read_port_byte(PIT_GATE_PORT) & ~(PIT_GATE | PIT_SPEAKER);
+        write_port_byte(PIT_GATE_PORT, gate);
+        write_port_byte(PIT_COMMAND_PORT, PIT_CHANNEL2_ONE_SHOT);
+        write_port_byte(PIT_CHANNEL2_PORT, count & 0xff);
+        write_port_byte(PIT_CHANNEL2_PORT, count >> 8);
+        write_port_byte(PIT_GATE_PORT, gate | PIT_GATE);
+
+        while ((read_port_byte(PIT_GATE_PORT) & PIT_OUTPUT) == 0) cpu_relax();
+        microseconds -= wait;
+    }
+}
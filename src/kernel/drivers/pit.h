@@ -0,0 +1,13 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+
+
+// The programmable interval timer counts at a fixed frequency, so it is used to measure delays
+// before any other timer is calibrated
+#define PIT_FREQUENCY 1193182
+
+void pit_wait(uint32_t microseconds);
+
+#endif
@@ -1,14 +1,25 @@
 #include "tty.h"
 #include "../lib/mem.h"
+#include "../mm/paging/page.h"
+#include "../sync/spinlock.h"
 #include <stddef.h>
 #include <stdint.h>
 
 
-static uint16_t* cursor    = (uint16_t*)VGA_MEM_START;
+// The vga buffer is reached through the direct map of physical memory
+#define VGA_BUFFER_START (PHYS_OFFSET + VGA_MEM_START)
+#define VGA_BUFFER_END   (PHYS_OFFSET + VGA_MEM_END)
+
+
+static uint16_t* cursor    = (uint16_t*)VGA_BUFFER_START;
 static uint8_t   vga_color = VGA_BLACK << 4 | VGA_WHITE;
 
+// Every cpu prints, the cursor is only moved with the lock held
+static spinlock_t tty_lock = SPINLOCK_INIT;
+
 
 static inline void print_char_internal(char to_print);
+static inline void clear_screen_internal();
 static inline void scroll(int rows);
 
 static inline void   set_row(size_t row);
@@ -19,36 +30,45 @@ static inline size_t get_col();
 
 void set_color(vga_colors foreground, vga_colors background) {
     // 4 low bits = foreground, 3 high bits = background
-    vga_color = background << 4 | foreground;
+    uint64_t rflags = spin_lock_irqsave(&tty_lock);
+    vga_color       = background << 4 | foreground;
+    spin_unlock_irqrestore(&tty_lock, rflags);
 }
 
 void clear_screen() {
-    // Fills screen with whitespace characters
-    for (uint16_t* pointer = (uint16_t*)VGA_MEM_START; pointer <= (uint16_t*)VGA_MEM_END;
-         pointer++) {
-        *pointer = (VGA_BLACK << 4 | VGA_WHITE) << 8 | 0x20;
-    }
-
-    // Returns cursor pointer to the start of the screen
-    cursor = (uint16_t*)VGA_MEM_START;
+    uint64_t rflags = spin_lock_irqsave(&tty_lock);
+    clear_screen_internal();
+    spin_unlock_irqrestore(&tty_lock, rflags);
 }
 
-void print_char(char to_print) { print_char_internal(to_print); }
+void print_char(char to_print) {
+    uint64_t rflags = spin_lock_irqsave(&tty_lock);
+    print_char_internal(to_print);
+    spin_unlock_irqrestore(&tty_lock, rflags);
+}
 
 void print(const char* str) {
-    char* pointer = (char*)str;
+    char*    pointer = (char*)str;
+    uint64_t rflags  = spin_lock_irqsave(&tty_lock);
+
     // while the string isn't terminated print a character and advance pointer
     while (*pointer != '\0') print_char_internal(*pointer++);
+
+    spin_unlock_irqrestore(&tty_lock, rflags);
 }
 
 void print_line(const char* str) {
-    print(str);
+    char*    pointer = (char*)str;
+    uint64_t rflags  = spin_lock_irqsave(&tty_lock);
+
+    while (*pointer != '\0') print_char_internal(*pointer++);
 
     // if the cursor is at the last row scroll the screen, else go to the next row
     if (get_row() == VGA_ROWS - 1) scroll(1);
     else set_row(get_row() + 1);
 
     set_col(0);
+    spin_unlock_irqrestore(&tty_lock, rflags);
 }
 
 
@@ -57,17 +77,28 @@ static inline void print_char_internal(char to_print) {
 
     // if the end of the vga memory has been reached
     // scroll and set the cursor back to the first column
-    if (cursor == (uint16_t*)VGA_MEM_END) {
+    if (cursor >= (uint16_t*)VGA_BUFFER_END) {
         scroll(1);
         set_col(0);
     }
     else cursor++;
 }
 
+static inline void clear_screen_internal() {
+    // Fills screen with whitespace characters
+    for (uint16_t* pointer = (uint16_t*)VGA_BUFFER_START; pointer <= (uint16_t*)VGA_BUFFER_END;
+         pointer++) {
+        *pointer = (VGA_BLACK << 4 | VGA_WHITE) << 8 | 0x20;
+    }
+
+    // Returns cursor pointer to the start of the screen
+    cursor = (uint16_t*)VGA_BUFFER_START;
+}
+
 static inline void set_row(size_t row) {
 
     // reset the cursor to the start of vga memory + cols
-    cursor = (uint16_t*)VGA_MEM_START + get_col();
+    cursor = (uint16_t*)VGA_BUFFER_START + get_col();
 
     // if the row is valid increase the cursor by 'row' * 80 times
     if (row < VGA_ROWS) cursor += row * VGA_COLS;
@@ -75,7 +106,7 @@ static inline void set_row(size_t row) {
 
 static inline void set_col(size_t col) {
     // reset the cursor to the start of the current row
-    cursor = (uint16_t*)VGA_MEM_START + get_row() * VGA_COLS;
+    cursor = (uint16_t*)VGA_BUFFER_START + get_row() * VGA_COLS;
 
     // if the col is valid increase the cursor by 'col' times
     if (col < VGA_COLS) cursor += col;
@@ -84,13 +115,13 @@ static inline void set_col(size_t col) {
 static inline size_t get_row() {
     // gets the offset and divides it by the number of columns
     // (*2 because each character occupies 2 bytes)
-    return ((size_t)cursor - VGA_MEM_START) / (VGA_COLS * 2);
+    return ((size_t)cursor - VGA_BUFFER_START) / (VGA_COLS * 2);
 }
 
 static inline size_t get_col() {
     // gets the offset and subtracts the offset of the current row
     // (/2 because each character occupies 2 bytes)
-    return ((size_t)cursor - VGA_MEM_START - (get_row() * VGA_COLS * 2)) / 2;
+    return ((size_t)cursor - VGA_BUFFER_START - (get_row() * VGA_COLS * 2)) / 2;
 }
 
 // Copies memory in the vga buffer, making the screen text scroll
@@ -98,7 +129,7 @@ static inline void scroll(int rows) {
 
     // If the rows to scroll are more than the screen size, then clear the screen
     if (rows > VGA_ROWS - 1) {
-        clear_screen();
+        clear_screen_internal();
         return;
     }
 
@@ -107,14 +138,14 @@ static inline void scroll(int rows) {
 
     // Copies the bits from a specified row to the first one
     memcpy(
-        (uint16_t*)VGA_MEM_START,
-        (uint16_t*)((size_t)VGA_MEM_START + (VGA_COLS * rows * 2)),
+        (uint16_t*)VGA_BUFFER_START,
+        (uint16_t*)((size_t)VGA_BUFFER_START + (VGA_COLS * rows * 2)),
         to_copy
     );
 
     // Clears the remaining bottom rows
-    for (uint16_t* pointer = (uint16_t*)(VGA_MEM_START + to_copy);
-         pointer <= (uint16_t*)VGA_MEM_END;
+    for (uint16_t* pointer = (uint16_t*)(VGA_BUFFER_START + to_copy);
+         pointer <= (uint16_t*)VGA_BUFFER_END;
          pointer++) {
         *pointer = (VGA_BLACK << 4 | VGA_WHITE) << 8 | 0x20;
     }
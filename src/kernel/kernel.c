@@ -1,7 +1,14 @@
+#include "./cpu/cpu.h"
+#include "./cpu/gdt.h"
+#include "./cpu/idt.h"
+#include "./cpu/percpu.h"
+#include "./cpu/smp.h"
 #include "./drivers/tty.h"
 #include "./lib/malloc.h"
 #include "./lib/printf.h"
 #include "./mm/mm.h"
+#include "./sched/scheduler.h"
+#include "./selftest/selftest.h"
 #include "log.h"
 
 
@@ -14,15 +21,41 @@
 #endif
 
 
+// Defined in boot.asm
+extern uint8_t stack_top[];
+
+
 void kernel_main(void* multiboot_header) {
     LOG("Kernel booted!\n");
 
+    // The bootstrap cpu is cpu 0, per-cpu state is used from the start (e.g. by frame caches)
+    init_percpu(0, get_initial_apic_id(), stack_top);
+
+    // Cpu exceptions are reported instead of causing a triple fault
+    init_gdt();
+    init_idt();
+
     init_mm(multiboot_header);
 
+    // Timer ticks preempt the threads once a cpu runs the scheduler
+    init_scheduler();
+
+    // The other cpus start in the kernel address space, every cpu gets timer interrupts
+    init_smp();
+    enable_interrupts();
+
     int* x = malloc(sizeof(int));
     int* y = malloc(sizeof(int) * 4);
     DEBUG("Allocated pointer x: %p\n", x);
     DEBUG("Allocated pointer y: %p\n", y);
     free(y);
     free(x);
+
+#ifdef DEBUG_BUILD
+    // make debug checks the allocators, locks and scheduler and prints their benchmarks
+    start_selftests();
+#endif
+
+    // The boot context becomes the idle thread of the bootstrap cpu
+    run_scheduler();
 }
@@ -1,7 +1,34 @@
 #include "malloc.h"
 #include "../mm/heap/allocator.h"
+#include "../mm/heap/slab.h"
+#include "mem.h"
 
 
-void* malloc(size_t size) { return allocate(size); }
+// Small objects are served by the slab allocator, the others by the heap allocator
+// Both give every cpu its own memory, so malloc and free do not serialize the cpus
+// The returned memory is not initialized
+void* malloc(size_t size) {
+    if (size <= SLAB_MAX_SIZE) return slab_allocate(size);
+    return allocate(size);
+}
 
-void free(void* address) { deallocate(address); }
+// Returns zeroed memory for an array of count elements
+// Big allocations are only cleared if the heap does not know them to be zeroed already
+void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) return NULL;
+    size *= count;
+
+    if (size > SLAB_MAX_SIZE) return allocate_zeroed(size);
+
+    void* address = slab_allocate(size);
+    if (address != NULL) memset(address, 0, size);
+    return address;
+}
+
+// Freeing NULL does nothing
+void free(void* address) {
+    if (address == NULL) return;
+
+    if (is_slab_address(address)) slab_deallocate(address);
+    else deallocate(address);
+}
@@ -1,36 +1,155 @@
 #include "mem.h"
+#include "../cpu/cpu.h"
+#include "../mm/paging/page.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Buffers at least this big are handled with string instructions (rep stos / rep movs)
+#define REP_THRESHOLD 128
+
+// CPUID.(EAX=07H, ECX=0H):EBX[9] Enhanced REP MOVSB/STOSB
+#define CPUID_ERMS_BIT 0x200
+
+// Word accesses may be unaligned and may alias any other type
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) word_t;
+
+static inline bool has_erms();
+
+static int erms = -1;
 
 
 void* memset(void* destination, char value, size_t length) {
-    char* dest = (char*)destination;
+    uint8_t* dest = (uint8_t*)destination;
+    uint64_t word = (uint8_t)value * 0x0101010101010101;
 
+    if (length >= REP_THRESHOLD) {
+        // with ERMS a byte sized rep stos is as fast as a word sized one
+        if (has_erms()) {
+            __asm__ volatile("rep stosb" : "+D"(dest), "+c"(length) : "a"(value) : "memory");
+            return destination;
+        }
+
+        // align the destination, then store 8 bytes at a time
+        while (((size_t)dest & 7) != 0) {
+            *dest++ = value;
+            length--;
+        }
+
+        size_t words = length / 8;
+        __asm__ volatile("rep stosq" : "+D"(dest), "+c"(words) : "a"(word) : "memory");
+        length &= 7;
+    }
+
+    for (; length >= 8; length -= 8, dest += 8) *(word_t*)dest = word;
     while (length-- > 0) *dest++ = value;
 
     return destination;
 }
 
 void* memcpy(void* destination, const void* source, size_t length) {
-    char*       dest = (char*)destination;
-    const char* src  = (char*)source;
+    uint8_t*       dest = (uint8_t*)destination;
+    const uint8_t* src  = (const uint8_t*)source;
+
+    if (length >= REP_THRESHOLD) {
+        if (has_erms()) {
+            __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(length)::"memory");
+            return destination;
+        }
 
+        size_t words = length / 8;
+        __asm__ volatile("rep movsq" : "+D"(dest), "+S"(src), "+c"(words)::"memory");
+        length &= 7;
+    }
+
+    for (; length >= 8; length -= 8, dest += 8, src += 8) *(word_t*)dest = *(const word_t*)src;
     while (length-- > 0) *dest++ = *src++;
 
     return destination;
 }
 
 void* memmove(void* destination, const void* source, size_t length) {
-    char*       dest = (char*)destination;
-    const char* src  = (char*)source;
+    uint8_t*       dest = (uint8_t*)destination;
+    const uint8_t* src  = (const uint8_t*)source;
 
     // memmove checks if source and destination buffers overlap
     // if the buffers don't overlap the direction it copies from doesn't matter
 
     // if the source buffer starts before the destination's start copying from the end
-    if (src < dest) {
-        for (int i = length - 1; i >= 0; i--) dest[i] = src[i];
+    if (src < dest && src + length > dest) {
+        dest += length;
+        src  += length;
+
+        for (; length >= 8; length -= 8) {
+            dest           -= 8;
+            src            -= 8;
+            *(word_t*)dest  = *(const word_t*)src;
+        }
+        while (length-- > 0) *--dest = *--src;
     }
     else return memcpy(destination, source, length);
 
 
     return destination;
 }
+
+// Zeroes a 4KiB aligned page using non-temporal stores (movnti)
+// The stores bypass the cache, so zeroing a frame does not evict data that is in use
+void zero_page(void* page) {
+    size_t lines = PAGE_SIZE / 64;
+
+    __asm__ volatile("xor %%eax, %%eax\n\t"
+                     "1:\n\t"
+                     "movnti %%rax, 0(%0)\n\t"
+                     "movnti %%rax, 8(%0)\n\t"
+                     "movnti %%rax, 16(%0)\n\t"
+                     "movnti %%rax, 24(%0)\n\t"
+                     "movnti %%rax, 32(%0)\n\t"
+                     "movnti %%rax, 40(%0)\n\t"
+                     "movnti %%rax, 48(%0)\n\t"
+                     "movnti %%rax, 56(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(page), "+r"(lines)
+                     :
+                     : "rax", "memory");
+}
+
+// Copies a 4KiB aligned page to another one using non-temporal stores (movnti)
+void copy_page(void* destination, const void* source) {
+    size_t   lines = PAGE_SIZE / 32;
+    uint64_t a, b, c, d;
+
+    __asm__ volatile("1:\n\t"
+                     "mov 0(%1), %2\n\t"
+                     "mov 8(%1), %3\n\t"
+                     "mov 16(%1), %4\n\t"
+                     "mov 24(%1), %5\n\t"
+                     "movnti %2, 0(%0)\n\t"
+                     "movnti %3, 8(%0)\n\t"
+                     "movnti %4, 16(%0)\n\t"
+                     "movnti %5, 24(%0)\n\t"
+                     "add $32, %1\n\t"
+                     "add $32, %0\n\t"
+                     "dec %6\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(destination),
+                       "+r"(source),
+                       "=&r"(a),
+                       "=&r"(b),
+                       "=&r"(c),
+                       "=&r"(d),
+                       "+r"(lines)
+                     :
+                     : "memory");
+}
+
+
+// Checks (once) if the cpu supports enhanced rep movsb/stosb
+static inline bool has_erms() {
+    if (erms == -1) erms = cpuid(0, 0).eax >= 7 && (cpuid(7, 0).ebx & CPUID_ERMS_BIT) != 0;
+    return erms;
+}
@@ -9,4 +9,7 @@ void* memset(void* destination, char value, size_t length);
 void* memcpy(void* destination, const void* source, size_t length);
 void* memmove(void* destination, const void* source, size_t length);
 
+void zero_page(void* page);
+void copy_page(void* destination, const void* source);
+
 #endif
@@ -5,8 +5,8 @@
 #include <stdint.h>
 
 
-// size of a pointer + 2 bytes for hex representation + 1 byte for string termination
-#define NUMERIC_BUFFER_SIZE (sizeof(void*) + 2 + 1)
+// hex digits of a pointer + 2 bytes for the 0x prefix + 1 byte for string termination
+#define NUMERIC_BUFFER_SIZE (sizeof(void*) * 2 + 2 + 1)
 
 
 static inline void print_ulong_hex(unsigned long num);
@@ -14,8 +14,6 @@ static inline void print_uint_hex(unsigned int num);
 static inline void print_uint(unsigned int num);
 static inline void print_int(int num);
 
-static char num_buf[NUMERIC_BUFFER_SIZE];
-
 
 void printf(char* str, ...) {
     va_list args;
@@ -78,21 +76,26 @@ void printf(char* str, ...) {
 
 
 static inline void print_int(int num) {
+    // on the stack, several cpus can print at the same time
+    char num_buf[NUMERIC_BUFFER_SIZE];
     itoa(num, num_buf, 10);
     print(num_buf);
 }
 
 static inline void print_uint(unsigned int num) {
+    char num_buf[NUMERIC_BUFFER_SIZE];
     utoa(num, num_buf, 10);
     print(num_buf);
 }
 
 static inline void print_uint_hex(unsigned int num) {
+    char num_buf[NUMERIC_BUFFER_SIZE];
     utoa(num, num_buf, 16);
     print(num_buf);
 }
 
 static inline void print_ulong_hex(unsigned long num) {
+    char num_buf[NUMERIC_BUFFER_SIZE];
     num_buf[0] = '0';
     num_buf[1] = 'x';
     ultoa(num, num_buf + 2, 16);
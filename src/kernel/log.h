@@ -4,6 +4,14 @@
 
 #include "drivers/tty.h"
 #include "lib/printf.h"
+#include <stdbool.h>
+
+
+// Interrupts are disabled first, so a panic cannot be resumed by an interrupt
+__attribute__((noreturn)) static inline void halt_forever() {
+    __asm__ volatile("cli" ::: "memory");
+    for (;;) __asm__ volatile("hlt");
+}
 
 
 // No, I'm not going to implement vprintf right now
@@ -25,18 +33,25 @@
         set_color(VGA_WHITE, VGA_BLACK); \
         print_char(' ');                 \
         __LOG(__VA_ARGS__);              \
-        __asm__ volatile("hlt");         \
+        halt_forever();                  \
     } while (0);
 
+// DEBUG is replaced by the macro below, DEBUG_BUILD is left to tell debug builds apart
 #ifdef DEBUG
 #undef DEBUG
-#define DEBUG(...)                       \
-    do {                                 \
-        set_color(VGA_WHITE, VGA_BLUE);  \
-        print("DEBUG:");                 \
-        set_color(VGA_WHITE, VGA_BLACK); \
-        print_char(' ');                 \
-        __LOG(__VA_ARGS__);              \
+#define DEBUG_BUILD
+
+// Set while the self-tests time the hot paths (see start_benchmark), on every cpu
+extern bool debug_muted;
+
+#define DEBUG(...)                                                  \
+    do {                                                            \
+        if (__atomic_load_n(&debug_muted, __ATOMIC_RELAXED)) break; \
+        set_color(VGA_WHITE, VGA_BLUE);                             \
+        print("DEBUG:");                                            \
+        set_color(VGA_WHITE, VGA_BLACK);                            \
+        print_char(' ');                                            \
+        __LOG(__VA_ARGS__);                                         \
     } while (0);
 #else
 #define DEBUG(...) (void)(0)
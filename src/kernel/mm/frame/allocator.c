@@ -1,74 +1,223 @@
 #include "allocator.h"
-#include "../../lib/mem.h"
 #include "../../log.h"
 #include "../paging/page.h"
+#include "buddy.h"
+#include "cache.h"
 #include <stdint.h>
 
 
 // if PAGE_SIZE = 0x1000, FRAME_MASK = 0xFFFFFFFFFFFFF000
 #define FRAME_MASK (~((size_t)PAGE_SIZE - 1))
 
-#define MAX_USED_REGIONS 20
+// Reference counters of the frames that do not belong to the allocator (e.g. device memory)
+#define FRAME_NOT_OWNED      UINT16_MAX
+#define FRAME_MAX_REFERENCES (UINT16_MAX - 1)
 
-static mem_region_t used_regions[MAX_USED_REGIONS];
-static size_t       used_regions_size = 0;
+static inline void      free_frames_in_region(uint8_t* start, uint8_t* end);
+static inline uint16_t* get_references(const void* frame);
+static inline void      own_frames(const void* frame, size_t order);
 
-static uint8_t* next_free_frame = (uint8_t*)-1;
-static uint8_t* end_of_memory   = 0x0;
+
+// Frames below end_of_memory, the ones above it are never handed out
+static size_t frames_number;
+
+// References to each frame besides the first one, a frame that is not shared has none
+// They are atomic, the frames of an address space can be shared with the ones running elsewhere
+// The array is allocated by init_frame_references, sized for the installed memory
+static uint16_t* frame_references;
 
 
 // required to use the other functions
-void init_frame_allocator(
-    mem_region_t system_memory, const mem_region_t _used_regions[], size_t _used_regions_size
-) {
-    if (_used_regions_size > MAX_USED_REGIONS)
-        PANIC(
-            "Used memory regions (%d) exceed maximum allowed (%d)",
-            used_regions_size,
-            MAX_USED_REGIONS
-        );
-
-    next_free_frame   = system_memory.start;
-    end_of_memory     = system_memory.end;
-    used_regions_size = _used_regions_size;
-    memcpy(used_regions, _used_regions, sizeof(mem_region_t) * used_regions_size);
-
-#ifdef DEBUG
-    DEBUG("Used memory regions:\n");
-    for (size_t i = 0; i < used_regions_size; i++)
-        DEBUG("\t%d) start = %p, end = %p\n", i, used_regions[i].start, used_regions[i].end);
-#endif
+// Marks as available every frame fully contained in the free regions
+// The free regions must be sorted by their start address and must not overlap
+void init_frame_allocator(const mem_region_t free_regions[], size_t free_regions_size) {
+    if (free_regions_size == 0) PANIC("No free memory regions");
+
+    uint8_t* end_of_memory = free_regions[free_regions_size - 1].end;
+    if ((size_t)end_of_memory >= MAX_PHYSICAL_MEMORY) {
+        LOG("Physical memory above %p will not be used\n", MAX_PHYSICAL_MEMORY);
+        end_of_memory = (uint8_t*)(MAX_PHYSICAL_MEMORY - 1);
+    }
+
+    frames_number = ((size_t)end_of_memory + 1) / PAGE_SIZE;
+    init_buddy(frames_number);
+
+    for (size_t i = 0; i < free_regions_size && free_regions[i].start <= end_of_memory; i++) {
+        uint8_t* end = free_regions[i].end < end_of_memory ? free_regions[i].end : end_of_memory;
+        free_frames_in_region(free_regions[i].start, end);
+    }
+
+    DEBUG("Free frames: %d\n", get_free_frames());
 }
 
+// required to use reference_frame, release_frame and get_frame_references
+// The counters are reached through the direct map, so the kernel has to be remapped before
+// Only the frames of the free regions (the ones passed to init_frame_allocator) are counted
+void init_frame_references(const mem_region_t free_regions[], size_t free_regions_size) {
+    size_t size  = frames_number * sizeof(uint16_t);
+    size_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) order++;
+
+    // the frames past the end of the array go back to the allocator
+    uint8_t* block = (uint8_t*)allocate_frames(order);
+    uint8_t* end   = (uint8_t*)(((size_t)block + size + PAGE_SIZE - 1) & FRAME_MASK);
+    if (end < block + ((size_t)PAGE_SIZE << order))
+        free_frames_in_region(end, block + ((size_t)PAGE_SIZE << order) - 1);
+
+    frame_references = PHYS_TO_VIRT(block);
+    for (size_t i = 0; i < frames_number; i++) frame_references[i] = FRAME_NOT_OWNED;
+
+    for (size_t i = 0; i < free_regions_size; i++) {
+        size_t first_frame = ((size_t)free_regions[i].start + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t last_frame  = ((size_t)free_regions[i].end + 1) / PAGE_SIZE; // exclusive
+        if (last_frame > frames_number) last_frame = frames_number;
+
+        for (size_t frame = first_frame; frame < last_frame; frame++) frame_references[frame] = 0;
+    }
+
+    DEBUG("Frame references initialized (start = %p, size = %p)\n", frame_references, size);
+}
 
-// Selects a free frame based excluding used memory regions and returns it
-// Increases the next free frame pointer
+
+// Single frames go through the running cpu's frame cache
 const void* allocate_frame() {
-    if (next_free_frame + PAGE_SIZE >= end_of_memory)
-        PANIC("No free frames (%x > %x)", next_free_frame, end_of_memory);
-
-    // If the frame pointer overlaps a reseved memory region
-    // it will be repositioned to end of that region
-    for (size_t i = 0; i < used_regions_size; i++) {
-        // 1: check if the current frame pointer is in the reserved region
-        // 2: check if frame will overlap with the reserved region at some point
-        // 3: check if frame will completely cover the reserved region
-        if ((next_free_frame >= used_regions[i].start && next_free_frame <= used_regions[i].end)
-            || (next_free_frame + PAGE_SIZE > used_regions[i].start
-                && next_free_frame + PAGE_SIZE <= used_regions[i].end)
-            || (next_free_frame <= used_regions[i].start
-                && next_free_frame + PAGE_SIZE >= used_regions[i].end)) {
-            next_free_frame  = (uint8_t*)((size_t)used_regions[i].end & FRAME_MASK);
-            next_free_frame += PAGE_SIZE;
-        }
+    const void* frame = frame_cache_allocate();
+    own_frames(frame, 0);
+    return frame;
+}
+
+void deallocate_frame(const void* address) { frame_cache_free(address); }
+
+// Returns the first of 2^order physically contiguous frames, aligned to their total size
+const void* allocate_frames(size_t order) {
+    size_t frame = buddy_allocate(order);
+    if (frame == BUDDY_NOT_FOUND) PANIC("No free frames (order = %d)", order);
+
+    own_frames((void*)(frame * PAGE_SIZE), order);
+    return (void*)(frame * PAGE_SIZE);
+}
+
+// Marks 2^order frames previously returned by allocate_frames as available
+void deallocate_frames(const void* address, size_t order) {
+    if (((size_t)address & ~FRAME_MASK) != 0) PANIC("Frame %p is not aligned", address);
+
+    buddy_free((size_t)address / PAGE_SIZE, order);
+}
+
+// Adds a reference to a frame returned by allocate_frame (e.g. when it is mapped a second time)
+// Frames that do not belong to the allocator are not counted
+void reference_frame(const void* frame) {
+    uint16_t* references = get_references(frame);
+    if (references == NULL) return;
+
+    // the counter is checked before it is incremented, so it never wraps
+    uint16_t expected = __atomic_load_n(references, __ATOMIC_RELAXED);
+    do {
+        if (expected == FRAME_MAX_REFERENCES) PANIC("Too many references to frame %p", frame);
+    } while (!__atomic_compare_exchange_n(
+        references, &expected, expected + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    ));
+}
+
+// Drops a reference to the frame, the frame is deallocated with the last one
+// It has the same signature as deallocate_frame, so it can be passed to unmap_range
+// Frames that do not belong to the allocator are never deallocated
+void release_frame(const void* frame) {
+    uint16_t* references = get_references(frame);
+    if (references == NULL) return;
+
+    uint16_t expected = __atomic_load_n(references, __ATOMIC_ACQUIRE);
+    while (expected > 0)
+        if (__atomic_compare_exchange_n(
+                references, &expected, expected - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+            ))
+            return;
+
+    deallocate_frame(frame);
+}
+
+// Returns how many times the frame is mapped (1 if it is not shared or not counted)
+size_t get_frame_references(const void* frame) {
+    uint16_t* references = get_references(frame);
+    if (references == NULL) return 1;
+
+    return (size_t)__atomic_load_n(references, __ATOMIC_ACQUIRE) + 1;
+}
+
+// Returns the number of frames that can still be allocated (including the cached ones)
+size_t get_free_frames() { return buddy_free_frames() + get_frame_cache_stats().cached_frames; }
+
+// Returns how free memory is split between block orders
+// Fragmentation is the percentage of free memory that is not part of the biggest free block
+frame_allocator_stats_t get_frame_allocator_stats() {
+    frame_cache_stats_t     cache_stats = get_frame_cache_stats();
+    frame_allocator_stats_t stats       = {
+        .free_frames   = buddy_free_frames() + cache_stats.cached_frames,
+        .cached_frames = cache_stats.cached_frames,
+        .cache_refills = cache_stats.refills,
+        .cache_drains  = cache_stats.drains,
+    };
+
+    for (size_t order = 0; order <= FRAME_MAX_ORDER; order++) {
+        stats.free_blocks[order] = buddy_free_blocks(order);
+        if (stats.free_blocks[order] > 0) stats.largest_free_order = order;
     }
 
-    void* start_address = next_free_frame;
+    if (stats.free_frames > 0)
+        stats.fragmentation
+            = 100 - (((size_t)100 << stats.largest_free_order) / stats.free_frames);
+
+    return stats;
+}
+
+void print_frame_allocator_stats() {
+    frame_allocator_stats_t stats = get_frame_allocator_stats();
+
+    LOG("Free frames: %d (fragmentation = %d%%)\n", stats.free_frames, stats.fragmentation);
+    for (size_t order = 0; order <= FRAME_MAX_ORDER; order++)
+        if (stats.free_blocks[order] > 0)
+            LOG("\torder %d: %d free blocks\n", order, stats.free_blocks[order]);
+    LOG(
+        "Cached frames: %d (refills = %d, drains = %d)\n",
+        stats.cached_frames,
+        stats.cache_refills,
+        stats.cache_drains
+    );
+}
 
-    next_free_frame += PAGE_SIZE;
 
-    return start_address;
+// Returns the reference counter of the frame or NULL if the allocator does not own it
+static inline uint16_t* get_references(const void* frame) {
+    size_t index = (size_t)frame / PAGE_SIZE;
+    if (frame_references == NULL || index >= frames_number) return NULL;
+
+    uint16_t* references = &frame_references[index];
+    return *references == FRAME_NOT_OWNED ? NULL : references;
 }
 
-// to implement
-void deallocate_frame(const void* address) {}
+// Frames that were not in the free regions (e.g. the boot table4 or the trampoline) can be given to
+// the allocator later, they are counted from the first time they are handed out
+static inline void own_frames(const void* frame, size_t order) {
+    size_t index = (size_t)frame / PAGE_SIZE;
+    if (frame_references == NULL || frame_references[index] != FRAME_NOT_OWNED) return;
+
+    for (size_t i = 0; i < ((size_t)1 << order); i++) frame_references[index + i] = 0;
+}
+
+// Marks as available all the frames fully contained in the region
+// The region is split in the biggest naturally aligned blocks that fit in it
+static inline void free_frames_in_region(uint8_t* start, uint8_t* end) {
+    size_t first_frame = ((size_t)start + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t last_frame  = ((size_t)end + 1) / PAGE_SIZE; // exclusive
+
+    DEBUG("Free memory region: start = %p, end = %p\n", start, end);
+    while (first_frame < last_frame) {
+        size_t order = 0;
+        while (order < FRAME_MAX_ORDER && (first_frame & ((size_t)1 << order)) == 0
+               && first_frame + ((size_t)2 << order) <= last_frame)
+            order++;
+
+        buddy_free(first_frame, order);
+        first_frame += (size_t)1 << order;
+    }
+}
@@ -5,13 +5,36 @@
 #include <stddef.h>
 
 
-void init_frame_allocator(
-    mem_region_t system_memory, const mem_region_t _used_regions[], size_t _used_regions_size
-);
+// Maximum order accepted by allocate_frames (2^18 frames = 1GiB)
+#define FRAME_MAX_ORDER 18
+
+typedef struct {
+    size_t free_frames;
+    size_t free_blocks[FRAME_MAX_ORDER + 1];
+    size_t largest_free_order;
+    size_t fragmentation;
+    size_t cached_frames;
+    size_t cache_refills;
+    size_t cache_drains;
+} frame_allocator_stats_t;
+
+void init_frame_allocator(const mem_region_t free_regions[], size_t free_regions_size);
 const void* allocate_frame();
 void        deallocate_frame(const void* frame);
+const void* allocate_frames(size_t order);
+void        deallocate_frames(const void* address, size_t order);
+size_t      get_free_frames();
+
+void   init_frame_references(const mem_region_t free_regions[], size_t free_regions_size);
+void   reference_frame(const void* frame);
+void   release_frame(const void* frame);
+size_t get_frame_references(const void* frame);
+
+frame_allocator_stats_t get_frame_allocator_stats();
+void                    print_frame_allocator_stats();
 
 typedef const void* (*allocate_frame_t)();
 typedef void (*deallocate_frame_t)(const void* frame);
+typedef void (*deallocate_frames_t)(const void* frame, size_t order);
 
 #endif
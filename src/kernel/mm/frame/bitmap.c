@@ -0,0 +1,60 @@
+#include "bitmap.h"
+
+
+// required to use the other functions
+// the words array must be zeroed and big enough to contain 'size' bits
+void init_bitmap(bitmap_t* bitmap, uint64_t words[], size_t size) {
+    bitmap->words = words;
+    bitmap->size  = size;
+    bitmap->hint  = BITMAP_WORDS(size);
+}
+
+inline void bitmap_set(bitmap_t* bitmap, size_t bit) {
+    size_t word = bit / BITMAP_WORD_BITS;
+
+    bitmap->words[word] |= (uint64_t)1 << (bit % BITMAP_WORD_BITS);
+
+    // a set bit before the hint moves the hint back
+    if (word < bitmap->hint) bitmap->hint = word;
+}
+
+inline void bitmap_clear(bitmap_t* bitmap, size_t bit) {
+    bitmap->words[bit / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (bit % BITMAP_WORD_BITS));
+}
+
+inline bool bitmap_test(const bitmap_t* bitmap, size_t bit) {
+    return (bitmap->words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+// Checks if a bit in [start, end) is set, a word at a time
+bool bitmap_test_range(const bitmap_t* bitmap, size_t start, size_t end) {
+    if (end > bitmap->size) end = bitmap->size;
+
+    while (start < end) {
+        size_t offset = start % BITMAP_WORD_BITS;
+        size_t bits   = BITMAP_WORD_BITS - offset; // up to the end of the word
+        if (bits > end - start) bits = end - start;
+
+        uint64_t mask
+            = bits == BITMAP_WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1) << offset;
+        if ((bitmap->words[start / BITMAP_WORD_BITS] & mask) != 0) return true;
+        start += bits;
+    }
+
+    return false;
+}
+
+// Returns the index of the lowest set bit or BITMAP_NOT_FOUND
+// Scans a word at a time starting from the hint, empty words before the hint are never visited
+// again until a bit in them gets set, so repeated searches are amortized O(1)
+size_t bitmap_find_first_set(bitmap_t* bitmap) {
+    size_t words_number = BITMAP_WORDS(bitmap->size);
+
+    while (bitmap->hint < words_number) {
+        uint64_t word = bitmap->words[bitmap->hint];
+        if (word != 0) return bitmap->hint * BITMAP_WORD_BITS + __builtin_ctzll(word);
+        bitmap->hint++;
+    }
+
+    return BITMAP_NOT_FOUND;
+}
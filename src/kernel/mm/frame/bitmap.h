@@ -0,0 +1,31 @@
+#ifndef FRAME_BITMAP_H
+#define FRAME_BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define BITMAP_WORD_BITS 64
+#define BITMAP_NOT_FOUND ((size_t)-1)
+
+// Number of words needed to store 'bits' bits
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+// A set bit marks an available item
+// hint is the index of the first word that may contain a set bit
+typedef struct {
+    uint64_t* words;
+    size_t    size;
+    size_t    hint;
+} bitmap_t;
+
+
+void   init_bitmap(bitmap_t* bitmap, uint64_t words[], size_t size);
+void   bitmap_set(bitmap_t* bitmap, size_t bit);
+void   bitmap_clear(bitmap_t* bitmap, size_t bit);
+bool   bitmap_test(const bitmap_t* bitmap, size_t bit);
+bool   bitmap_test_range(const bitmap_t* bitmap, size_t start, size_t end);
+size_t bitmap_find_first_set(bitmap_t* bitmap);
+
+#endif
@@ -0,0 +1,172 @@
+#include "buddy.h"
+#include "../../log.h"
+#include "../../sync/ticketlock.h"
+#include "../paging/page.h"
+#include "bitmap.h"
+#include <stdint.h>
+
+
+#define MAX_FRAMES          (MAX_PHYSICAL_MEMORY / PAGE_SIZE)
+
+// Order n needs half the bits of order n-1 (+1 word per order for rounding)
+// 4GiB / 4KiB / 8 * 2 = 256KiB
+#define BUDDY_WORDS (BITMAP_WORDS(MAX_FRAMES) * 2 + BUDDY_MAX_ORDER + 1)
+
+
+static inline size_t allocate_block(size_t order);
+static inline void   free_block(size_t frame, size_t order);
+static inline bool   overlaps_free_block(size_t frame, size_t order);
+
+
+// free_blocks[n] has a set bit for every free block of order n that is not part of a bigger one
+static uint64_t buddy_words[BUDDY_WORDS];
+static bitmap_t free_blocks[BUDDY_MAX_ORDER + 1];
+static size_t   free_blocks_number[BUDDY_MAX_ORDER + 1];
+
+// Taken by every cpu when its frame cache is refilled or drained, so it is handed over fairly
+static ticket_lock_t buddy_lock = TICKET_LOCK_INIT;
+
+
+// required to use the other functions
+// All the frames start as used, they become available with buddy_free
+void init_buddy(size_t frames_number) {
+    if (frames_number > MAX_FRAMES)
+        PANIC("Frames (%d) exceed maximum allowed (%d)", frames_number, MAX_FRAMES);
+
+    uint64_t* words = buddy_words;
+    for (size_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size_t blocks = frames_number >> order;
+        init_bitmap(&free_blocks[order], words, blocks);
+        words += BITMAP_WORDS(blocks);
+    }
+}
+
+// Returns the first frame of a free block of the requested order or BUDDY_NOT_FOUND
+// Bigger blocks are split in half until the requested order is reached
+size_t buddy_allocate(size_t order) {
+    if (order > BUDDY_MAX_ORDER) return BUDDY_NOT_FOUND;
+
+    uint64_t rflags = ticket_lock_irqsave(&buddy_lock);
+    size_t   frame  = allocate_block(order);
+    ticket_unlock_irqrestore(&buddy_lock, rflags);
+
+    return frame;
+}
+
+// Frees a block, merging it with its buddy as long as the buddy is free too
+void buddy_free(size_t frame, size_t order) {
+    uint64_t rflags = ticket_lock_irqsave(&buddy_lock);
+    free_block(frame, order);
+    ticket_unlock_irqrestore(&buddy_lock, rflags);
+}
+
+// Allocates up to count single frames with one lock acquisition
+// Returns the number of frames stored in frames (less than count if memory runs out)
+size_t buddy_allocate_many(size_t frames[], size_t count) {
+    uint64_t rflags    = ticket_lock_irqsave(&buddy_lock);
+    size_t   allocated = 0;
+
+    while (allocated < count) {
+        size_t frame = allocate_block(0);
+        if (frame == BUDDY_NOT_FOUND) break;
+        frames[allocated++] = frame;
+    }
+
+    ticket_unlock_irqrestore(&buddy_lock, rflags);
+    return allocated;
+}
+
+// Frees count single frames with one lock acquisition
+void buddy_free_many(const size_t frames[], size_t count) {
+    uint64_t rflags = ticket_lock_irqsave(&buddy_lock);
+    for (size_t i = 0; i < count; i++) free_block(frames[i], 0);
+    ticket_unlock_irqrestore(&buddy_lock, rflags);
+}
+
+// Checks if the frame is part of a free block of any order
+// The lock is not taken, the answer may be outdated as soon as it is returned
+bool buddy_is_free(size_t frame) {
+    for (size_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size_t block = frame >> order;
+        if (block < free_blocks[order].size && bitmap_test(&free_blocks[order], block))
+            return true;
+    }
+    return false;
+}
+
+// Returns the number of free blocks of the specified order
+size_t buddy_free_blocks(size_t order) { return free_blocks_number[order]; }
+
+// Returns the number of frames in free blocks of any order
+size_t buddy_free_frames() {
+    size_t frames = 0;
+    for (size_t order = 0; order <= BUDDY_MAX_ORDER; order++)
+        frames += free_blocks_number[order] << order;
+    return frames;
+}
+
+// Returns the number of frames managed by the allocator, the ones above it are never free
+size_t buddy_frames_number() { return free_blocks[0].size; }
+
+
+// The callers hold buddy_lock
+static inline size_t allocate_block(size_t order) {
+    size_t current_order = order;
+    size_t block         = BUDDY_NOT_FOUND;
+    while (current_order <= BUDDY_MAX_ORDER) {
+        block = bitmap_find_first_set(&free_blocks[current_order]);
+        if (block != BUDDY_NOT_FOUND) break;
+        current_order++;
+    }
+    if (block == BUDDY_NOT_FOUND) return BUDDY_NOT_FOUND;
+
+    bitmap_clear(&free_blocks[current_order], block);
+    free_blocks_number[current_order]--;
+
+    // keep the lower half, the upper half (the buddy) becomes a free block of the order below
+    while (current_order > order) {
+        current_order--;
+        block *= 2;
+        bitmap_set(&free_blocks[current_order], block + 1);
+        free_blocks_number[current_order]++;
+    }
+
+    return block << order;
+}
+
+static inline void free_block(size_t frame, size_t order) {
+    if (order > BUDDY_MAX_ORDER) PANIC("Invalid block order (%d)", order);
+    if ((frame & (((size_t)1 << order) - 1)) != 0)
+        PANIC("Frame %p is not aligned to order %d", frame * PAGE_SIZE, order);
+    if ((frame >> order) >= free_blocks[order].size)
+        PANIC("Frame %p is outside of system memory", frame * PAGE_SIZE);
+    if (overlaps_free_block(frame, order))
+        PANIC("Block %p (order %d) is already free", frame * PAGE_SIZE, order);
+
+    size_t block = frame >> order;
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy = block ^ 1;
+        if (buddy >= free_blocks[order].size || !bitmap_test(&free_blocks[order], buddy)) break;
+
+        bitmap_clear(&free_blocks[order], buddy);
+        free_blocks_number[order]--;
+        block /= 2;
+        order++;
+    }
+
+    bitmap_set(&free_blocks[order], block);
+    free_blocks_number[order]++;
+}
+
+// Checks if any frame of the block is part of a free block (a whole or partial double free)
+static inline bool overlaps_free_block(size_t frame, size_t order) {
+    // free blocks of the same order or bigger contain the first frame
+    if (buddy_is_free(frame)) return true;
+
+    // smaller free blocks can be anywhere in the block
+    size_t end = frame + ((size_t)1 << order);
+    for (size_t lower = 0; lower < order; lower++)
+        if (bitmap_test_range(&free_blocks[lower], frame >> lower, end >> lower)) return true;
+
+    return false;
+}
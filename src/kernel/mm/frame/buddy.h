@@ -0,0 +1,27 @@
+#ifndef FRAME_BUDDY_H
+#define FRAME_BUDDY_H
+
+#include "allocator.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Physical memory above this address is ignored by the allocator
+#define MAX_PHYSICAL_MEMORY 0x100000000
+
+// A block of order n is made of 2^n contiguous frames
+#define BUDDY_MAX_ORDER FRAME_MAX_ORDER
+#define BUDDY_NOT_FOUND ((size_t)-1)
+
+
+void   init_buddy(size_t frames_number);
+size_t buddy_allocate(size_t order);
+void   buddy_free(size_t frame, size_t order);
+size_t buddy_allocate_many(size_t frames[], size_t count);
+void   buddy_free_many(const size_t frames[], size_t count);
+bool   buddy_is_free(size_t frame);
+size_t buddy_free_blocks(size_t order);
+size_t buddy_free_frames();
+size_t buddy_frames_number();
+
+#endif
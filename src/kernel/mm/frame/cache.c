@@ -0,0 +1,92 @@
+#include "cache.h"
+#include "../../cpu/cpu.h"
+#include "../../log.h"
+#include "../paging/page.h"
+#include "buddy.h"
+#include <stdint.h>
+
+
+typedef struct {
+    size_t size;
+    size_t frames[FRAME_CACHE_SIZE];
+    size_t refills;
+    size_t drains;
+} frame_cache_t;
+
+static inline void refill(frame_cache_t* cache);
+static inline void drain(frame_cache_t* cache);
+static inline bool is_cached(const frame_cache_t* cache, size_t frame);
+
+
+// Only the owning cpu touches its cache, with interrupts disabled
+static frame_cache_t frame_caches[MAX_CPUS];
+
+
+// Pops a frame from the running cpu's cache, refilling it from the buddy allocator when empty
+const void* frame_cache_allocate() {
+    uint64_t       rflags = disable_interrupts();
+    frame_cache_t* cache  = &frame_caches[get_cpu_id()];
+
+    if (cache->size == 0) refill(cache);
+    if (cache->size == 0) PANIC("No free frames");
+
+    size_t frame = cache->frames[--cache->size];
+
+    restore_interrupts(rflags);
+    return (void*)(frame * PAGE_SIZE);
+}
+
+// Pushes a frame on the running cpu's cache, draining half of it to the buddy allocator when full
+// The frame would only reach the buddy checks when drained, after it was maybe handed out again,
+// so it is checked here (the double free checks are only done by debug builds)
+void frame_cache_free(const void* address) {
+    size_t frame = (size_t)address / PAGE_SIZE;
+    if (((size_t)address & (PAGE_SIZE - 1)) != 0) PANIC("Frame %p is not aligned", address);
+    if (frame >= buddy_frames_number()) PANIC("Frame %p is outside of system memory", address);
+
+    uint64_t       rflags = disable_interrupts();
+    frame_cache_t* cache  = &frame_caches[get_cpu_id()];
+
+#ifdef DEBUG_BUILD
+    // a frame freed twice on another cpu can still be in that cpu's cache, it is not noticed
+    if (buddy_is_free(frame) || is_cached(cache, frame)) PANIC("Frame %p is already free", address);
+#endif
+
+    if (cache->size == FRAME_CACHE_SIZE) drain(cache);
+    cache->frames[cache->size++] = frame;
+
+    restore_interrupts(rflags);
+}
+
+// Returns the counters of all the caches added together
+frame_cache_stats_t get_frame_cache_stats() {
+    frame_cache_stats_t stats = {0};
+
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        stats.cached_frames += frame_caches[cpu].size;
+        stats.refills       += frame_caches[cpu].refills;
+        stats.drains        += frame_caches[cpu].drains;
+    }
+
+    return stats;
+}
+
+
+// The batch is moved with a single buddy lock acquisition
+static inline void refill(frame_cache_t* cache) {
+    cache->refills++;
+    cache->size
+        += buddy_allocate_many(&cache->frames[cache->size], FRAME_CACHE_BATCH - cache->size);
+}
+
+static inline void drain(frame_cache_t* cache) {
+    cache->drains++;
+    cache->size -= FRAME_CACHE_BATCH;
+    buddy_free_many(&cache->frames[cache->size], FRAME_CACHE_BATCH);
+}
+
+static inline bool is_cached(const frame_cache_t* cache, size_t frame) {
+    for (size_t i = 0; i < cache->size; i++)
+        if (cache->frames[i] == frame) return true;
+    return false;
+}
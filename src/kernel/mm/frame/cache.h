@@ -0,0 +1,23 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stddef.h>
+
+
+// Each cpu keeps up to FRAME_CACHE_SIZE free frames
+// An empty cache is refilled and a full one is drained FRAME_CACHE_BATCH frames at a time
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
+typedef struct {
+    size_t cached_frames;
+    size_t refills;
+    size_t drains;
+} frame_cache_stats_t;
+
+
+const void*         frame_cache_allocate();
+void                frame_cache_free(const void* address);
+frame_cache_stats_t get_frame_cache_stats();
+
+#endif
@@ -1,123 +1,397 @@
 #include "allocator.h"
+#include "../../cpu/cpu.h"
 #include "../../lib/mem.h"
 #include "../../log.h"
+#include "../../sync/spinlock.h"
+#include "../frame/allocator.h"
+#include "../paging/paging.h"
+#include "../vma/vma.h"
 #include <stdbool.h>
 #include <stdint.h>
 
 
+// Every block is surrounded by two boundary tags (header and footer) holding its payload size
+// The footer lets a block find the start of its left neighbour in constant time
+// A zeroed free block only contains zeroes, except for its free list links
+typedef struct {
+    size_t size;
+    bool   used;
+    bool   zeroed;
+} boundary_tag_t;
+
+// Free blocks store the links of the free list in their payload
 typedef struct free_mem_region_t {
     struct free_mem_region_t* next;
-    bool                      used;
-    size_t                    size;
+    struct free_mem_region_t* prev;
 } free_mem_region_t;
 
+// Every cpu allocates from its own arena, so its lock is almost never contended
+// The lock is still needed: a thread can be moved to another cpu while it uses the arena
+// Blocks freed by another cpu are pushed on the owner's remote_frees, a lock free stack with
+// many producers and a single consumer (whoever holds the arena lock)
+typedef struct __attribute__((aligned(64))) {
+    spinlock_t         lock;
+    uint8_t*           heap_start;
+    uint8_t*           heap_end;
+    free_mem_region_t* root;
+    size_t             free_bytes;
+    void*              remote_frees; // linked through the first word of the payloads
+} heap_arena_t;
+
+#define HEAP_ALIGNMENT   16
+#define MIN_PAYLOAD_SIZE sizeof(free_mem_region_t)
+#define TAGS_SIZE        (2 * sizeof(boundary_tag_t))
+#define HEAP_AREA_SIZE   ((size_t)MAX_CPUS * HEAP_MAX_SIZE)
+
+static inline uint32_t        get_running_cpu_id();
+static inline heap_arena_t*   lock_arena();
+static inline void            init_arena(heap_arena_t* arena, uint32_t cpu);
+static inline void            push_remote_block(heap_arena_t* arena, void* address);
+static inline void            free_remote_blocks(heap_arena_t* arena);
+static inline void*           allocate_block(size_t size, bool zeroed);
+static inline void            free_block(heap_arena_t* arena, boundary_tag_t* header);
 static inline void*
-mark_used_region(free_mem_region_t* node, free_mem_region_t* next_node, size_t size);
-static inline void mark_free_region(
-    free_mem_region_t* node, free_mem_region_t* prev_node, free_mem_region_t* next_node
-);
+mark_used_region(heap_arena_t* arena, boundary_tag_t* header, size_t size, bool zeroed);
+static inline void            mark_free_region(heap_arena_t* arena, boundary_tag_t* header);
+static inline void            set_tags(boundary_tag_t* header, size_t size, bool used, bool zeroed);
+static inline boundary_tag_t* get_footer(boundary_tag_t* header);
+static inline void*           get_payload(boundary_tag_t* header);
+static inline void            push_free_region(heap_arena_t* arena, boundary_tag_t* header);
+static inline void            remove_free_region(heap_arena_t* arena, boundary_tag_t* header);
+static inline boundary_tag_t* grow_heap(heap_arena_t* arena, size_t size);
+static inline void            shrink_heap(heap_arena_t* arena);
+static inline boundary_tag_t* get_last_header(heap_arena_t* arena);
 
 
-static free_mem_region_t* root;
-static size_t             free_bytes = HEAP_SIZE - sizeof(free_mem_region_t);
+// The arena of cpu n starts at heap_area_start + n * HEAP_MAX_SIZE
+static uint8_t*     heap_area_start;
+static heap_arena_t arenas[MAX_CPUS];
 
 
-void init_heap_allocator(void* start_address) {
-    root       = start_address;
-    root->next = NULL;
-    root->used = false;
-    root->size = free_bytes;
-    DEBUG("Heap initialized (start = %p, size = %p)\n", root, free_bytes);
+// The whole heap area is lazy, its pages are mapped (and zeroed) by the page fault handler
+// An arena is set up the first time its cpu allocates, so only the running cpus use memory
+// init_vma and init_page_fault_handler have to be called before
+void init_heap_allocator() {
+    vma_t* vma = vma_reserve(
+        HEAP_AREA_SIZE, PAGE_FLAG_WRITABLE | PAGE_FLAG_GLOBAL | PAGE_FLAG_NO_EXECUTE, VMA_LAZY
+    );
+    if (vma == NULL) PANIC("Cannot reserve the heap area");
+
+    heap_area_start = vma->start;
+    DEBUG("Heap initialized (start = %p, arenas = %d)\n", heap_area_start, MAX_CPUS);
 }
 
-void* allocate(size_t size) {
-    if (size > free_bytes) return NULL;
+// The returned memory is not initialized
+void* allocate(size_t size) { return allocate_block(size, false); }
 
-    free_mem_region_t* node = root;
+// The returned memory is zeroed, blocks known to be zeroed are not cleared again
+void* allocate_zeroed(size_t size) { return allocate_block(size, true); }
 
-    while (node != NULL) {
-        if (node->size >= size && !node->used) {
-            return mark_used_region(node, node->next, size);
-        }
+// Blocks of another cpu's arena are handed back to it without waiting
+// Panics if the address was not returned by allocate (or was already freed)
+void deallocate(void* address) {
+    if ((uint8_t*)address < heap_area_start + sizeof(boundary_tag_t)
+        || (uint8_t*)address >= heap_area_start + HEAP_AREA_SIZE)
+        PANIC("%p is not a heap address", address);
+
+    uint32_t      cpu   = ((uint8_t*)address - heap_area_start) / HEAP_MAX_SIZE;
+    heap_arena_t* owner = &arenas[cpu];
 
-        node = node->next;
+    // the start of an arena does not change once it is set up
+    if (__atomic_load_n(&owner->heap_start, __ATOMIC_ACQUIRE) == NULL)
+        PANIC("%p belongs to the arena of cpu %d, it was never used", address, cpu);
+
+    if (cpu != get_running_cpu_id()) {
+        push_remote_block(owner, address);
+        return;
     }
 
-    return NULL;
+    spin_lock(&owner->lock);
+    free_remote_blocks(owner);
+    free_block(owner, (boundary_tag_t*)address - 1);
+    spin_unlock(&owner->lock);
 }
 
-void deallocate(void* address) {
-    // is the address in the heap memory region?
-    if ((size_t)address < (size_t)root || (size_t)address > (size_t)root + HEAP_SIZE) return;
+// Frees the blocks the other cpus handed back to the running cpu's arena
+// Called by the idle loop, so they are not kept until the cpu allocates again
+void free_remote_deallocations() {
+    heap_arena_t* arena = &arenas[get_running_cpu_id()];
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    // the thread holding the lock frees them anyway
+    if (!spin_try_lock(&arena->lock)) return;
+    free_remote_blocks(arena);
+    spin_unlock(&arena->lock);
+}
+
+
+// Interrupts are only disabled to read the per-cpu data, the thread may run on another cpu by the
+// time the id is used (the arena locks make it safe)
+static inline uint32_t get_running_cpu_id() {
+    uint64_t rflags = disable_interrupts();
+    uint32_t cpu    = get_cpu_id();
+    restore_interrupts(rflags);
+
+    return cpu;
+}
+
+// Returns the running cpu's arena, with its lock held
+static inline heap_arena_t* lock_arena() {
+    uint32_t      cpu   = get_running_cpu_id();
+    heap_arena_t* arena = &arenas[cpu];
+
+    spin_lock(&arena->lock);
+    if (arena->heap_start == NULL) init_arena(arena, cpu);
+    return arena;
+}
+
+static inline void init_arena(heap_arena_t* arena, uint32_t cpu) {
+    uint8_t* start = heap_area_start + (size_t)cpu * HEAP_MAX_SIZE;
+
+    arena->heap_end     = start + HEAP_INITIAL_SIZE;
+    arena->root         = NULL;
+    arena->free_bytes   = HEAP_INITIAL_SIZE - TAGS_SIZE;
+    arena->remote_frees = NULL;
+
+    set_tags((boundary_tag_t*)start, arena->free_bytes, false, true);
+    push_free_region(arena, (boundary_tag_t*)start);
+
+    // read without the lock by deallocate
+    __atomic_store_n(&arena->heap_start, start, __ATOMIC_RELEASE);
+    DEBUG("Heap arena initialized (start = %p, cpu = %d)\n", start, cpu);
+}
+
+// The block is only checked by the owner, when it frees it
+static inline void push_remote_block(heap_arena_t* arena, void* address) {
+    void* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+
+    do *(void**)address = head;
+    while (!__atomic_compare_exchange_n(
+        &arena->remote_frees, &head, address, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    ));
+}
 
+// The whole stack is taken at once, so the single consumer never races with the producers
+static inline void free_remote_blocks(heap_arena_t* arena) {
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) return;
 
-    free_mem_region_t* prev_node = NULL;
-    free_mem_region_t* node      = root;
-    while (node != NULL && (size_t)node + sizeof(free_mem_region_t) + node->size < (size_t)address
-    ) {
-        prev_node = node;
-        node      = node->next;
+    void* block = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        void* next = *(void**)block;
+        free_block(arena, (boundary_tag_t*)block - 1);
+        block = next;
     }
+}
+
+static inline void* allocate_block(size_t size, bool zeroed) {
+    if (size < MIN_PAYLOAD_SIZE) size = MIN_PAYLOAD_SIZE;
+    size = (size + HEAP_ALIGNMENT - 1) & ~((size_t)HEAP_ALIGNMENT - 1);
+
+    heap_arena_t* arena   = lock_arena();
+    void*         payload = NULL;
+
+    free_remote_blocks(arena);
 
-    // is the address already in a free region?
-    if (!node->used) return;
+    // only free blocks are visited
+    if (size <= arena->free_bytes) {
+        for (free_mem_region_t* node = arena->root; node != NULL; node = node->next) {
+            boundary_tag_t* header = (boundary_tag_t*)node - 1;
+            if (header->size >= size) {
+                payload = mark_used_region(arena, header, size, zeroed);
+                break;
+            }
+        }
+    }
+
+    // no free block is big enough, map more memory at the end of the heap
+    if (payload == NULL) {
+        boundary_tag_t* header = grow_heap(arena, size);
+        if (header != NULL) payload = mark_used_region(arena, header, size, zeroed);
+    }
 
-    mark_free_region(node, prev_node, node->next);
+    spin_unlock(&arena->lock);
+    return payload;
 }
 
+// Frees a block of the arena, its lock must be held
+// The tags are checked first, a bad address or a double free panics
+static inline void free_block(heap_arena_t* arena, boundary_tag_t* header) {
+    if ((uint8_t*)header < arena->heap_start || (uint8_t*)header >= arena->heap_end
+        || ((size_t)get_payload(header) & (HEAP_ALIGNMENT - 1)) != 0)
+        PANIC("%p is not a block of the heap arena at %p", get_payload(header), arena->heap_start);
+
+    if (!header->used) PANIC("Heap block %p is already free", get_payload(header));
+
+    boundary_tag_t* footer = get_footer(header);
+    if ((uint8_t*)footer >= arena->heap_end || footer->size != header->size || !footer->used)
+        PANIC("Heap block %p is corrupted (size = %p)", get_payload(header), header->size);
+
+    mark_free_region(arena, header);
+    shrink_heap(arena);
+}
 
 static inline void*
-mark_used_region(free_mem_region_t* node, free_mem_region_t* next_node, size_t size) {
-    free_mem_region_t* used_node = node;
+mark_used_region(heap_arena_t* arena, boundary_tag_t* header, size_t size, bool zeroed) {
+    boundary_tag_t* used_header = header;
+    bool            was_zeroed  = header->zeroed;
 
-    // is there enough space to insert another node?
-    if (node->size > size + sizeof(free_mem_region_t)) {
+    // is there enough space to insert another block?
+    if (header->size >= size + TAGS_SIZE + MIN_PAYLOAD_SIZE) {
 
-        // add the used_node at the end of the current node
-        used_node       = (free_mem_region_t*)((size_t)node + sizeof(free_mem_region_t) + node->size
-                                         - sizeof(free_mem_region_t) - size);
-        used_node->size = size;
-        DEBUG("New node added: (start = %p, size = %p)\n", used_node, used_node->size);
+        // add the used block at the end of the current one, so the free one stays in the list
+        set_tags(header, header->size - size - TAGS_SIZE, false, was_zeroed);
+        used_header = (boundary_tag_t*)((uint8_t*)get_footer(header) + sizeof(boundary_tag_t));
+        set_tags(used_header, size, true, was_zeroed);
+        DEBUG("New node added: (start = %p, size = %p)\n", used_header, used_header->size);
 
-        node->size -= sizeof(free_mem_region_t) + used_node->size;
-        free_bytes -= sizeof(free_mem_region_t);
+        arena->free_bytes -= TAGS_SIZE;
+    }
+    else {
+        remove_free_region(arena, header);
+        set_tags(header, header->size, true, was_zeroed);
+    }
+
+    arena->free_bytes -= used_header->size;
+    DEBUG("Free space after alloc: %p\n", arena->free_bytes);
 
-        node->next      = used_node;
-        used_node->next = next_node;
+    // only the free list links have to be cleared in a zeroed block
+    if (!zeroed) return get_payload(used_header);
+    if (was_zeroed) memset(get_payload(used_header), 0, MIN_PAYLOAD_SIZE);
+    else memset(get_payload(used_header), 0, used_header->size);
+
+    return get_payload(used_header);
+}
+
+// Marks a block as free and merges it with its free neighbours
+static inline void mark_free_region(heap_arena_t* arena, boundary_tag_t* header) {
+    size_t size        = header->size;
+    arena->free_bytes += size;
+
+    // if the next block is free merge it
+    boundary_tag_t* next_header
+        = (boundary_tag_t*)((uint8_t*)get_footer(header) + sizeof(boundary_tag_t));
+    if ((uint8_t*)next_header < arena->heap_end && !next_header->used) {
+        remove_free_region(arena, next_header);
+        size              += next_header->size + TAGS_SIZE;
+        arena->free_bytes += TAGS_SIZE;
+        DEBUG("Next node removed: (start = %p, size = %p)\n", next_header, next_header->size);
+    }
+
+    // if the previous block is also free merge them together, it is already in the free list
+    if ((uint8_t*)header > arena->heap_start) {
+        boundary_tag_t* prev_footer = header - 1;
+        if (!prev_footer->used) {
+            boundary_tag_t* prev_header
+                = (boundary_tag_t*)((uint8_t*)prev_footer - prev_footer->size) - 1;
+            set_tags(prev_header, prev_header->size + size + TAGS_SIZE, false, false);
+            arena->free_bytes += TAGS_SIZE;
+            DEBUG("Node removed: (start = %p, size = %p)\n", header, size);
+            DEBUG("Free space after dealloc: %p\n", arena->free_bytes);
+            return;
+        }
     }
-    // mark the node as used
-    used_node->used  = true;
-    free_bytes      -= used_node->size;
-    DEBUG("Free space after alloc: %p\n", free_bytes);
 
-    memset((void*)((size_t)used_node + sizeof(free_mem_region_t)), 0, used_node->size);
-    return (void*)((size_t)used_node + sizeof(free_mem_region_t));
+    set_tags(header, size, false, false);
+    push_free_region(arena, header);
+    DEBUG("Free space after dealloc: %p\n", arena->free_bytes);
+}
+
+static inline void set_tags(boundary_tag_t* header, size_t size, bool used, bool zeroed) {
+    header->size   = size;
+    header->used   = used;
+    header->zeroed = zeroed;
+    *get_footer(header) = *header;
+}
+
+static inline boundary_tag_t* get_footer(boundary_tag_t* header) {
+    return (boundary_tag_t*)((uint8_t*)header + sizeof(boundary_tag_t) + header->size);
+}
+
+static inline void* get_payload(boundary_tag_t* header) { return header + 1; }
+
+static inline void push_free_region(heap_arena_t* arena, boundary_tag_t* header) {
+    free_mem_region_t* node = get_payload(header);
+
+    node->prev = NULL;
+    node->next = arena->root;
+    if (arena->root != NULL) arena->root->prev = node;
+    arena->root = node;
 }
 
-static inline void mark_free_region(
-    free_mem_region_t* node, free_mem_region_t* prev_node, free_mem_region_t* next_node
-) {
-    // TODO: same for next node
-    node->used  = false;
-    free_bytes += node->size;
+static inline void remove_free_region(heap_arena_t* arena, boundary_tag_t* header) {
+    free_mem_region_t* node = get_payload(header);
+
+    if (node->prev != NULL) node->prev->next = node->next;
+    else arena->root = node->next;
+    if (node->next != NULL) node->next->prev = node->prev;
+}
+
+// Returns the header of the block at the end of the heap
+static inline boundary_tag_t* get_last_header(heap_arena_t* arena) {
+    boundary_tag_t* last_footer = (boundary_tag_t*)arena->heap_end - 1;
+    return (boundary_tag_t*)((uint8_t*)last_footer - last_footer->size) - 1;
+}
 
-    // if the next node is free merge it
-    if (next_node != NULL && !next_node->used) {
-        node->size += next_node->size + sizeof(free_mem_region_t);
-        node->next  = next_node->next;
+// Moves the end of the heap to fit a block of the requested size (the pages are mapped on access)
+// Returns the header of a free block big enough, or NULL if the heap cannot grow
+static inline boundary_tag_t* grow_heap(heap_arena_t* arena, size_t size) {
+    boundary_tag_t* last_header = get_last_header(arena);
 
-        free_bytes += sizeof(free_mem_region_t);
-        DEBUG("Next node removed: (start = %p, size = %p)\n", next_node, next_node->size);
+    // a free last block is extended, otherwise a new block is added after it
+    size_t needed = last_header->used ? size + TAGS_SIZE : size - last_header->size;
+    if (needed < HEAP_GROW_SIZE) needed = HEAP_GROW_SIZE;
+    needed = (needed + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+
+    if (arena->heap_end + needed > arena->heap_start + HEAP_MAX_SIZE) {
+        DEBUG(
+            "Heap cannot grow (size = %p, requested = %p)\n",
+            arena->heap_end - arena->heap_start,
+            needed
+        );
+        return NULL;
     }
 
-    // if the previous node is also free merge them together
-    if (prev_node != NULL && !prev_node->used) {
-        prev_node->size += node->size + sizeof(free_mem_region_t);
-        prev_node->next  = next_node;
+    uint8_t* old_end  = arena->heap_end;
+    arena->heap_end  += needed;
+    DEBUG("Heap grown (end = %p)\n", arena->heap_end);
 
-        free_bytes += sizeof(free_mem_region_t);
-        DEBUG("Node removed: (start = %p, size = %p)\n", node, node->size);
+    arena->free_bytes += needed;
+    if (!last_header->used) {
+        // the old footer becomes part of the payload
+        boundary_tag_t* old_footer = get_footer(last_header);
+        set_tags(last_header, last_header->size + needed, false, last_header->zeroed);
+        memset(old_footer, 0, sizeof(boundary_tag_t));
+        return last_header;
     }
 
-    DEBUG("Free space after dealloc: %p\n", free_bytes);
+    boundary_tag_t* header = (boundary_tag_t*)old_end;
+    set_tags(header, needed - TAGS_SIZE, false, true);
+    push_free_region(arena, header);
+    arena->free_bytes -= TAGS_SIZE;
+
+    return header;
+}
+
+// Unmaps the pages at the end of the heap if they are part of a big enough free block
+static inline void shrink_heap(heap_arena_t* arena) {
+    boundary_tag_t* last_header = get_last_header(arena);
+    if (last_header->used) return;
+
+    // keep the header of the last block and a minimum sized payload mapped
+    uint8_t* new_end = (uint8_t*)last_header + TAGS_SIZE + MIN_PAYLOAD_SIZE;
+    new_end          = (uint8_t*)(((size_t)new_end + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1));
+    if (new_end < arena->heap_start + HEAP_INITIAL_SIZE)
+        new_end = arena->heap_start + HEAP_INITIAL_SIZE;
+
+    if (arena->heap_end < new_end + HEAP_SHRINK_SIZE) return;
+
+    size_t released = arena->heap_end - new_end;
+    set_tags(last_header, last_header->size - released, false, last_header->zeroed);
+    arena->free_bytes -= released;
+
+    // pages that were never touched are not mapped
+    // the frames are freed once no cpu has the pages in its TLB anymore (see unmap_range)
+    unmap_range(new_end, released, deallocate_frame, false);
+    arena->heap_end = new_end;
+    DEBUG("Heap shrunk (end = %p)\n", arena->heap_end);
 }
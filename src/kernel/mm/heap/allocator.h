@@ -3,9 +3,17 @@
 
 #include <stddef.h>
 
-#define HEAP_SIZE (100 * 0x400) // 100KiB
+// Every cpu has its own heap arena, it reserves HEAP_MAX_SIZE bytes of virtual memory but only
+// maps what it uses
+// The arenas are locked with interrupts enabled, interrupt handlers must not allocate
+#define HEAP_INITIAL_SIZE (16 * 0x400)   // 16KiB
+#define HEAP_GROW_SIZE    (16 * 0x400)   // 16KiB, minimum amount mapped when growing
+#define HEAP_SHRINK_SIZE  (64 * 0x400)   // 64KiB, minimum free tail unmapped when shrinking
+#define HEAP_MAX_SIZE     0x40000000     // 1GiB
 
-void  init_heap_allocator(void* start_address);
+void  init_heap_allocator();
 void* allocate(size_t size);
+void* allocate_zeroed(size_t size);
 void  deallocate(void* address);
+void  free_remote_deallocations();
 #endif
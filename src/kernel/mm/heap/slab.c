@@ -0,0 +1,324 @@
+#include "slab.h"
+#include "../../cpu/cpu.h"
+#include "../../log.h"
+#include "../../sync/spinlock.h"
+#include "../frame/allocator.h"
+#include "../frame/bitmap.h"
+#include "../paging/paging.h"
+#include <stdint.h>
+
+
+// 16, 32, 64, 128, 256, 512, 1024, 2048
+#define SIZE_CLASSES 8
+
+// Empty slabs kept mapped, the next ones are unmapped and their slot can be mapped again
+#define SLAB_EMPTY_CACHE 4
+#define SLAB_SLOTS       (SLAB_REGION_SIZE / SLAB_SIZE)
+
+// Second word of every free object, a freed object holding it is looked for in the free list
+#define SLAB_FREE_MAGIC 0x5ab0f7eeb10c5ab0
+
+typedef struct slab_t {
+    struct slab_t* next;
+    struct slab_t* prev;
+    void*          free_objects;
+    size_t         object_size; // 0 while the slab is empty and not assigned to a size class
+    size_t         used;
+    size_t         capacity;
+    uint32_t       cpu; // the only cpu changing the slab, the others hand its objects back
+} slab_t;
+
+// Every cpu allocates from its own slabs, with interrupts disabled instead of a lock
+// Objects freed by another cpu are pushed on the owner's remote_frees, a lock free stack with many
+// producers and a single consumer (the owner)
+typedef struct __attribute__((aligned(64))) {
+    slab_t* partial_slabs[SIZE_CLASSES]; // slabs with at least one free object
+    void*   remote_frees;                // linked through the first word of the objects
+} slab_cache_t;
+
+// Objects start after the slab header, 16 bytes aligned
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 15) & ~(size_t)15)
+
+static inline size_t  get_size_class(size_t size);
+static inline slab_t* get_empty_slab();
+static inline void    release_slab(slab_t* slab);
+static inline slab_t* map_slab();
+static inline void    unmap_slab(slab_t* slab);
+static inline void    init_slab(slab_t* slab, size_t size_class, uint32_t cpu);
+static inline slab_t* find_slab(const void* address);
+static inline void    free_object(slab_cache_t* cache, slab_t* slab, void* address);
+static inline void    push_remote_object(slab_cache_t* cache, void* address);
+static inline void    free_remote_objects(slab_cache_t* cache);
+static inline bool    is_free_object(const slab_t* slab, const void* object);
+static inline void    push_slab(slab_t** list, slab_t* slab);
+static inline void    remove_slab(slab_t** list, slab_t* slab);
+
+
+static uint8_t* slab_region_start;
+static uint8_t* next_slab;
+
+// Only touched by their cpu, with interrupts disabled (except for the remote frees)
+static slab_cache_t slab_caches[MAX_CPUS];
+
+// Slabs that are still mapped but not assigned to any cpu or size class
+static slab_t* empty_slabs;
+static size_t  empty_slabs_number;
+
+// A set bit marks a slot below next_slab whose slab was unmapped
+static uint64_t unmapped_slots_words[BITMAP_WORDS(SLAB_SLOTS)];
+static bitmap_t unmapped_slots;
+
+// Only taken when a cpu needs a new slab or gives back an empty one, not by allocations and frees
+// The slabs are mapped and unmapped without it, so the page tables are never locked under it
+static spinlock_t slab_lock = SPINLOCK_INIT;
+
+
+// required to use the other functions
+// The region is mapped a slab at a time, when all the slabs of a size class are full
+void init_slab_allocator(void* start_address) {
+    slab_region_start = start_address;
+    next_slab         = start_address;
+    init_bitmap(&unmapped_slots, unmapped_slots_words, SLAB_SLOTS);
+    DEBUG("Slab allocator initialized (start = %p, size = %p)\n", start_address, SLAB_REGION_SIZE);
+}
+
+// Returns an object of the smallest size class that fits the requested size (not initialized)
+// The caller must ensure that size <= SLAB_MAX_SIZE
+void* slab_allocate(size_t size) {
+    size_t        size_class = get_size_class(size);
+    uint64_t      rflags     = disable_interrupts();
+    slab_cache_t* cache      = &slab_caches[get_cpu_id()];
+
+    free_remote_objects(cache);
+    if (cache->partial_slabs[size_class] == NULL) {
+        // a new slab may have to be mapped, the thread can be moved to another cpu meanwhile
+        restore_interrupts(rflags);
+        slab_t* slab = get_empty_slab();
+        if (slab == NULL) return NULL;
+
+        rflags = disable_interrupts();
+        cache  = &slab_caches[get_cpu_id()];
+        init_slab(slab, size_class, get_cpu_id());
+        push_slab(&cache->partial_slabs[size_class], slab);
+    }
+
+    slab_t* slab           = cache->partial_slabs[size_class];
+    void*   object         = slab->free_objects;
+    slab->free_objects     = *(void**)object;
+    ((uint64_t*)object)[1] = 0; // not free anymore, see free_object
+    slab->used++;
+
+    if (slab->used == slab->capacity) remove_slab(&cache->partial_slabs[size_class], slab);
+
+    restore_interrupts(rflags);
+    return object;
+}
+
+// Panics if the address is not an object returned by slab_allocate, or if it was already freed
+// Objects of another cpu's slab are handed back to it without waiting, they are checked for double
+// frees when the owner takes them back
+void slab_deallocate(void* address) {
+    slab_t*  slab   = find_slab(address);
+    uint64_t rflags = disable_interrupts();
+    uint32_t cpu    = get_cpu_id();
+
+    if (slab->cpu != cpu) push_remote_object(&slab_caches[slab->cpu], address);
+    else {
+        free_remote_objects(&slab_caches[cpu]);
+        free_object(&slab_caches[cpu], slab, address);
+    }
+
+    restore_interrupts(rflags);
+}
+
+// Checks if the address is in the slab region (it may not be an object, see slab_deallocate)
+bool is_slab_address(const void* address) {
+    return slab_region_start != NULL && (uint8_t*)address >= slab_region_start
+        && (uint8_t*)address < slab_region_start + SLAB_REGION_SIZE;
+}
+
+// Frees the objects the other cpus handed back to the running cpu's slabs
+// Called by the idle loop, so they are not kept until the cpu allocates again
+void free_remote_slab_objects() {
+    uint64_t rflags = disable_interrupts();
+    free_remote_objects(&slab_caches[get_cpu_id()]);
+    restore_interrupts(rflags);
+}
+
+
+// 16 -> 0, 17..32 -> 1, 33..64 -> 2, ...
+static inline size_t get_size_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) return 0;
+    return 64 - __builtin_clzll(size - 1) - 4;
+}
+
+// Returns one of the empty slabs, or maps a new one (NULL if the region is full)
+static inline slab_t* get_empty_slab() {
+    uint64_t rflags = spin_lock_irqsave(&slab_lock);
+    slab_t*  slab   = empty_slabs;
+    if (slab != NULL) {
+        remove_slab(&empty_slabs, slab);
+        empty_slabs_number--;
+    }
+    spin_unlock_irqrestore(&slab_lock, rflags);
+
+    return slab != NULL ? slab : map_slab();
+}
+
+// Keeps the empty slab mapped for any cpu, or unmaps it if there are enough of them
+static inline void release_slab(slab_t* slab) {
+    slab->object_size = 0;
+
+    uint64_t rflags = spin_lock_irqsave(&slab_lock);
+    bool     unmap  = empty_slabs_number == SLAB_EMPTY_CACHE;
+    if (!unmap) {
+        push_slab(&empty_slabs, slab);
+        empty_slabs_number++;
+    }
+    spin_unlock_irqrestore(&slab_lock, rflags);
+
+    // nothing can reach the slab anymore
+    if (unmap) unmap_slab(slab);
+}
+
+// Maps a slab in an unmapped slot, or after the last one
+// The lock is only held to pick the slot, so the page tables are never locked under it
+// Returns NULL if the region is full
+static inline slab_t* map_slab() {
+    uint64_t rflags = spin_lock_irqsave(&slab_lock);
+    size_t   slot   = bitmap_find_first_set(&unmapped_slots);
+    uint8_t* slab   = NULL;
+
+    if (slot != BITMAP_NOT_FOUND) {
+        bitmap_clear(&unmapped_slots, slot);
+        slab = slab_region_start + slot * SLAB_SIZE;
+    }
+    else if (next_slab + SLAB_SIZE <= slab_region_start + SLAB_REGION_SIZE) {
+        slab = next_slab;
+        __atomic_store_n(&next_slab, next_slab + SLAB_SIZE, __ATOMIC_RELEASE); // see find_slab
+    }
+    spin_unlock_irqrestore(&slab_lock, rflags);
+
+    if (slab == NULL) return NULL;
+
+    map_range(
+        slab, MAP_NEW_FRAMES, SLAB_SIZE, PAGE_FLAG_WRITABLE | PAGE_FLAG_GLOBAL, allocate_frame
+    );
+    DEBUG("New slab mapped (start = %p)\n", slab);
+    return (slab_t*)slab;
+}
+
+// Gives the frames of an empty slab back, its slot can be mapped again once it is unmapped
+static inline void unmap_slab(slab_t* slab) {
+    unmap_range(slab, SLAB_SIZE, deallocate_frame, true);
+    DEBUG("Empty slab unmapped (start = %p)\n", slab);
+
+    uint64_t rflags = spin_lock_irqsave(&slab_lock);
+    bitmap_set(&unmapped_slots, ((uint8_t*)slab - slab_region_start) / SLAB_SIZE);
+    spin_unlock_irqrestore(&slab_lock, rflags);
+}
+
+// Assigns the slab to a cpu and a size class and links all of its objects in the free list
+static inline void init_slab(slab_t* slab, size_t size_class, uint32_t cpu) {
+    slab->cpu          = cpu;
+    slab->next         = NULL;
+    slab->prev         = NULL;
+    slab->object_size  = (size_t)SLAB_MIN_SIZE << size_class;
+    slab->used         = 0;
+    slab->capacity     = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->object_size;
+    slab->free_objects = NULL;
+
+    // link the objects from the last one, so they are handed out in address order
+    for (size_t i = slab->capacity; i > 0; i--) {
+        void* object           = (uint8_t*)slab + SLAB_HEADER_SIZE + (i - 1) * slab->object_size;
+        *(void**)object        = slab->free_objects;
+        ((uint64_t*)object)[1] = SLAB_FREE_MAGIC;
+        slab->free_objects     = object;
+    }
+}
+
+// Returns the slab of an allocated object, panics if the address is not one
+// The lock is not taken: the slot of an allocated object stays mapped and keeps its size class
+static inline slab_t* find_slab(const void* address) {
+    uint8_t* start = (uint8_t*)((size_t)address & ~((size_t)SLAB_SIZE - 1));
+    if (!is_slab_address(address) || start >= __atomic_load_n(&next_slab, __ATOMIC_ACQUIRE)
+        || bitmap_test(&unmapped_slots, (start - slab_region_start) / SLAB_SIZE))
+        PANIC("%p is not in a mapped slab", address);
+
+    // addresses in the header wrap around and are caught by the capacity check
+    slab_t* slab   = (slab_t*)start;
+    size_t  offset = (uint8_t*)address - start - SLAB_HEADER_SIZE;
+    if (slab->object_size == 0 || offset % slab->object_size != 0
+        || offset / slab->object_size >= slab->capacity)
+        PANIC("%p is not a slab object", address);
+
+    return slab;
+}
+
+// The running cpu owns the slab, interrupts are disabled
+// One partial slab is kept for each size class, the other empty ones are given back
+static inline void free_object(slab_cache_t* cache, slab_t* slab, void* address) {
+    size_t size_class = get_size_class(slab->object_size);
+
+    // the magic value can also be part of the object's data, only the free list is sure
+    if (slab->used == 0
+        || (((uint64_t*)address)[1] == SLAB_FREE_MAGIC && is_free_object(slab, address)))
+        PANIC("Slab object %p is already free", address);
+
+    *(void**)address        = slab->free_objects;
+    ((uint64_t*)address)[1] = SLAB_FREE_MAGIC;
+    slab->free_objects      = address;
+
+    // a full slab has a free object again
+    if (slab->used == slab->capacity) push_slab(&cache->partial_slabs[size_class], slab);
+    slab->used--;
+
+    if (slab->used == 0 && (slab->next != NULL || slab->prev != NULL)) {
+        remove_slab(&cache->partial_slabs[size_class], slab);
+        release_slab(slab);
+    }
+}
+
+static inline void push_remote_object(slab_cache_t* cache, void* address) {
+    void* head = __atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED);
+
+    do *(void**)address = head;
+    while (!__atomic_compare_exchange_n(
+        &cache->remote_frees, &head, address, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    ));
+}
+
+// The whole stack is taken at once, so the single consumer never races with the producers
+// An object pushed twice is found in its slab's free list the second time
+static inline void free_remote_objects(slab_cache_t* cache) {
+    if (__atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    void* object = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (object != NULL) {
+        void* next = *(void**)object;
+        free_object(cache, find_slab(object), object);
+        object = next;
+    }
+}
+
+static inline bool is_free_object(const slab_t* slab, const void* object) {
+    for (void* free = slab->free_objects; free != NULL; free = *(void**)free)
+        if (free == object) return true;
+    return false;
+}
+
+static inline void push_slab(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) (*list)->prev = slab;
+    *list = slab;
+}
+
+static inline void remove_slab(slab_t** list, slab_t* slab) {
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+
+    slab->next = NULL;
+    slab->prev = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef HEAP_SLAB_H
+#define HEAP_SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Every cpu has its own slabs, so allocations and frees do not take a lock
+// Slabs are SLAB_SIZE aligned, so the slab owning an object is found by masking its address
+#define SLAB_SIZE        (4 * 0x1000) // 16KiB
+#define SLAB_MIN_SIZE    16
+#define SLAB_MAX_SIZE    2048
+#define SLAB_REGION_SIZE 0x40000000 // 1GiB
+
+void  init_slab_allocator(void* start_address);
+void* slab_allocate(size_t size);
+void  slab_deallocate(void* address);
+bool  is_slab_address(const void* address);
+void  free_remote_slab_objects();
+
+#endif
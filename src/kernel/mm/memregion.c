@@ -0,0 +1,67 @@
+#include "memregion.h"
+#include "../lib/sort.h"
+
+
+static inline int compare_mem_regions(const void* a, const void* b);
+
+
+// Sorts the regions by start address
+void sort_mem_regions(mem_region_t regions[], size_t size) {
+    qsort(regions, size, sizeof(mem_region_t), compare_mem_regions);
+}
+
+// Merges overlapping and adjacent regions of a sorted array in place
+// Returns the number of regions left in the array
+size_t merge_mem_regions(mem_region_t regions[], size_t size) {
+    if (size == 0) return 0;
+
+    size_t merged = 0;
+    for (size_t i = 1; i < size; i++) {
+        if (regions[i].start <= regions[merged].end + 1) {
+            if (regions[i].end > regions[merged].end) regions[merged].end = regions[i].end;
+        }
+        else regions[++merged] = regions[i];
+    }
+
+    return merged + 1;
+}
+
+// Copies into free_regions the parts of memory not covered by a used region
+// The used regions must be sorted and merged, free_regions must fit used_regions_size + 1 regions
+// Returns the number of free regions
+size_t get_free_mem_regions(
+    mem_region_t       memory,
+    const mem_region_t used_regions[],
+    size_t             used_regions_size,
+    mem_region_t       free_regions[]
+) {
+    size_t   free_regions_size = 0;
+    uint8_t* free_start        = memory.start;
+
+    for (size_t i = 0; i < used_regions_size && free_start <= memory.end; i++) {
+        if (used_regions[i].end < free_start) continue;
+
+        if (used_regions[i].start > free_start) {
+            uint8_t* free_end = used_regions[i].start - 1;
+            if (free_end > memory.end) free_end = memory.end;
+
+            free_regions[free_regions_size++] = (mem_region_t){.start = free_start, .end = free_end};
+        }
+
+        // the last used region can end at the top of the address space
+        if (used_regions[i].end == (uint8_t*)-1) return free_regions_size;
+        free_start = used_regions[i].end + 1;
+    }
+
+    if (free_start <= memory.end)
+        free_regions[free_regions_size++] = (mem_region_t){.start = free_start, .end = memory.end};
+
+    return free_regions_size;
+}
+
+
+static inline int compare_mem_regions(const void* a, const void* b) {
+    if (((mem_region_t*)a)->start > ((mem_region_t*)b)->start) return 1;
+    if (((mem_region_t*)a)->start < ((mem_region_t*)b)->start) return -1;
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define MEMREGION_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -13,4 +14,14 @@ typedef struct {
     bool     executable;
 } mem_region_t;
 
+
+void   sort_mem_regions(mem_region_t regions[], size_t size);
+size_t merge_mem_regions(mem_region_t regions[], size_t size);
+size_t get_free_mem_regions(
+    mem_region_t       memory,
+    const mem_region_t used_regions[],
+    size_t             used_regions_size,
+    mem_region_t       free_regions[]
+);
+
 #endif
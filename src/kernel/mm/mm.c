@@ -1,20 +1,25 @@
 #include "mm.h"
 #include "../cpu/cpu.h"
+#include "../cpu/smp.h"
 #include "../drivers/tty.h"
-#include "../lib/sort.h"
 #include "../log.h"
 #include "frame/allocator.h"
 #include "heap/allocator.h"
+#include "heap/slab.h"
+#include "memregion.h"
 #include "multiboot2.h"
+#include "paging/addrspace.h"
+#include "paging/fault.h"
 #include "paging/paging.h"
 #include "paging/remap.h"
-#include "paging/tempallocator.h"
+#include "vma/vma.h"
 
 
-#define MAX_USED_REGIONS  20
-#define KERNEL_HEAP_START 0x40000000
-
-static inline int compare_mem_regions(const void* a, const void* b);
+// The lower half is left to user address spaces
+// The heap, vmalloc and the kernel stacks get their ranges from the VMA space
+#define KERNEL_VMA_START   0xffffc00000000000
+#define KERNEL_VMA_END     0xffffe00000000000
+#define KERNEL_SLABS_START 0xffffe00000000000
 
 
 void init_mm(void* multiboot_header) {
@@ -31,51 +36,71 @@ void init_mm(void* multiboot_header) {
     };
     mem_region_t multiboot_mem_region = get_multiboot_mem_region();
 
+    // The application processors start in real mode, so their first code must be below 1MiB
+    mem_region_t trampoline_mem_region = {
+        .start = (uint8_t*)SMP_TRAMPOLINE_ADDRESS,
+        .end   = (uint8_t*)SMP_TRAMPOLINE_ADDRESS + PAGE_SIZE - 1,
+    };
+
 
     // Initialize frame allocators
     DEBUG("Initializing frame allocators\n");
 
     mem_region_t system_memory = get_system_mem_region();
 
-    mem_region_t used_mem_regions[MAX_USED_REGIONS];
+    // Used regions are sorted and merged once, so the frame allocator only sees free ranges
+    mem_region_t used_mem_regions[get_used_mmap_regions_number() + 4];
     size_t       used_mem_regions_size = get_used_mmap_regions(used_mem_regions);
 
     used_mem_regions[used_mem_regions_size++] = vga_mem_region;
     used_mem_regions[used_mem_regions_size++] = multiboot_mem_region;
+    used_mem_regions[used_mem_regions_size++] = trampoline_mem_region;
     used_mem_regions[used_mem_regions_size++] = get_kernel_mem_region();
-    qsort(used_mem_regions, used_mem_regions_size, sizeof(mem_region_t), compare_mem_regions);
+    sort_mem_regions(used_mem_regions, used_mem_regions_size);
+    used_mem_regions_size = merge_mem_regions(used_mem_regions, used_mem_regions_size);
 
-    init_frame_allocator(system_memory, used_mem_regions, used_mem_regions_size);
-    init_temp_allocator();
+    mem_region_t free_mem_regions[used_mem_regions_size + 1];
+    size_t       free_mem_regions_size = get_free_mem_regions(
+        system_memory, used_mem_regions, used_mem_regions_size, free_mem_regions
+    );
+
+    init_frame_allocator(free_mem_regions, free_mem_regions_size);
 
 
     // Remap kernel
     DEBUG("Remapping kernel\n");
 
-    // Reuse the previously declared array and put inside of it the kernel's elf sections
-    used_mem_regions_size                     = get_allocated_elf_sections(used_mem_regions);
-    used_mem_regions[used_mem_regions_size++] = vga_mem_region;
-    used_mem_regions[used_mem_regions_size++] = multiboot_mem_region;
-    qsort(used_mem_regions, used_mem_regions_size, sizeof(mem_region_t), compare_mem_regions);
+    // The vga buffer and the multiboot struct are reached through the direct map
+    mem_region_t to_map[get_elf_sections_number()];
+    size_t       to_map_size = get_allocated_elf_sections(to_map);
+    sort_mem_regions(to_map, to_map_size);
 
-    remap_kernel(used_mem_regions, used_mem_regions_size);
+    const page_table_t* kernel_table4 = remap_kernel(to_map, to_map_size, system_memory.end);
 
+    // Frames shared by address spaces are counted, the counters are reached through the direct map
+    DEBUG("Initializing frame references\n");
+    init_frame_references(free_mem_regions, free_mem_regions_size);
 
-    // Map and initialize heap
-    DEBUG("Initializing heap allocator (heap address = %p)\n", KERNEL_HEAP_START);
+    // The kernel address space keeps PCID 0, new ones get their own PCID
+    DEBUG("Initializing address spaces\n");
+    init_address_spaces(kernel_table4);
 
-    for (uint64_t addr  = KERNEL_HEAP_START; addr <= KERNEL_HEAP_START + HEAP_SIZE - 1;
-         addr          += PAGE_SIZE) {
-        page_t page = {.fields.address = addr / PAGE_SIZE};
-        map_page_to_frame(page, PAGE_FLAG_WRITABLE, allocate_frame(), allocate_frame);
-    }
-    init_heap_allocator((void*)KERNEL_HEAP_START);
 
-    LOG("MMU initialized!\n");
-}
+    // Lazy areas are mapped by the page fault handler
+    DEBUG("Initializing page fault handler\n");
+    init_page_fault_handler();
+
+    // Slabs are mapped on demand, they also hold the VMA tree nodes
+    DEBUG("Initializing slab allocator (slabs address = %p)\n", KERNEL_SLABS_START);
+    init_slab_allocator((void*)KERNEL_SLABS_START);
 
-static inline int compare_mem_regions(const void* a, const void* b) {
-    if (((mem_region_t*)a)->start > ((mem_region_t*)b)->start) return 1;
-    if (((mem_region_t*)a)->start < ((mem_region_t*)b)->start) return -1;
-    return 0;
+    DEBUG("Initializing VMA space (start = %p, end = %p)\n", KERNEL_VMA_START, KERNEL_VMA_END);
+    init_vma((void*)KERNEL_VMA_START, (void*)KERNEL_VMA_END);
+
+    // Initialize heap (its area is lazy, the pages are mapped on demand)
+    DEBUG("Initializing heap allocator\n");
+    init_heap_allocator();
+
+    LOG("MMU initialized!\n");
+    print_frame_allocator_stats();
 }
@@ -1,5 +1,6 @@
 #include "multiboot2.h"
 #include "../log.h"
+#include "paging/page.h"
 #include <stdbool.h>
 
 
@@ -7,19 +8,33 @@ static uint8_t* multiboot_info_ptr = (uint8_t*)-1;
 
 
 static inline multiboot_tag_t* get_tag(uint32_t tag_type);
+static inline multiboot_tag_t* find_tag(uint32_t tag_type);
 static inline size_t           get_mem_regions_number(const multiboot_tag_mmap_t* memmap);
+static inline uint8_t*         get_section_physical_address(uint64_t address);
 
 
 // required to use the other functions
+// The address is physical, the struct is read through the direct map
 void init_multiboot_info(void* address) {
     if ((((uint64_t)address) & 7) != 0) PANIC("Multiboot address is not aligned (%d)", address);
     if (address == (void*)-1) PANIC("Multiboot address is not initialized");
 
-    multiboot_info_ptr = (uint8_t*)address;
+    multiboot_info_ptr = PHYS_TO_VIRT(address);
+}
+
+// Returns the number of memory regions not available for use
+size_t get_used_mmap_regions_number() {
+    multiboot_tag_mmap_t* memmap = (multiboot_tag_mmap_t*)get_tag(MULTIBOOT_TAG_TYPE_MMAP);
+    size_t                used_regions_number = 0;
+
+    for (size_t i = 0; i < get_mem_regions_number(memmap); i++)
+        if (memmap->entries[i].type != MULTIBOOT_MEMORY_AVAILABLE) used_regions_number++;
+
+    return used_regions_number;
 }
 
 // Copies all used memory regions into the first parameter
-// Ensure that when using it the array is big enough
+// Ensure that when using it the array is big enough (see get_used_mmap_regions_number)
 size_t get_used_mmap_regions(mem_region_t used_regions[]) {
     multiboot_tag_mmap_t* memmap = (multiboot_tag_mmap_t*)get_tag(MULTIBOOT_TAG_TYPE_MMAP);
     size_t                used_regions_number = 0;
@@ -65,11 +80,21 @@ mem_region_t get_system_mem_region() {
     return (mem_region_t){.start = 0x0, .end = highest_address};
 }
 
-// Returns the memory region used by the multiboot struct
+// Returns the copy of the ACPI RSDP made by the bootloader or -1 if there is none
+// The ACPI 2.0 one (with the XSDT address) is preferred
+const void* get_acpi_rsdp() {
+    multiboot_tag_t* tag = find_tag(MULTIBOOT_TAG_TYPE_ACPI_NEW);
+    if (tag == (void*)-1) tag = find_tag(MULTIBOOT_TAG_TYPE_ACPI_OLD);
+    if (tag == (void*)-1) return (void*)-1;
+
+    return ((multiboot_tag_acpi_t*)tag)->rsdp;
+}
+
+// Returns the (physical) memory region used by the multiboot struct
 mem_region_t get_multiboot_mem_region() {
     mem_region_t mem_region = {
-        .start = (uint8_t*)multiboot_info_ptr,
-        .end   = (uint8_t*)multiboot_info_ptr + (*multiboot_info_ptr) - 1,
+        .start = VIRT_TO_PHYS(multiboot_info_ptr),
+        .end   = (uint8_t*)VIRT_TO_PHYS(multiboot_info_ptr) + (*multiboot_info_ptr) - 1,
     };
     DEBUG(
         "Multiboot struct: start = %p, end = %p, size = %p\n",
@@ -80,7 +105,7 @@ mem_region_t get_multiboot_mem_region() {
     return mem_region;
 }
 
-// Returns the memory region used by the kernel
+// Returns the (physical) memory region used by the kernel
 mem_region_t get_kernel_mem_region() {
 
     multiboot_tag_elf_sections_t* sections_tag
@@ -95,9 +120,9 @@ mem_region_t get_kernel_mem_region() {
     DEBUG("Elf sections:\n");
     while (remaining > 0) {
         if (section->type != MULTIBOOT_ELF_SECTION_UNUSED) {
-            if (min > (uint8_t*)section->address) min = (uint8_t*)section->address;
-            if (max < (uint8_t*)section->address)
-                max = (uint8_t*)(section->address + section->size - 1);
+            uint8_t* address = get_section_physical_address(section->address);
+            if (min > address) min = address;
+            if (max < address) max = address + section->size - 1;
         }
         DEBUG(
             "\t address = %p, size = %p, flags = %p\n",
@@ -122,8 +147,16 @@ mem_region_t get_kernel_mem_region() {
     return mem_region;
 }
 
+// Returns the number of elf sections of the kernel
+size_t get_elf_sections_number() {
+    multiboot_tag_elf_sections_t* sections_tag
+        = (multiboot_tag_elf_sections_t*)get_tag(MULTIBOOT_TAG_TYPE_ELF_SECTIONS);
+    return sections_tag->num;
+}
+
 // Copies all allocated (in use) memory regions into the first parameter
-// Ensure that when using it the array is big enough
+// The regions hold the addresses the sections are linked at (see KERNEL_OFFSET)
+// Ensure that when using it the array is big enough (see get_elf_sections_number)
 size_t get_allocated_elf_sections(mem_region_t used_regions[]) {
     multiboot_tag_elf_sections_t* sections_tag
         = (multiboot_tag_elf_sections_t*)get_tag(MULTIBOOT_TAG_TYPE_ELF_SECTIONS);
@@ -156,14 +189,26 @@ size_t get_allocated_elf_sections(mem_region_t used_regions[]) {
 }
 
 
+// Sections linked in the higher half are loaded at their address - KERNEL_OFFSET
+static inline uint8_t* get_section_physical_address(uint64_t address) {
+    return (uint8_t*)(address >= KERNEL_OFFSET ? address - KERNEL_OFFSET : address);
+}
+
 // Returns the number of memory regions
 static inline size_t get_mem_regions_number(const multiboot_tag_mmap_t* memmap) {
     return ((size_t)memmap->size - (sizeof memmap)) / (size_t)memmap->entry_size;
 }
 
-// To avoid repeating code this function iterates through tags
-// and returns the first tag of the specified type
+// Returns the first tag of the specified type, the tag must exist
 static inline multiboot_tag_t* get_tag(uint32_t tag_type) {
+    multiboot_tag_t* tag = find_tag(tag_type);
+    if (tag == (void*)-1) PANIC("Multiboot tag (%d) not found!", tag_type);
+    return tag;
+}
+
+// To avoid repeating code this function iterates through tags
+// and returns the first tag of the specified type or -1 if there is none
+static inline multiboot_tag_t* find_tag(uint32_t tag_type) {
 
     // skips the first 8 bytes of the header: (total_size and reserved)
     multiboot_tag_t* tag = (multiboot_tag_t*)((uint8_t*)multiboot_info_ptr + 8);
@@ -173,6 +218,5 @@ static inline multiboot_tag_t* get_tag(uint32_t tag_type) {
         tag = (multiboot_tag_t*)((uint8_t*)tag + ((tag->size + 7) & ~7));
     }
 
-    PANIC("Multiboot tag (%d) not found!", tag_type);
     return (void*)-1;
 }
@@ -15,12 +15,15 @@
 
 void init_multiboot_info(void* address);
 
+size_t get_used_mmap_regions_number();
 size_t get_used_mmap_regions(mem_region_t regions[]);
+size_t get_elf_sections_number();
 size_t get_allocated_elf_sections(mem_region_t used_regions[]);
 
 mem_region_t get_system_mem_region();
 mem_region_t get_kernel_mem_region();
 mem_region_t get_multiboot_mem_region();
+const void*  get_acpi_rsdp();
 
 
 // Available multiboot info tags
@@ -120,6 +123,13 @@ typedef struct {
 } multiboot_tag_mmap_t;
 
 
+// Holds a copy of the RSDP (ACPI 1.0 or 2.0, depending on the tag type)
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint8_t  rsdp[];
+} multiboot_tag_acpi_t;
+
 // This struct would occupy 24 bits instead of 20
 typedef struct __attribute__((packed)) {
     uint32_t                type;
@@ -0,0 +1,275 @@
+#include "addrspace.h"
+#include "../../cpu/cpu.h"
+#include "../../cpu/percpu.h"
+#include "../../cpu/tlb.h"
+#include "../../lib/mem.h"
+#include "../../log.h"
+#include "../../sync/spinlock.h"
+#include "../frame/allocator.h"
+#include "../frame/bitmap.h"
+#include "helpers.h"
+#include "paging.h"
+
+
+// The lower half tables are walked from table3 (level 3) down to table1 (level 1)
+#define TABLE3_LEVEL 3
+
+static inline uint64_t get_cr3_value(const address_space_t* address_space);
+static inline bool     is_loaded(const address_space_t* address_space);
+static inline page_t   clone_table(page_t entry, size_t level);
+static inline void     release_table(page_t entry, size_t level);
+static inline page_t*  get_table1_entry(page_table_t* table4_ptr, page_t page);
+
+
+// A set bit marks an available PCID
+static uint64_t        pcid_words[BITMAP_WORDS(PCID_NUMBER)];
+static bitmap_t        pcids;
+static spinlock_t      pcids_lock = SPINLOCK_INIT;
+static bool            pcid_enabled;
+static address_space_t kernel_address_space;
+
+
+// required to use the other functions
+// kernel_table4 must be the running table4
+void init_address_spaces(const page_table_t* kernel_table4) {
+    kernel_address_space = (address_space_t){.table4 = kernel_table4, .pcid = KERNEL_PCID};
+
+    // Every kernel half entry points to a table3 from the start and new address spaces copy them
+    // so kernel mappings added later are seen by all the address spaces
+    page_table_t* table4_ptr = PHYS_TO_VIRT(kernel_table4);
+    for (size_t i = KERNEL_TABLE4_FIRST_ENTRY; i < PAGE_ENTRIES; i++)
+        get_or_create_next_table(table4_ptr, i, allocate_frame);
+
+    init_bitmap(&pcids, pcid_words, PCID_NUMBER);
+    for (size_t pcid = KERNEL_PCID + 1; pcid < PCID_NUMBER; pcid++) bitmap_set(&pcids, pcid);
+
+    pcid_enabled = enable_pcid();
+    DEBUG("PCIDs %s\n", pcid_enabled ? "enabled" : "not supported");
+}
+
+const address_space_t* get_kernel_address_space() { return &kernel_address_space; }
+
+// Creates an address space with an empty lower half, the kernel half is shared with the others
+// Its table4 is tagged with a free PCID, the kernel PCID is shared if there are none left
+address_space_t create_address_space() {
+    const page_table_t* table4            = allocate_frame();
+    page_table_t*       table4_ptr        = PHYS_TO_VIRT(table4);
+    page_table_t*       kernel_table4_ptr = PHYS_TO_VIRT(kernel_address_space.table4);
+
+    zero_table_entries(table4_ptr);
+    for (size_t i = KERNEL_TABLE4_FIRST_ENTRY; i < PAGE_ENTRIES; i++)
+        table4_ptr->entries[i] = kernel_table4_ptr->entries[i];
+
+    address_space_t address_space = {.table4 = table4, .pcid = KERNEL_PCID};
+    if (!pcid_enabled) return address_space;
+
+    uint64_t rflags = spin_lock_irqsave(&pcids_lock);
+    size_t   pcid   = bitmap_find_first_set(&pcids);
+    if (pcid != BITMAP_NOT_FOUND) {
+        bitmap_clear(&pcids, pcid);
+        address_space.pcid = pcid;
+    }
+    spin_unlock_irqrestore(&pcids_lock, rflags);
+
+    DEBUG("Address space created (table4 = %p, pcid = %d)\n", table4, address_space.pcid);
+    return address_space;
+}
+
+// Creates an address space sharing the parent's lower half frames instead of copying them
+// Writable pages become read only copy on write pages in both address spaces, the first write
+// to one of them gives the writer its own copy (see handle_copy_on_write)
+// Only the page tables are allocated, so the cost does not depend on the memory in use
+address_space_t clone_address_space(const address_space_t* parent) {
+    address_space_t child             = create_address_space();
+    page_table_t*   parent_table4_ptr = PHYS_TO_VIRT(parent->table4);
+    page_table_t*   child_table4_ptr  = PHYS_TO_VIRT(child.table4);
+
+    // the parent may be running (and faulting) on other cpus while its entries are changed
+    uint64_t rflags = lock_page_tables();
+    for (size_t i = 0; i < KERNEL_TABLE4_FIRST_ENTRY; i++)
+        if (parent_table4_ptr->entries[i].fields.present)
+            child_table4_ptr->entries[i]
+                = clone_table(parent_table4_ptr->entries[i], TABLE3_LEVEL);
+
+    // the parent's writable pages are now read only, on every cpu, before a write fault can copy
+    // one of them (the lock is held until then)
+    shootdown_address_space(parent->table4, parent->pcid);
+    unlock_page_tables(rflags);
+
+    DEBUG("Address space cloned (parent table4 = %p, table4 = %p)\n", parent->table4, child.table4);
+    return child;
+}
+
+// Drops the TLB entries tagged with the address space's PCID and makes the PCID available again
+// The lower half is freed, shared frames are only freed by the last address space using them
+void destroy_address_space(address_space_t* address_space) {
+    if (is_loaded(address_space))
+        PANIC("Cannot destroy a running address space (table4 = %p)", address_space->table4);
+
+    page_table_t* table4_ptr = PHYS_TO_VIRT(address_space->table4);
+    for (size_t i = 0; i < KERNEL_TABLE4_FIRST_ENTRY; i++)
+        if (table4_ptr->entries[i].fields.present)
+            release_table(table4_ptr->entries[i], TABLE3_LEVEL);
+
+    // every cpu that ran the address space may still have entries tagged with its PCID
+    if (address_space->pcid != KERNEL_PCID) {
+        shootdown_address_space(address_space->table4, address_space->pcid);
+
+        uint64_t rflags = spin_lock_irqsave(&pcids_lock);
+        bitmap_set(&pcids, address_space->pcid);
+        spin_unlock_irqrestore(&pcids_lock, rflags);
+    }
+
+    deallocate_frame(address_space->table4);
+    address_space->table4 = NULL;
+    address_space->pcid   = KERNEL_PCID;
+}
+
+// Loads the address space's table4 in CR3
+// The TLB entries of a tagged address space survive the switch, so they are not reloaded
+void switch_address_space(const address_space_t* address_space) {
+    uint64_t cr3 = get_cr3_value(address_space);
+    if ((read_cr3() & ~CR3_NO_FLUSH) == (cr3 & ~CR3_NO_FLUSH)) return;
+
+    DEBUG(
+        "Switching address space (table4 = %p, pcid = %d)\n",
+        address_space->table4,
+        address_space->pcid
+    );
+
+    // the cpu must not change between the write and the update of its per-cpu data
+    uint64_t rflags = disable_interrupts();
+    write_cr3(cr3);
+    get_running_cpu()->table4 = address_space->table4;
+    restore_interrupts(rflags);
+}
+
+// Invalidates a page of an address space, even if it is not the running one
+void invalidate_address_space_page(const address_space_t* address_space, void* virtual_page_addr) {
+    invalidate_pcid_page(address_space->pcid, virtual_page_addr);
+}
+
+// Called on write protection faults, gives the running address space its own copy of the page
+// The last address space using a frame takes it over without copying it
+// Returns false if the page is not a copy on write page
+bool handle_copy_on_write(void* address) {
+    page_t page = {.fields.address = (size_t)address / PAGE_SIZE};
+    if (get_table4_index(page) >= KERNEL_TABLE4_FIRST_ENTRY) return false;
+
+    // threads of the same address space can fault on the page at the same time
+    uint64_t rflags = lock_page_tables();
+    page_t*  entry  = get_table1_entry(get_active_table4(), page);
+    if (entry == (void*)-1 || !entry->fields.present || !entry->fields.copy_on_write) {
+        unlock_page_tables(rflags);
+
+        // a cpu that lost the race finds the page already writable
+        return entry != (void*)-1 && entry->fields.present && entry->fields.writable;
+    }
+
+    const void* frame  = (void*)((size_t)entry->fields.address * PAGE_SIZE);
+    bool        copied = get_frame_references(frame) > 1;
+    if (copied) {
+        const void* copy = allocate_frame();
+        copy_page(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(frame));
+        entry->fields.address = (size_t)copy / PAGE_SIZE;
+        release_frame(frame);
+    }
+
+    entry->fields.copy_on_write = false;
+    entry->fields.writable      = true;
+
+    // the other threads of the address space may still read the old frame through their TLB
+    if (copied) shootdown_tlb_pages(get_page_address(page), 1, false);
+    else flush_tlb_page(get_page_address(page));
+    unlock_page_tables(rflags);
+    return true;
+}
+
+
+// Address spaces sharing the kernel PCID must flush its entries, the other ones keep them
+static inline uint64_t get_cr3_value(const address_space_t* address_space) {
+    uint64_t cr3 = (uint64_t)address_space->table4 & CR3_ADDRESS_MASK;
+    if (!pcid_enabled || address_space->pcid == KERNEL_PCID) return cr3;
+
+    return cr3 | address_space->pcid | CR3_NO_FLUSH;
+}
+
+// Checks if a cpu has the address space's table4 in CR3 (see switch_address_space)
+static inline bool is_loaded(const address_space_t* address_space) {
+    if ((read_cr3() & CR3_ADDRESS_MASK) == (uint64_t)address_space->table4) return true;
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++)
+        if (__atomic_load_n(&get_cpu(id)->table4, __ATOMIC_ACQUIRE) == address_space->table4)
+            return true;
+    return false;
+}
+
+// Returns an entry like the given one, pointing to a copy of its table
+// The tables are copied, the frames mapped by the table1s are shared
+static inline page_t clone_table(page_t entry, size_t level) {
+    if (entry.fields.huge_page) PANIC("Huge pages cannot be shared (entry = %p)", entry.bits);
+
+    page_table_t* table_ptr = PHYS_TO_VIRT((size_t)entry.fields.address * PAGE_SIZE);
+    const void*   copy      = allocate_frame();
+    page_table_t* copy_ptr  = PHYS_TO_VIRT(copy);
+
+    for (size_t i = 0; i < PAGE_ENTRIES; i++) {
+        page_t* table_entry = &table_ptr->entries[i];
+
+        if (!table_entry->fields.present) copy_ptr->entries[i].bits = 0;
+        else if (level > 1) copy_ptr->entries[i] = clone_table(*table_entry, level - 1);
+        else {
+            if (table_entry->fields.writable) {
+                table_entry->fields.writable      = false;
+                table_entry->fields.copy_on_write = true;
+            }
+            reference_frame((void*)((size_t)table_entry->fields.address * PAGE_SIZE));
+            copy_ptr->entries[i] = *table_entry;
+        }
+    }
+
+    entry.fields.address = (size_t)copy / PAGE_SIZE;
+    return entry;
+}
+
+// Frees the table the entry points to, its subtables and the frames they map
+static inline void release_table(page_t entry, size_t level) {
+    const void* frame = (void*)((size_t)entry.fields.address * PAGE_SIZE);
+
+    // huge pages are never shared (see clone_table)
+    if (entry.fields.huge_page) {
+        size_t page_size = level == 1 ? PAGE_SIZE_2MIB : PAGE_SIZE_1GIB;
+        frame            = (void*)((size_t)frame & ~(page_size - 1));
+        deallocate_frames(frame, __builtin_ctzll(page_size / PAGE_SIZE));
+        return;
+    }
+
+    if (level == 0) {
+        release_frame(frame);
+        return;
+    }
+
+    page_table_t* table_ptr = PHYS_TO_VIRT(frame);
+    for (size_t i = 0; i < PAGE_ENTRIES; i++)
+        if (table_ptr->entries[i].fields.present) release_table(table_ptr->entries[i], level - 1);
+
+    deallocate_frame(frame);
+}
+
+// Returns the table1 entry mapping the page or -1 if there is no table1 for it
+static inline page_t* get_table1_entry(page_table_t* table4_ptr, page_t page) {
+    page_table_t* table_ptr = table4_ptr;
+    size_t        indexes[] = {
+        get_table4_index(page),
+        get_table3_index(page),
+        get_table2_index(page),
+    };
+
+    for (size_t i = 0; i < 3; i++) {
+        page_t entry = table_ptr->entries[indexes[i]];
+        if (!entry.fields.present || entry.fields.huge_page) return (void*)-1;
+        table_ptr = next_table(table_ptr, indexes[i]);
+    }
+
+    return &table_ptr->entries[get_table1_index(page)];
+}
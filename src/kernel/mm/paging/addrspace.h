@@ -0,0 +1,33 @@
+#ifndef PAGING_ADDRSPACE_H
+#define PAGING_ADDRSPACE_H
+
+
+#include "page.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// PCIDs are 12 bits wide, PCID 0 belongs to the kernel address space
+// Address spaces share PCID 0 when PCIDs are not supported or all of them are in use
+#define PCID_NUMBER 4096
+#define KERNEL_PCID 0
+
+// The higher half (table4 entries 256-511) holds the kernel and is the same in every address space
+#define KERNEL_TABLE4_FIRST_ENTRY 256
+
+typedef struct {
+    const page_table_t* table4; // physical address
+    uint16_t            pcid;
+} address_space_t;
+
+
+void                   init_address_spaces(const page_table_t* kernel_table4);
+const address_space_t* get_kernel_address_space();
+address_space_t        create_address_space();
+address_space_t        clone_address_space(const address_space_t* parent);
+void                   destroy_address_space(address_space_t* address_space);
+void                   switch_address_space(const address_space_t* address_space);
+void invalidate_address_space_page(const address_space_t* address_space, void* virtual_page_addr);
+bool handle_copy_on_write(void* address);
+
+#endif
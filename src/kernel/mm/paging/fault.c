@@ -0,0 +1,85 @@
+#include "fault.h"
+#include "../../cpu/cpu.h"
+#include "../../cpu/idt.h"
+#include "../../lib/mem.h"
+#include "../../log.h"
+#include "../frame/allocator.h"
+#include "../vma/vma.h"
+#include "addrspace.h"
+#include "paging.h"
+
+
+// Page fault error code bits
+#define PAGE_FAULT_PRESENT     0x1 // the page was present (protection violation)
+#define PAGE_FAULT_WRITE       0x2
+#define PAGE_FAULT_INSTRUCTION 0x10
+
+static inline void handle_page_fault(interrupt_frame_t* frame);
+static inline bool is_guard_page(const uint8_t* page);
+
+
+static uint8_t* guard_pages[MAX_GUARD_PAGES];
+static size_t   guard_pages_size;
+
+
+// required to use lazy areas and guard pages
+void init_page_fault_handler() { set_interrupt_handler(PAGE_FAULT_VECTOR, handle_page_fault); }
+
+// Accessing a guard page is reported as a stack overflow instead of a generic page fault
+// Used for the pages outside of the VMA space (VMA_GUARD areas are recognized on their own)
+// The page must not be mapped
+void register_guard_page(void* page) {
+    if (guard_pages_size == MAX_GUARD_PAGES) PANIC("Too many guard pages");
+    guard_pages[guard_pages_size++] = page;
+}
+
+
+// Runs on its own interrupt stack (see IST_PAGE_FAULT), so it works even if the stack overflowed
+// It must not cause page faults itself, they would overwrite its stack
+static inline void handle_page_fault(interrupt_frame_t* frame) {
+    uint8_t* address = (uint8_t*)read_cr2();
+    uint8_t* page    = (uint8_t*)((size_t)address & ~((size_t)PAGE_SIZE - 1));
+
+    // pages shared by cloned address spaces are copied on the first write
+    if ((frame->error_code & PAGE_FAULT_PRESENT) != 0 && (frame->error_code & PAGE_FAULT_WRITE) != 0
+        && handle_copy_on_write(address))
+        return;
+
+    // takes vma_lock, safe because vma.c never allocates or touches lazy areas while holding it
+    vma_t* vma = find_vma(address);
+
+    if (is_guard_page(page) || (vma != NULL && (vma->flags & VMA_GUARD) != 0 && page == vma->start))
+        PANIC("Guard page hit at %p (rip = %p), stack overflow\n", address, frame->rip);
+
+    if (vma != NULL && (vma->flags & VMA_LAZY) != 0
+        && (frame->error_code & PAGE_FAULT_PRESENT) == 0) {
+        const void* frame_ptr = allocate_frame();
+        zero_page(PHYS_TO_VIRT(frame_ptr));
+
+        // another cpu may have faulted on the same page and mapped it first
+        if (!try_map_page_to_frame(
+                (page_t){.fields.address = (size_t)page / PAGE_SIZE},
+                vma->page_flags,
+                frame_ptr,
+                allocate_frame
+            ))
+            deallocate_frame(frame_ptr);
+        return;
+    }
+
+    print_interrupt_frame(frame);
+    PANIC(
+        "Page fault at %p (%s%s%s, rip = %p)\n",
+        address,
+        (frame->error_code & PAGE_FAULT_PRESENT) != 0 ? "protection" : "not present",
+        (frame->error_code & PAGE_FAULT_WRITE) != 0 ? ", write" : ", read",
+        (frame->error_code & PAGE_FAULT_INSTRUCTION) != 0 ? ", fetch" : "",
+        frame->rip
+    );
+}
+
+static inline bool is_guard_page(const uint8_t* page) {
+    for (size_t i = 0; i < guard_pages_size; i++)
+        if (guard_pages[i] == page) return true;
+    return false;
+}
@@ -0,0 +1,10 @@
+#ifndef PAGING_FAULT_H
+#define PAGING_FAULT_H
+
+#define MAX_GUARD_PAGES 32
+
+
+void init_page_fault_handler();
+void register_guard_page(void* page);
+
+#endif
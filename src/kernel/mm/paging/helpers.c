@@ -1,4 +1,6 @@
 #include "helpers.h"
+#include "../../cpu/cpu.h"
+#include "../../lib/mem.h"
 #include "../../log.h"
 
 
@@ -10,31 +12,73 @@ inline size_t get_table2_index(page_t entry) { return ((size_t)entry.fields.addr
 
 inline size_t get_table1_index(page_t entry) { return ((size_t)entry.fields.address >> 0) & 0777; }
 
-inline void zero_table_entries(page_table_t* table) {
-    for (int i = 0; i < PAGE_ENTRIES; i++) table->entries[i].bits = 0;
+// Returns the canonical virtual address of the page (bit 47 is copied in the upper bits)
+inline void* get_page_address(page_t page) {
+    size_t address = ((size_t)page.fields.address * PAGE_SIZE) & 0x0000ffffffffffff;
+    if ((address & 0x0000800000000000) != 0) address |= 0xffff000000000000;
+    return (void*)address;
 }
 
+inline void zero_table_entries(page_table_t* table) { zero_page(table); }
+
+// Returns the table4 loaded in CR3, through the direct map
+inline page_table_t* get_active_table4() { return PHYS_TO_VIRT(read_cr3() & CR3_ADDRESS_MASK); }
+
+// Returns -1 if the entry is not present or maps a huge page (it does not point to a table)
 inline page_table_t* next_table(const page_table_t* table, size_t index) {
     const page_t* entry = &(table->entries[index]);
-    if (!entry->fields.present) return (void*)-1;
-    if (entry->fields.huge_page)
-        PANIC("Huge pages not supported! (Table entry %d is a huge page)", entry->bits);
+    if (!entry->fields.present || entry->fields.huge_page) return (void*)-1;
 
-    return (page_table_t*)(((size_t)table << 9) | (index << 12));
+    return PHYS_TO_VIRT((size_t)entry->fields.address * PAGE_SIZE);
 }
 
+// A huge page entry has to be split first (see split_huge_page), it would be overwritten
 inline page_table_t*
 get_or_create_next_table(page_table_t* table, size_t index, allocate_frame_t allocate_frame) {
+    if (table->entries[index].fields.present && table->entries[index].fields.huge_page)
+        PANIC("Table entry %p maps a huge page, it has to be split", table->entries[index].bits);
 
     // if the next table does not exist, allocate a frame for a new one
     if (next_table(table, index) == (void*)-1) {
 
         DEBUG("(get_or_create_next_table) Creating next table\n");
-        table->entries[index].fields.address  = (size_t)allocate_frame() / PAGE_SIZE;
-        table->entries[index].fields.present  = true;
+        const void* frame = allocate_frame();
+
+        // cleared before it is linked, so the lookups that do not lock the tables never see
+        // stale entries
+        zero_table_entries(PHYS_TO_VIRT(frame));
+        table->entries[index].fields.address  = (size_t)frame / PAGE_SIZE;
         table->entries[index].fields.writable = true;
-        zero_table_entries(next_table(table, index));
+        table->entries[index].fields.present  = true;
     }
 
     return next_table(table, index);
 }
+
+// Replaces a 1GiB (table3) or 2MiB (table2) entry with a table of 2MiB or 4KiB entries mapping the
+// same frames with the same flags
+// The translations do not change, so the TLB entry of the huge page is still right until one of the
+// new entries changes (and invalidating any page of the huge page drops it)
+inline page_table_t* split_huge_page(
+    page_table_t* table, size_t index, size_t page_size, allocate_frame_t allocate_frame
+) {
+    page_t   entry      = table->entries[index];
+    size_t   entry_size = page_size == PAGE_SIZE_1GIB ? PAGE_SIZE_2MIB : PAGE_SIZE;
+    uint64_t flags      = entry.bits & PAGE_FLAG_MASK;
+    if (entry_size == PAGE_SIZE) flags &= ~(uint64_t)PAGE_FLAG_HUGE_PAGE;
+
+    // in huge page entries the lowest address bits are reserved (or hold the PAT bit)
+    size_t        frame     = ((size_t)entry.fields.address * PAGE_SIZE) & ~(page_size - 1);
+    const void*   new_table = allocate_frame();
+    page_table_t* table_ptr = PHYS_TO_VIRT(new_table);
+    for (size_t i = 0; i < PAGE_ENTRIES; i++)
+        table_ptr->entries[i].bits = flags | (frame + i * entry_size);
+
+    // filled before it is linked, like the new tables of get_or_create_next_table
+    __atomic_store_n(
+        &table->entries[index].bits,
+        (uint64_t)new_table | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITABLE,
+        __ATOMIC_RELEASE
+    );
+    return table_ptr;
+}
@@ -10,10 +10,16 @@ size_t get_table3_index(page_t entry);
 size_t get_table2_index(page_t entry);
 size_t get_table1_index(page_t entry);
 
-void zero_table_entries(page_table_t* table);
+void* get_page_address(page_t page);
+
+void          zero_table_entries(page_table_t* table);
+page_table_t* get_active_table4();
 
 page_table_t* next_table(const page_table_t* table, size_t index);
 page_table_t*
 get_or_create_next_table(page_table_t* table, size_t index, allocate_frame_t allocate_frame);
+page_table_t* split_huge_page(
+    page_table_t* table, size_t index, size_t page_size, allocate_frame_t allocate_frame
+);
 
 #endif
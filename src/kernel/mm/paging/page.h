@@ -8,6 +8,10 @@
 #define PAGE_SIZE    0x1000
 #define PAGE_ENTRIES 512
 
+// Huge pages are mapped by table2 (2MiB) and table3 (1GiB) entries
+#define PAGE_SIZE_2MIB 0x200000
+#define PAGE_SIZE_1GIB 0x40000000
+
 
 typedef union {
 #define PAGE_FLAG_PRESENT        0x1
@@ -19,6 +23,7 @@ typedef union {
 #define PAGE_FLAG_DIRTY          0x40
 #define PAGE_FLAG_HUGE_PAGE      0x80
 #define PAGE_FLAG_GLOBAL         0x100
+#define PAGE_FLAG_COPY_ON_WRITE  0x200 // available to the os, set on pages shared by clones
 #define PAGE_FLAG_NO_EXECUTE     0x8000000000000000
 #define PAGE_FLAG_MASK           0x80000000000001ff
     struct {
@@ -31,7 +36,8 @@ typedef union {
         bool dirty           : 1;
         bool huge_page       : 1;
         bool global          : 1;
-        int                  : 3;
+        bool copy_on_write   : 1;
+        int                  : 2;
         uint64_t address     : 40;
         int                  : 11;
         bool no_execute      : 1;
@@ -44,7 +50,15 @@ typedef struct {
 } page_table_t;
 
 
-// The last entry of the page map level4 table is mapped to itself in boot.asm
-#define TABLE4_PTR ((page_table_t*)0xfffffffffffff000)
+// All the physical memory is mapped at PHYS_OFFSET (higher half direct map) with huge pages
+// boot.asm only maps the first GiB there, the rest is mapped by remap_kernel
+#define PHYS_OFFSET 0xffff800000000000
+
+#define PHYS_TO_VIRT(address) ((void*)((size_t)(address) + PHYS_OFFSET))
+#define VIRT_TO_PHYS(address) ((void*)((size_t)(address) - PHYS_OFFSET))
+
+// The kernel is linked at its physical address + KERNEL_OFFSET (see linker.*.ld)
+// Only the boot code, which runs before the higher half is mapped, is linked below it
+#define KERNEL_OFFSET 0xffffffff80000000
 
 #endif
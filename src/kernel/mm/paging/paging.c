@@ -1,12 +1,47 @@
 #include "paging.h"
 #include "../../cpu/cpu.h"
+#include "../../cpu/tlb.h"
 #include "../../log.h"
+#include "../../sync/spinlock.h"
 #include "helpers.h"
 
 
 #define LOWER_HALF_TOP_ADDRESS     (0x0000800000000000 - 1)
 #define HIGHER_HALF_BOTTOM_ADDRESS 0xffff800000000000
 
+// unmap_range frees the frames of this many pages at a time, after the TLBs are flushed
+#define UNMAP_BATCH_SIZE 64
+
+static inline page_t*
+get_huge_page_entry(page_table_t* table4, page_t page, size_t page_size);
+static inline size_t        get_huge_page_frame(page_t entry, size_t page_size);
+static inline page_table_t* get_table1(page_table_t* table4, page_t page);
+static inline page_table_t*
+get_or_create_table1(page_table_t* table4, page_t page, allocate_frame_t allocate_frame);
+static inline page_table_t* get_or_split_next_table(
+    page_table_t* table, size_t index, size_t page_size, allocate_frame_t allocate_frame
+);
+static inline void free_unmapped_frames(
+    void*              start,
+    size_t             pages,
+    bool               global,
+    const void*        frames[],
+    size_t             frames_size,
+    deallocate_frame_t deallocate_frame
+);
+
+
+// Serializes the changes to the page tables, the kernel half is shared by every cpu
+// New tables are cleared before they are linked (see get_or_create_next_table), so the lookups
+// (e.g. get_physical_address) walk the tables without it
+static spinlock_t page_tables_lock = SPINLOCK_INIT;
+
+
+// Held while changing page table entries outside of the functions below (e.g. by addrspace.c)
+// Only the frame allocator can be called while holding it
+uint64_t lock_page_tables() { return spin_lock_irqsave(&page_tables_lock); }
+
+void unlock_page_tables(uint64_t rflags) { spin_unlock_irqrestore(&page_tables_lock, rflags); }
 
 const void* get_physical_address(void* virtual) {
 
@@ -20,18 +55,30 @@ const void* get_physical_address(void* virtual) {
 
     page_t page = {.fields.address = (size_t) virtual / PAGE_SIZE};
 
-    page_table_t* table3_ptr = next_table(TABLE4_PTR, get_table4_index(page));
+    page_table_t* table3_ptr = next_table(get_active_table4(), get_table4_index(page));
     if (table3_ptr == (void*)-1) {
         DEBUG("(get_physical_address) Page table 3 is empty, (addr = %p)\n", page.bits);
         return (void*)-1;
     }
 
+    // 1GiB pages are mapped directly by table3
+    page_t table3_entry = table3_ptr->entries[get_table3_index(page)];
+    if (table3_entry.fields.present && table3_entry.fields.huge_page)
+        return (void*)(get_huge_page_frame(table3_entry, PAGE_SIZE_1GIB)
+                       + (size_t) virtual % PAGE_SIZE_1GIB);
+
     page_table_t* table2_ptr = next_table(table3_ptr, get_table3_index(page));
     if (table2_ptr == (void*)-1) {
         DEBUG("(get_physical_address) Page table 2 is empty, (addr = %p)\n", page.bits);
         return (void*)-1;
     }
 
+    // 2MiB pages are mapped directly by table2
+    page_t table2_entry = table2_ptr->entries[get_table2_index(page)];
+    if (table2_entry.fields.present && table2_entry.fields.huge_page)
+        return (void*)(get_huge_page_frame(table2_entry, PAGE_SIZE_2MIB)
+                       + (size_t) virtual % PAGE_SIZE_2MIB);
+
     page_table_t* table1_ptr = next_table(table2_ptr, get_table2_index(page));
     if (table1_ptr == (void*)-1) {
         DEBUG("(get_physical_address) Page table 1 is empty, (addr = %p)\n", page.bits);
@@ -55,60 +102,326 @@ void identity_map(uint64_t page_flags, const void* frame_ptr, allocate_frame_t a
 void map_page_to_frame(
     page_t page, uint64_t page_flags, const void* frame_ptr, allocate_frame_t allocate_frame
 ) {
-
-    page_table_t* table3_ptr
-        = get_or_create_next_table(TABLE4_PTR, get_table4_index(page), allocate_frame);
-    page_table_t* table2_ptr
-        = get_or_create_next_table(table3_ptr, get_table3_index(page), allocate_frame);
-    page_table_t* table1_ptr
-        = get_or_create_next_table(table2_ptr, get_table2_index(page), allocate_frame);
-
-    page_t* table1_entry = &(table1_ptr->entries[get_table1_index(page)]);
-
-    if (table1_entry->bits != 0)
+    if (!try_map_page_to_frame(page, page_flags, frame_ptr, allocate_frame))
         PANIC(
             "Page %p is already in use (points to %p)",
             page.bits,
-            (size_t)table1_entry->fields.address * PAGE_SIZE
+            get_physical_address(get_page_address(page))
         );
-    table1_entry->bits           |= (page_flags | PAGE_FLAG_PRESENT) & PAGE_FLAG_MASK;
-    table1_entry->fields.address  = (size_t)frame_ptr / PAGE_SIZE;
+}
+
+// Same as map_page_to_frame, but returns false instead of panicking if the page is in use
+// Used when another cpu may map the page first (e.g. on a fault in a lazy area)
+bool try_map_page_to_frame(
+    page_t page, uint64_t page_flags, const void* frame_ptr, allocate_frame_t allocate_frame
+) {
+    uint64_t      rflags       = lock_page_tables();
+    page_table_t* table1_ptr   = get_or_create_table1(get_active_table4(), page, allocate_frame);
+    page_t*       table1_entry = &(table1_ptr->entries[get_table1_index(page)]);
+    bool          free         = table1_entry->bits == 0;
+
+    if (free) {
+        table1_entry->bits           |= (page_flags | PAGE_FLAG_PRESENT) & PAGE_FLAG_MASK;
+        table1_entry->fields.address  = (size_t)frame_ptr / PAGE_SIZE;
+    }
+
+    unlock_page_tables(rflags);
+    return free;
 }
 
 void unmap_page(page_t page, deallocate_frame_t deallocate_frame, bool panic_on_empty) {
-    page_table_t* table3_ptr = next_table(TABLE4_PTR, get_table4_index(page));
-    if (table3_ptr == (void*)-1) {
-        DEBUG("(unmap_page) Page table 3 is empty, (page = %p)\n", page.bits);
-        if (panic_on_empty) PANIC("(unmap_page) Page table 3 is empty, (page = %p)\n", page.bits);
+    uint64_t      rflags     = lock_page_tables();
+    page_table_t* table1_ptr = get_table1(get_active_table4(), page);
+    page_t*       table1_entry
+        = table1_ptr == (void*)-1 ? (void*)-1 : &table1_ptr->entries[get_table1_index(page)];
+
+    if (table1_entry == (void*)-1 || !table1_entry->fields.present) {
+        unlock_page_tables(rflags);
+        DEBUG("(unmap_page) Page is not mapped, (page = %p)\n", page.bits);
+        if (panic_on_empty) PANIC("(unmap_page) Page is not mapped, (page = %p)\n", page.bits);
         return;
     }
 
-    page_table_t* table2_ptr = next_table(table3_ptr, get_table3_index(page));
-    if (table2_ptr == (void*)-1) {
-        DEBUG("(unmap_page) Page table 2 is empty, (page = %p)\n", page.bits);
-        if (panic_on_empty) PANIC("(unmap_page) Page table 2 is empty, (page = %p)\n", page.bits);
-        return;
+    const void* frame_ptr = (void*)((size_t)table1_entry->fields.address * PAGE_SIZE);
+
+    bool        global    = table1_entry->fields.global;
+
+    // the other cpus may still use the frame until their TLB is flushed
+    table1_entry->bits = 0;
+    shootdown_tlb_pages(get_page_address(page), 1, global);
+    unlock_page_tables(rflags);
+
+    deallocate_frame(frame_ptr);
+}
+
+// Maps length bytes starting from virtual_start to contiguous frames starting from frame_start
+// If frame_start is MAP_NEW_FRAMES every page is mapped to a new frame from allocate_frame
+void map_range(
+    void*            virtual_start,
+    const void*      frame_start,
+    size_t           length,
+    uint64_t         page_flags,
+    allocate_frame_t allocate_frame
+) {
+    map_range_in(
+        get_active_table4(), virtual_start, frame_start, length, page_flags, allocate_frame
+    );
+}
+
+// Same as map_range, but the pages are mapped in table4 (it does not need to be the active one)
+// The tables are walked once for each table1, instead of once for each page
+void map_range_in(
+    page_table_t*    table4,
+    void*            virtual_start,
+    const void*      frame_start,
+    size_t           length,
+    uint64_t         page_flags,
+    allocate_frame_t allocate_frame
+) {
+    if (((size_t)virtual_start & (PAGE_SIZE - 1)) != 0
+        || (frame_start != MAP_NEW_FRAMES && ((size_t)frame_start & (PAGE_SIZE - 1)) != 0))
+        PANIC("Range %p (frames %p) is not aligned", virtual_start, frame_start);
+
+    size_t        pages      = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    page_table_t* table1_ptr = (void*)-1;
+    uint64_t      rflags     = lock_page_tables();
+
+    for (size_t i = 0; i < pages; i++) {
+        page_t page = {.fields.address = (size_t)virtual_start / PAGE_SIZE + i};
+
+        if (table1_ptr == (void*)-1 || get_table1_index(page) == 0)
+            table1_ptr = get_or_create_table1(table4, page, allocate_frame);
+
+        page_t* table1_entry = &table1_ptr->entries[get_table1_index(page)];
+        if (table1_entry->bits != 0)
+            PANIC(
+                "Page %p is already in use (points to %p)",
+                (uint8_t*)virtual_start + i * PAGE_SIZE,
+                (size_t)table1_entry->fields.address * PAGE_SIZE
+            );
+
+        const void* frame_ptr = frame_start == MAP_NEW_FRAMES
+                                  ? allocate_frame()
+                                  : (uint8_t*)frame_start + i * PAGE_SIZE;
+
+        table1_entry->bits           |= (page_flags | PAGE_FLAG_PRESENT) & PAGE_FLAG_MASK;
+        table1_entry->fields.address  = (size_t)frame_ptr / PAGE_SIZE;
     }
 
-    page_table_t* table1_ptr = next_table(table2_ptr, get_table2_index(page));
-    if (table1_ptr == (void*)-1) {
-        DEBUG("(unmap_page) Page table 1 is empty, (page = %p)\n", page.bits);
-        if (panic_on_empty) PANIC("(unmap_page) Page table 1 is empty, (page = %p)\n", page.bits);
-        return;
+    unlock_page_tables(rflags);
+}
+
+// Unmaps length bytes starting from virtual_start and frees their frames
+// The pages are unmapped in batches, the frames of a batch are freed after the TLBs of every cpu
+// are flushed (see shootdown_tlb_pages)
+void unmap_range(
+    void* virtual_start, size_t length, deallocate_frame_t deallocate_frame, bool panic_on_empty
+) {
+    if (((size_t)virtual_start & (PAGE_SIZE - 1)) != 0)
+        PANIC("Range %p is not aligned", virtual_start);
+
+    size_t        pages      = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    page_table_t* table4_ptr = get_active_table4();
+    page_table_t* table1_ptr = (void*)-1;
+    const void*   frames[UNMAP_BATCH_SIZE];
+    size_t        frames_size = 0;
+    size_t        batch_start = 0; // first page of the batch
+    bool          global      = false;
+    uint64_t      rflags      = lock_page_tables();
+
+    for (size_t i = 0; i < pages; i++) {
+        page_t page = {.fields.address = (size_t)virtual_start / PAGE_SIZE + i};
+
+        if (table1_ptr == (void*)-1 || get_table1_index(page) == 0)
+            table1_ptr = get_table1(table4_ptr, page);
+
+        page_t* table1_entry
+            = table1_ptr == (void*)-1 ? (void*)-1 : &table1_ptr->entries[get_table1_index(page)];
+        if (table1_entry == (void*)-1 || !table1_entry->fields.present) {
+            void* virtual = (uint8_t*)virtual_start + i * PAGE_SIZE;
+            DEBUG("(unmap_range) Page %p is not mapped\n", virtual);
+            if (panic_on_empty) PANIC("(unmap_range) Page %p is not mapped\n", virtual);
+            continue;
+        }
+
+        frames[frames_size++]  = (void*)((size_t)table1_entry->fields.address * PAGE_SIZE);
+        global                |= table1_entry->fields.global;
+        table1_entry->bits     = 0;
+
+        if (frames_size == UNMAP_BATCH_SIZE) {
+            free_unmapped_frames(
+                (uint8_t*)virtual_start + batch_start * PAGE_SIZE,
+                i + 1 - batch_start,
+                global,
+                frames,
+                frames_size,
+                deallocate_frame
+            );
+            frames_size = 0;
+            batch_start = i + 1;
+            global      = false;
+        }
+    }
+
+    free_unmapped_frames(
+        (uint8_t*)virtual_start + batch_start * PAGE_SIZE,
+        pages - batch_start,
+        global,
+        frames,
+        frames_size,
+        deallocate_frame
+    );
+    unlock_page_tables(rflags);
+}
+
+// Maps a 2MiB (table2 entry) or 1GiB (table3 entry) page to a frame of the same size
+// Both the page and the frame have to be aligned to the page size
+void map_huge_page_to_frame(
+    page_t           page,
+    size_t           page_size,
+    uint64_t         page_flags,
+    const void*      frame_ptr,
+    allocate_frame_t allocate_frame
+) {
+    if (page_size != PAGE_SIZE_2MIB && page_size != PAGE_SIZE_1GIB)
+        PANIC("Invalid huge page size (%p)", page_size);
+    if (page_size == PAGE_SIZE_1GIB && !has_1gib_pages()) PANIC("1GiB pages are not supported");
+    if ((((size_t)page.fields.address * PAGE_SIZE) & (page_size - 1)) != 0
+        || ((size_t)frame_ptr & (page_size - 1)) != 0)
+        PANIC("Huge page %p or frame %p is not aligned", page.bits, frame_ptr);
+
+    uint64_t      rflags = lock_page_tables();
+    page_table_t* table3_ptr
+        = get_or_create_next_table(get_active_table4(), get_table4_index(page), allocate_frame);
+    page_t* entry = &table3_ptr->entries[get_table3_index(page)];
+
+    // a 1GiB page around it is split, its 2MiB entry is then in use like the others
+    if (page_size == PAGE_SIZE_2MIB) {
+        page_table_t* table2_ptr = get_or_split_next_table(
+            table3_ptr, get_table3_index(page), PAGE_SIZE_1GIB, allocate_frame
+        );
+        entry = &table2_ptr->entries[get_table2_index(page)];
     }
 
-    page_t* table1_entry = &table1_ptr->entries[get_table1_index(page)];
-    if (!table1_entry->fields.present) {
-        DEBUG("(unmap_page) Page table 1 entry is empty, (page = %p)\n", page.bits);
+    if (entry->bits != 0)
+        PANIC(
+            "Huge page %p is already in use (points to %p)",
+            page.bits,
+            (size_t)entry->fields.address * PAGE_SIZE
+        );
+    page_flags            |= PAGE_FLAG_PRESENT | PAGE_FLAG_HUGE_PAGE;
+    entry->bits           |= page_flags & PAGE_FLAG_MASK;
+    entry->fields.address  = (size_t)frame_ptr / PAGE_SIZE;
+
+    unlock_page_tables(rflags);
+}
+
+// Unmaps a page mapped with map_huge_page_to_frame and frees its frames
+// A 2MiB page can also be unmapped from a 1GiB page, which is split first
+void unmap_huge_page(
+    page_t page, size_t page_size, deallocate_frames_t deallocate_frames, bool panic_on_empty
+) {
+    uint64_t rflags = lock_page_tables();
+    page_t*  entry  = get_huge_page_entry(get_active_table4(), page, page_size);
+    if (entry == (void*)-1) {
+        unlock_page_tables(rflags);
+        DEBUG("(unmap_huge_page) Huge page is not mapped, (page = %p)\n", page.bits);
         if (panic_on_empty)
-            PANIC("(unmap_page) Page table 1 entry is empty, (page = %p)\n", page.bits);
+            PANIC("(unmap_huge_page) Huge page is not mapped, (page = %p)\n", page.bits);
         return;
     }
 
-    const void* frame_ptr = (void*)((size_t)table1_entry->fields.address * PAGE_SIZE);
+    const void* frame_ptr = (void*)get_huge_page_frame(*entry, page_size);
 
-    table1_entry->bits = 0;
-    flush_tlb_page((void*)page.bits);
+    bool        global    = entry->fields.global;
 
-    deallocate_frame(frame_ptr);
+    // the other cpus may still use the frames until their TLB is flushed
+    entry->bits = 0;
+    shootdown_tlb_pages(get_page_address(page), page_size / PAGE_SIZE, global);
+    unlock_page_tables(rflags);
+
+    // a huge page is made of 2^order frames
+    deallocate_frames(frame_ptr, __builtin_ctzll(page_size / PAGE_SIZE));
+}
+
+
+// Returns the table entry mapping a huge page or -1 if it does not exist
+static inline page_t* get_huge_page_entry(page_table_t* table4, page_t page, size_t page_size) {
+    page_table_t* table3_ptr = next_table(table4, get_table4_index(page));
+    if (table3_ptr == (void*)-1) return (void*)-1;
+
+    page_t* entry = &table3_ptr->entries[get_table3_index(page)];
+    if (page_size == PAGE_SIZE_2MIB) {
+        if (!entry->fields.present) return (void*)-1;
+
+        page_table_t* table2_ptr = get_or_split_next_table(
+            table3_ptr, get_table3_index(page), PAGE_SIZE_1GIB, allocate_frame
+        );
+        entry = &table2_ptr->entries[get_table2_index(page)];
+    }
+
+    if (!entry->fields.present || !entry->fields.huge_page) return (void*)-1;
+    return entry;
+}
+
+// In huge page entries the lowest address bits are reserved (or hold the PAT bit)
+static inline size_t get_huge_page_frame(page_t entry, size_t page_size) {
+    return ((size_t)entry.fields.address * PAGE_SIZE) & ~(page_size - 1);
+}
+
+// Returns the table1 containing the page entry or -1 if it does not exist
+// The huge pages containing the page are split, so their 4KiB pages can be unmapped one by one
+static inline page_table_t* get_table1(page_table_t* table4, page_t page) {
+    page_table_t* table3_ptr = next_table(table4, get_table4_index(page));
+    if (table3_ptr == (void*)-1 || !table3_ptr->entries[get_table3_index(page)].fields.present)
+        return (void*)-1;
+
+    page_table_t* table2_ptr = get_or_split_next_table(
+        table3_ptr, get_table3_index(page), PAGE_SIZE_1GIB, allocate_frame
+    );
+    if (!table2_ptr->entries[get_table2_index(page)].fields.present) return (void*)-1;
+
+    return get_or_split_next_table(
+        table2_ptr, get_table2_index(page), PAGE_SIZE_2MIB, allocate_frame
+    );
+}
+
+// Returns the table1 containing the page entry, creating the missing tables
+// The huge pages containing the page are split, the page is then in use like the others
+static inline page_table_t*
+get_or_create_table1(page_table_t* table4, page_t page, allocate_frame_t allocate_frame) {
+    page_table_t* table3_ptr
+        = get_or_create_next_table(table4, get_table4_index(page), allocate_frame);
+    page_table_t* table2_ptr = get_or_split_next_table(
+        table3_ptr, get_table3_index(page), PAGE_SIZE_1GIB, allocate_frame
+    );
+    return get_or_split_next_table(
+        table2_ptr, get_table2_index(page), PAGE_SIZE_2MIB, allocate_frame
+    );
+}
+
+// Same as get_or_create_next_table, but a huge page entry (of page_size) is split instead
+static inline page_table_t* get_or_split_next_table(
+    page_table_t* table, size_t index, size_t page_size, allocate_frame_t allocate_frame
+) {
+    page_t entry = table->entries[index];
+    if (entry.fields.present && entry.fields.huge_page)
+        return split_huge_page(table, index, page_size, allocate_frame);
+
+    return get_or_create_next_table(table, index, allocate_frame);
+}
+
+// Flushes the unmapped pages from the TLBs of every cpu, then frees their frames
+static inline void free_unmapped_frames(
+    void*              start,
+    size_t             pages,
+    bool               global,
+    const void*        frames[],
+    size_t             frames_size,
+    deallocate_frame_t deallocate_frame
+) {
+    if (frames_size == 0) return;
+
+    shootdown_tlb_pages(start, pages, global);
+    for (size_t i = 0; i < frames_size; i++) deallocate_frame(frames[i]);
 }
@@ -8,11 +8,51 @@
 #include <stddef.h>
 #include <stdint.h>
 
+
+// Passed to map_range instead of a frame address, to map every page to a new frame
+#define MAP_NEW_FRAMES ((void*)-1)
+
+uint64_t lock_page_tables();
+void     unlock_page_tables(uint64_t rflags);
+
 void identity_map(uint64_t page_flags, const void* frame_ptr, allocate_frame_t allocate_frame);
 void map_page_to_frame(
     page_t page, uint64_t page_flags, const void* frame_ptr, allocate_frame_t allocate_frame
 );
+bool try_map_page_to_frame(
+    page_t page, uint64_t page_flags, const void* frame_ptr, allocate_frame_t allocate_frame
+);
 void        unmap_page(page_t page, deallocate_frame_t deallocate_frame, bool panic_on_empty);
 const void* get_physical_address(void* virtual);
 
+void map_range(
+    void*            virtual_start,
+    const void*      frame_start,
+    size_t           length,
+    uint64_t         page_flags,
+    allocate_frame_t allocate_frame
+);
+void map_range_in(
+    page_table_t*    table4,
+    void*            virtual_start,
+    const void*      frame_start,
+    size_t           length,
+    uint64_t         page_flags,
+    allocate_frame_t allocate_frame
+);
+void unmap_range(
+    void* virtual_start, size_t length, deallocate_frame_t deallocate_frame, bool panic_on_empty
+);
+
+void map_huge_page_to_frame(
+    page_t           page,
+    size_t           page_size,
+    uint64_t         page_flags,
+    const void*      frame_ptr,
+    allocate_frame_t allocate_frame
+);
+void unmap_huge_page(
+    page_t page, size_t page_size, deallocate_frames_t deallocate_frames, bool panic_on_empty
+);
+
 #endif
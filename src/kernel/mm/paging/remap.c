@@ -3,43 +3,56 @@
 #include "../../log.h"
 #include "../frame/allocator.h"
 #include "../multiboot2.h"
+#include "fault.h"
 #include "helpers.h"
 #include "paging.h"
-#include "tempallocator.h"
 
 
-static inline void initialize_new_table4(page_table_t* new_table4_addr, const page_t temp_page);
-static inline void remap_to_new_table4(
-    const page_table_t* old_table4_addr,
-    page_table_t*       new_table4_addr,
-    const page_t        temp_page,
-    const mem_region_t  to_map[],
-    const size_t        to_map_size
-);
+// Enough for the table4, the direct map of MAX_PHYSICAL_MEMORY with 2MiB pages (5 tables) and a
+// kernel image of up to 16MiB (2 tables + 1 table1 for each 2MiB)
+#define REMAP_TABLES_NUMBER 16
 
-// Remaps the kernel and other important memory areas onto a the new table4
-// The pages will now have the correct flags
+static inline void map_physical_memory(page_table_t* table4, const uint8_t* memory_end);
+static inline void
+remap_to_new_table4(page_table_t* table4, const mem_region_t to_map[], const size_t to_map_size);
+static inline const void* allocate_remap_table();
+
+
+// The new tables are written through the boot direct map, which only covers the first GiB
+// The frame allocator can hand out frames above it, so the tables are taken from the kernel image
+// (it is loaded right above 1MiB)
+static page_table_t remap_tables[REMAP_TABLES_NUMBER] __attribute__((aligned(PAGE_SIZE)));
+static size_t       remap_tables_used;
+
+
+// Remaps the kernel sections onto a the new table4, at the higher half addresses they are linked at
+// The pages will now have the correct flags and all the physical memory is mapped at PHYS_OFFSET
+// The lower half of the new table4 is empty, so the identity map created at boot is removed
 // Returns the new table4 physical address
-const page_table_t* remap_kernel(const mem_region_t to_map[], const size_t to_map_size) {
+const page_table_t*
+remap_kernel(const mem_region_t to_map[], const size_t to_map_size, const void* memory_end) {
 
-    page_t              temp_page           = {.fields.address = 0xdeadbeef};
-    const page_table_t* phys_table4_ptr     = (page_table_t*)read_cr3();
-    page_table_t*       new_phys_table4_ptr = (page_table_t*)allocate_frame();
+    const page_table_t* phys_table4_ptr     = (page_table_t*)(read_cr3() & CR3_ADDRESS_MASK);
+    page_table_t*       new_phys_table4_ptr = (page_table_t*)allocate_remap_table();
     DEBUG("Physical table4 address: %p\n", phys_table4_ptr);
     DEBUG("Physical new table4 address: %p\n", new_phys_table4_ptr);
 
-    // Map temporarily new table4 to be able to access it
-    initialize_new_table4(new_phys_table4_ptr, temp_page);
+    page_table_t* new_table4_ptr = PHYS_TO_VIRT(new_phys_table4_ptr);
+    zero_table_entries(new_table4_ptr);
 
     // Avoid triggering cpu exceptions when marking a page as not executable
     enable_nxe_bit();
 
-    // Map the mem regions onto the new table4
-    remap_to_new_table4(phys_table4_ptr, new_phys_table4_ptr, temp_page, to_map, to_map_size);
+    // Map the physical memory and the mem regions onto the new table4
+    map_physical_memory(new_table4_ptr, memory_end);
+    remap_to_new_table4(new_table4_ptr, to_map, to_map_size);
 
     // Remove write access to not writable pages
     enable_write_protect_bit();
 
+    // Keep the kernel's TLB entries when switching address space
+    enable_global_pages();
+
     // Switch to the new table4
     write_cr3((uint64_t)new_phys_table4_ptr);
 
@@ -47,106 +60,80 @@ const page_table_t* remap_kernel(const mem_region_t to_map[], const size_t to_ma
     // The kernel stack is right under the old page tables, so:
     // - a stack overflow triggers a page fault
     // - we increased the kernel stack size by:
-    //    - 1   table3 (4KiB)
-    //    - 1   table2 (4KiB)
-    //    - 512 table1 (2MiB)
+    //    - 2   table3 (8KiB)
+    //    - 1   table2 (4KiB, unused if the boot code mapped a 1GiB page)
     unmap_page(
-        (page_t){.fields.address = (size_t)phys_table4_ptr / PAGE_SIZE}, deallocate_frame, true
+        (page_t){.fields.address = ((size_t)phys_table4_ptr + KERNEL_OFFSET) / PAGE_SIZE},
+        deallocate_frame,
+        true
     );
+    register_guard_page((uint8_t*)phys_table4_ptr + KERNEL_OFFSET);
+
+    // The tables that were not needed go back to the frame allocator
+    for (size_t i = remap_tables_used; i < REMAP_TABLES_NUMBER; i++)
+        unmap_page(
+            (page_t){.fields.address = (size_t)&remap_tables[i] / PAGE_SIZE},
+            deallocate_frame,
+            true
+        );
+    DEBUG("Remap tables used: %d/%d\n", remap_tables_used, REMAP_TABLES_NUMBER);
 
     return new_phys_table4_ptr;
 }
 
-// Zeroes table entries and sets up recursive mapping
-static inline void initialize_new_table4(page_table_t* new_table4_addr, const page_t temp_page) {
-
-    // Map temporarily new table4 to be able to access it
-    map_page_to_frame(
-        temp_page, PAGE_FLAG_WRITABLE, (uint8_t*)new_table4_addr, allocate_temp_frame
-    );
-    DEBUG(
-        "Temp page (%p) physical address: %p\n",
-        (size_t)temp_page.fields.address * PAGE_SIZE,
-        get_physical_address((void*)((size_t)temp_page.fields.address * PAGE_SIZE))
-    );
-
-    // Zero new table4 entries and recursively map it
-    zero_table_entries(new_table4_addr);
-    new_table4_addr->entries[PAGE_ENTRIES - 1].fields.address = (size_t)new_table4_addr / PAGE_SIZE;
-    new_table4_addr->entries[PAGE_ENTRIES - 1].fields.present = true;
-    new_table4_addr->entries[PAGE_ENTRIES - 1].fields.writable = true;
+// Maps the physical memory up to memory_end at PHYS_OFFSET
+// 1GiB pages are used if the cpu supports them, 2MiB pages otherwise
+static inline void map_physical_memory(page_table_t* table4, const uint8_t* memory_end) {
+    size_t   page_size = has_1gib_pages() ? PAGE_SIZE_1GIB : PAGE_SIZE_2MIB;
+    uint64_t flags     = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITABLE | PAGE_FLAG_HUGE_PAGE
+                   | PAGE_FLAG_GLOBAL | PAGE_FLAG_NO_EXECUTE;
+    DEBUG("Mapping physical memory at %p (end = %p)\n", PHYS_OFFSET, memory_end);
+
+    for (size_t frame = 0; frame <= (size_t)memory_end; frame += page_size) {
+        page_t page = {.fields.address = (PHYS_OFFSET + frame) / PAGE_SIZE};
+
+        page_table_t* table3_ptr
+            = get_or_create_next_table(table4, get_table4_index(page), allocate_remap_table);
+        page_t* entry = &table3_ptr->entries[get_table3_index(page)];
+
+        if (page_size == PAGE_SIZE_2MIB) {
+            page_table_t* table2_ptr = get_or_create_next_table(
+                table3_ptr, get_table3_index(page), allocate_remap_table
+            );
+            entry = &table2_ptr->entries[get_table2_index(page)];
+        }
 
-    unmap_page(temp_page, deallocate_temp_frame, true);
+        entry->bits = (flags & PAGE_FLAG_MASK) | frame;
+    }
 }
 
-// Maps the mem regions to the new table
-static inline void remap_to_new_table4(
-    const page_table_t* old_table4_addr,
-    page_table_t*       new_table4_addr,
-    const page_t        temp_page,
-    const mem_region_t  to_map[],
-    const size_t        to_map_size
-) {
-    // To write to the new table4 we need to have a corresponding entry in the current table4
-    // Map temporarily table4's address
-    map_page_to_frame(
-        temp_page, PAGE_FLAG_WRITABLE, (uint8_t*)old_table4_addr, allocate_temp_frame
-    );
-    // temp_page now holds the table4 address, so we can use it as a table4
-    page_table_t* temp_page_table_ptr
-        = (page_table_t*)((size_t)temp_page.fields.address * PAGE_SIZE);
-    DEBUG(
-        "Temp page (%p) physical address: %p\n",
-        (size_t)temp_page.fields.address * PAGE_SIZE,
-        get_physical_address((void*)((size_t)temp_page.fields.address * PAGE_SIZE))
-    );
-
-    // Temporarily set the last table4 entry with the new table4's address
-    {
-        DEBUG(
-            "Last table4 entry contents (before swap): %p\n",
-            TABLE4_PTR->entries[PAGE_ENTRIES - 1].bits
-        );
+// Maps the kernel sections in the new table (it does not need to be active)
+static inline void
+remap_to_new_table4(page_table_t* table4, const mem_region_t to_map[], const size_t to_map_size) {
+    DEBUG("Mapping kernel sections onto new table\n");
 
-        // Map new table4 to table4's 511th address
-        TABLE4_PTR->entries[PAGE_ENTRIES - 1].fields.address  = (size_t)new_table4_addr / PAGE_SIZE;
-        TABLE4_PTR->entries[PAGE_ENTRIES - 1].fields.present  = true;
-        TABLE4_PTR->entries[PAGE_ENTRIES - 1].fields.writable = true;
-        flush_tlb();
-        DEBUG(
-            "Last table4 entry contents (after swap, before remap): %p\n",
-            TABLE4_PTR->entries[PAGE_ENTRIES - 1].bits
-        );
+    for (size_t i = 0; i < to_map_size; i++) {
+        const mem_region_t* curr  = &to_map[i];
+        uint64_t            flags = PAGE_FLAG_GLOBAL; // shared by every address space
 
-        // Identity map the memory regions in the new table
-        DEBUG("Identity mapping used regions onto new table\n");
-        for (size_t i = 0; i < to_map_size; i++) {
-            const mem_region_t* curr  = &to_map[i];
-            uint64_t            flags = 0x0;
+        // the boot code is not used anymore once the kernel runs in the higher half
+        if ((size_t)curr->start < KERNEL_OFFSET) continue;
 
-            if (curr->writable) flags |= PAGE_FLAG_WRITABLE;
-            if (!curr->executable) flags |= PAGE_FLAG_NO_EXECUTE;
+        if (curr->writable) flags |= PAGE_FLAG_WRITABLE;
+        if (!curr->executable) flags |= PAGE_FLAG_NO_EXECUTE;
 
-            for (uint8_t* frame = curr->start; frame < curr->end; frame += PAGE_SIZE)
-                identity_map(flags, frame, allocate_frame);
-        }
-
-        // Restore the original recursive mapping
-        temp_page_table_ptr->entries[PAGE_ENTRIES - 1].fields.address
-            = (size_t)old_table4_addr / PAGE_SIZE;
-        temp_page_table_ptr->entries[PAGE_ENTRIES - 1].fields.present  = true;
-        temp_page_table_ptr->entries[PAGE_ENTRIES - 1].fields.writable = true;
-        flush_tlb();
-        DEBUG(
-            "Last table4 entry contents (after swap, after remap): %p\n",
-            TABLE4_PTR->entries[PAGE_ENTRIES - 1].bits
+        // map every page the region touches, even if it does not start on a page boundary
+        uint8_t* start = (uint8_t*)((size_t)curr->start & ~((size_t)PAGE_SIZE - 1));
+        map_range_in(
+            table4, start, start - KERNEL_OFFSET, curr->end - start + 1, flags, allocate_remap_table
         );
     }
+}
 
-    DEBUG(
-        "Temp page (%p) physical address: %p\n",
-        (size_t)temp_page.fields.address * PAGE_SIZE,
-        get_physical_address((void*)((size_t)temp_page.fields.address * PAGE_SIZE))
-    );
-    unmap_page(temp_page, deallocate_temp_frame, true);
+// Returns the physical address of a table from remap_tables
+static inline const void* allocate_remap_table() {
+    if (remap_tables_used == REMAP_TABLES_NUMBER)
+        PANIC("Not enough tables to remap the kernel (%d)", REMAP_TABLES_NUMBER);
+
+    return (uint8_t*)&remap_tables[remap_tables_used++] - KERNEL_OFFSET;
 }
@@ -6,6 +6,7 @@
 #include "page.h"
 #include <stddef.h>
 
-const page_table_t* remap_kernel(const mem_region_t to_map[], const size_t to_map_size);
+const page_table_t*
+remap_kernel(const mem_region_t to_map[], const size_t to_map_size, const void* memory_end);
 
 #endif
@@ -0,0 +1,229 @@
+#include "vma.h"
+#include "../../log.h"
+#include "../../sync/mcslock.h"
+#include "../heap/slab.h"
+#include "../paging/page.h"
+
+
+static inline vma_t*   insert(vma_t* node, vma_t* vma);
+static inline vma_t*   remove(vma_t* node, const vma_t* vma);
+static inline vma_t*   remove_min(vma_t* node, vma_t** min);
+static inline vma_t*   balance(vma_t* node);
+static inline vma_t*   rotate_left(vma_t* node);
+static inline vma_t*   rotate_right(vma_t* node);
+static inline void     update(vma_t* node);
+static inline int      get_height(const vma_t* node);
+static inline uint8_t* find_gap(const vma_t* node, uint8_t* low, uint8_t* high, size_t length);
+
+
+static vma_t*   root;
+static uint8_t* space_start;
+static uint8_t* space_end;
+static size_t   vma_number;
+
+// Also taken by the page fault handler: nothing may allocate or touch a lazy area while holding
+// it (the slab nodes are allocated and freed outside of it), a fault would deadlock on it
+// Every cpu faulting on a lazy area (e.g. its heap arena) looks it up, the MCS lock keeps the
+// waiters spinning on their own node instead of the lock's cache line
+static mcs_lock_t vma_lock = MCS_LOCK_INIT;
+
+
+// required to use the other functions
+// The areas are reserved between start and end, the nodes are allocated by the slab allocator
+void init_vma(void* start, void* end) {
+    root        = NULL;
+    space_start = start;
+    space_end   = end;
+    vma_number  = 0;
+    DEBUG("VMA space initialized (start = %p, end = %p)\n", start, end);
+}
+
+// Reserves the lowest free range of at least length bytes (rounded up to a page)
+// Returns NULL if there is no free range big enough
+vma_t* vma_reserve(size_t length, uint64_t page_flags, uint32_t flags) {
+    length = (length + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+    if (length == 0) return NULL;
+
+    // the node is allocated before taking the lock, the slab allocator is never called with it
+    vma_t* vma = slab_allocate(sizeof(vma_t));
+    if (vma == NULL) return NULL;
+
+    mcs_node_t node;
+    uint64_t   rflags = mcs_lock_irqsave(&vma_lock, &node);
+    uint8_t*   start  = find_gap(root, space_start, space_end, length);
+    if (start == NULL) {
+        mcs_unlock_irqrestore(&vma_lock, &node, rflags);
+        slab_deallocate(vma);
+        DEBUG("No free virtual range (length = %p)\n", length);
+        return NULL;
+    }
+
+    *vma = (vma_t){
+        .start      = start,
+        .end        = start + length,
+        .page_flags = page_flags,
+        .flags      = flags,
+    };
+    root = insert(root, vma);
+    vma_number++;
+    mcs_unlock_irqrestore(&vma_lock, &node, rflags);
+
+    DEBUG("VMA reserved (start = %p, end = %p)\n", vma->start, vma->end);
+    return vma;
+}
+
+// The pages of the area have to be unmapped by the caller
+void vma_release(vma_t* vma) {
+    DEBUG("VMA released (start = %p, end = %p)\n", vma->start, vma->end);
+
+    mcs_node_t node;
+    uint64_t   rflags = mcs_lock_irqsave(&vma_lock, &node);
+    root              = remove(root, vma);
+    vma_number--;
+    mcs_unlock_irqrestore(&vma_lock, &node, rflags);
+
+    slab_deallocate(vma);
+}
+
+// Returns the area containing the address or NULL
+// The area stays valid until its owner releases it
+vma_t* find_vma(const void* address) {
+    mcs_node_t lock_node;
+    uint64_t   rflags = mcs_lock_irqsave(&vma_lock, &lock_node);
+    vma_t*     node   = root;
+
+    while (node != NULL) {
+        if ((const uint8_t*)address < node->start) node = node->left;
+        else if ((const uint8_t*)address >= node->end) node = node->right;
+        else break;
+    }
+
+    mcs_unlock_irqrestore(&vma_lock, &lock_node, rflags);
+    return node;
+}
+
+size_t get_vma_number() { return vma_number; }
+
+
+static inline vma_t* insert(vma_t* node, vma_t* vma) {
+    if (node == NULL) {
+        vma->left  = NULL;
+        vma->right = NULL;
+        update(vma);
+        return vma;
+    }
+
+    if (vma->start < node->start) node->left = insert(node->left, vma);
+    else node->right = insert(node->right, vma);
+
+    return balance(node);
+}
+
+static inline vma_t* remove(vma_t* node, const vma_t* vma) {
+    if (node == NULL) PANIC("VMA %p is not in the tree", vma->start);
+
+    if (vma->start < node->start) node->left = remove(node->left, vma);
+    else if (vma->start > node->start) node->right = remove(node->right, vma);
+    else {
+        if (node->left == NULL) return node->right;
+        if (node->right == NULL) return node->left;
+
+        // the successor takes the place of the removed node
+        vma_t* min;
+        vma_t* right = remove_min(node->right, &min);
+        min->left    = node->left;
+        min->right   = right;
+        node         = min;
+    }
+
+    return balance(node);
+}
+
+static inline vma_t* remove_min(vma_t* node, vma_t** min) {
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+
+    node->left = remove_min(node->left, min);
+    return balance(node);
+}
+
+// Restores the AVL property (subtree heights differ at most by one)
+static inline vma_t* balance(vma_t* node) {
+    update(node);
+    int balance_factor = get_height(node->left) - get_height(node->right);
+
+    if (balance_factor > 1) {
+        if (get_height(node->left->left) < get_height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+
+    if (balance_factor < -1) {
+        if (get_height(node->right->right) < get_height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static inline vma_t* rotate_left(vma_t* node) {
+    vma_t* right = node->right;
+    node->right  = right->left;
+    right->left  = node;
+
+    update(node);
+    update(right);
+    return right;
+}
+
+static inline vma_t* rotate_right(vma_t* node) {
+    vma_t* left = node->left;
+    node->left  = left->right;
+    left->right = node;
+
+    update(node);
+    update(left);
+    return left;
+}
+
+// Recomputes the height and the augmented fields from the children
+static inline void update(vma_t* node) {
+    int left_height  = get_height(node->left);
+    int right_height = get_height(node->right);
+    node->height     = 1 + (left_height > right_height ? left_height : right_height);
+
+    node->subtree_start = node->left != NULL ? node->left->subtree_start : node->start;
+    node->subtree_end   = node->right != NULL ? node->right->subtree_end : node->end;
+    node->subtree_gap   = 0;
+
+    if (node->left != NULL) {
+        size_t gap        = node->start - node->left->subtree_end;
+        node->subtree_gap = node->left->subtree_gap > gap ? node->left->subtree_gap : gap;
+    }
+    if (node->right != NULL) {
+        size_t gap = node->right->subtree_start - node->end;
+        if (node->right->subtree_gap > gap) gap = node->right->subtree_gap;
+        if (gap > node->subtree_gap) node->subtree_gap = gap;
+    }
+}
+
+static inline int get_height(const vma_t* node) { return node != NULL ? node->height : 0; }
+
+// Returns the lowest address of a gap of at least length bytes, or NULL
+// low is the end of the area right before the subtree and high the start of the one right after
+// Subtrees without a big enough gap are skipped, so at most one path is followed to the bottom
+static inline uint8_t* find_gap(const vma_t* node, uint8_t* low, uint8_t* high, size_t length) {
+    if (node == NULL) return (size_t)(high - low) >= length ? low : NULL;
+
+    if (node->subtree_gap < length && (size_t)(node->subtree_start - low) < length
+        && (size_t)(high - node->subtree_end) < length)
+        return NULL;
+
+    uint8_t* start = find_gap(node->left, low, node->start, length);
+    if (start != NULL) return start;
+
+    return find_gap(node->right, node->end, high, length);
+}
@@ -0,0 +1,35 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define VMA_LAZY  0x1 // the pages are mapped by the page fault handler on the first access
+#define VMA_GUARD 0x2 // the first page is never mapped, touching it is a stack overflow
+
+// A reserved range of kernel virtual memory, page aligned
+// The areas are kept in an AVL tree ordered by address, every node also knows the biggest gap
+// between the areas of its subtree, so free ranges are found without visiting every area
+typedef struct vma_t {
+    uint8_t* start;
+    uint8_t* end; // exclusive
+    uint64_t page_flags;
+    uint32_t flags;
+
+    struct vma_t* left;
+    struct vma_t* right;
+    int           height;
+    uint8_t*      subtree_start;
+    uint8_t*      subtree_end;
+    size_t        subtree_gap;
+} vma_t;
+
+
+void   init_vma(void* start, void* end);
+vma_t* vma_reserve(size_t length, uint64_t page_flags, uint32_t flags);
+void   vma_release(vma_t* vma);
+vma_t* find_vma(const void* address);
+size_t get_vma_number();
+
+#endif
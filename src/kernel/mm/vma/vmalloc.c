@@ -0,0 +1,77 @@
+#include "vmalloc.h"
+#include "../../log.h"
+#include "../frame/allocator.h"
+#include "../paging/paging.h"
+#include "vma.h"
+
+
+#define VMALLOC_PAGE_FLAGS (PAGE_FLAG_WRITABLE | PAGE_FLAG_GLOBAL | PAGE_FLAG_NO_EXECUTE)
+#define MMIO_PAGE_FLAGS    (VMALLOC_PAGE_FLAGS | PAGE_FLAG_NO_CACHE | PAGE_FLAG_WRITE_THROUGH)
+
+static inline void     map_area(const vma_t* vma);
+static inline uint8_t* get_mapped_start(const vma_t* vma);
+
+
+// Virtually contiguous memory, backed by frames that are not physically contiguous
+// The size is rounded up to a page, the returned memory is not initialized
+void* vmalloc(size_t size) {
+    vma_t* vma = vma_reserve(size, VMALLOC_PAGE_FLAGS, 0);
+    if (vma == NULL) return NULL;
+
+    map_area(vma);
+    return vma->start;
+}
+
+// The address has to be the one returned by vmalloc
+void vfree(void* address) {
+    vma_t* vma = find_vma(address);
+    if (vma == NULL || vma->start != address) PANIC("%p was not returned by vmalloc", address);
+
+    uint8_t* start = get_mapped_start(vma);
+    unmap_range(start, vma->end - start, deallocate_frame, true);
+    vma_release(vma);
+}
+
+// Returns the top of the stack (it grows down towards the guard page)
+void* allocate_kernel_stack() {
+    vma_t* vma = vma_reserve(PAGE_SIZE + KERNEL_STACK_SIZE, VMALLOC_PAGE_FLAGS, VMA_GUARD);
+    if (vma == NULL) return NULL;
+
+    map_area(vma);
+    return vma->end;
+}
+
+void deallocate_kernel_stack(void* stack_top) {
+    // the top is the end of the area, so the last byte of the stack is right below it
+    vma_t* vma = find_vma((uint8_t*)stack_top - 1);
+    if (vma == NULL || vma->end != stack_top) PANIC("%p is not a kernel stack", stack_top);
+
+    uint8_t* start = get_mapped_start(vma);
+    unmap_range(start, vma->end - start, deallocate_frame, true);
+    vma_release(vma);
+}
+
+// Maps device registers, uncached, the address does not need to be page aligned
+// The frames do not belong to the frame allocator, so the mapping is never removed
+void* map_mmio(const void* physical_address, size_t size) {
+    size_t offset = (size_t)physical_address & (PAGE_SIZE - 1);
+    vma_t* vma    = vma_reserve(offset + size, MMIO_PAGE_FLAGS, 0);
+    if (vma == NULL) return NULL;
+
+    const uint8_t* frame = (const uint8_t*)physical_address - offset;
+    map_range(vma->start, frame, vma->end - vma->start, vma->page_flags, allocate_frame);
+
+    return vma->start + offset;
+}
+
+
+// Every page is mapped to a new frame, except for the guard page
+// The frames are allocated while the range is mapped, the tables are walked once per table1
+static inline void map_area(const vma_t* vma) {
+    uint8_t* start = get_mapped_start(vma);
+    map_range(start, MAP_NEW_FRAMES, vma->end - start, vma->page_flags, allocate_frame);
+}
+
+static inline uint8_t* get_mapped_start(const vma_t* vma) {
+    return (vma->flags & VMA_GUARD) != 0 ? vma->start + PAGE_SIZE : vma->start;
+}
@@ -0,0 +1,16 @@
+#ifndef VMA_VMALLOC_H
+#define VMA_VMALLOC_H
+
+#include <stddef.h>
+
+
+// Kernel stacks are preceded by an unmapped guard page
+#define KERNEL_STACK_SIZE (16 * 0x400) // 16KiB
+
+void* vmalloc(size_t size);
+void  vfree(void* address);
+void* allocate_kernel_stack();
+void  deallocate_kernel_stack(void* stack_top);
+void* map_mmio(const void* physical_address, size_t size);
+
+#endif
@@ -0,0 +1,200 @@
+#include "scheduler.h"
+#include "../cpu/cpu.h"
+#include "../cpu/percpu.h"
+#include "../cpu/smp.h"
+#include "../cpu/timer.h"
+#include "../log.h"
+#include "../mm/heap/allocator.h"
+#include "../mm/heap/slab.h"
+#include <stddef.h>
+
+
+// Ready threads of a cpu, in the order they will run
+typedef struct {
+    spinlock_t lock;
+    thread_t*  head;
+    thread_t*  tail;
+    size_t     length;
+} run_queue_t;
+
+static inline void      enqueue(uint32_t cpu, thread_t* thread);
+static inline thread_t* dequeue(uint32_t cpu);
+static inline thread_t* steal(uint32_t cpu);
+static inline void      handle_tick(interrupt_frame_t* frame);
+
+void finish_switch();
+
+// Defined in switch.asm
+extern void switch_context(uint64_t* rsp, uint64_t next_rsp);
+
+
+static run_queue_t run_queues[MAX_CPUS];
+
+
+// required to use the other functions
+// The timer ticks preempt the running threads
+void init_scheduler() { set_tick_handler(handle_tick); }
+
+// The running context becomes the cpu's idle thread, the cpu then only runs threads
+void run_scheduler() {
+    cpu_t*    cpu  = get_running_cpu();
+    thread_t* idle = create_idle_thread(cpu->stack_top);
+
+    disable_interrupts();
+    cpu->idle_thread = idle;
+    cpu->thread      = idle;
+    cpu->slice_start = cpu->ticks;
+    DEBUG("Scheduler running on cpu %d\n", cpu->id);
+
+    // every tick schedules the waiting threads
+    // the blocks and objects freed by the other cpus are taken back before waiting
+    enable_interrupts();
+    for (;;) {
+        free_remote_deallocations();
+        free_remote_slab_objects();
+        __asm__ volatile("hlt");
+    }
+}
+
+// Switches to the next ready thread, taking it from another cpu if the local queue is empty
+// The running thread keeps running if nothing else is ready, unless it blocked or exited
+// Interrupts must be disabled
+void schedule() {
+    cpu_t*    cpu      = get_running_cpu();
+    thread_t* previous = cpu->thread;
+    thread_t* next     = dequeue(cpu->id);
+
+    if (next == NULL) next = steal(cpu->id);
+    if (next == NULL) {
+        if (previous->state == THREAD_RUNNING) return;
+        next = cpu->idle_thread;
+    }
+
+    if (previous->state == THREAD_RUNNING) previous->state = THREAD_READY;
+    next->state          = THREAD_RUNNING;
+    next->cpu            = cpu->id;
+    cpu->thread          = next;
+    cpu->previous_thread = previous;
+    cpu->slice_start     = cpu->ticks;
+
+    switch_context(&previous->rsp, next->rsp);
+    finish_switch();
+}
+
+// Gives the cpu to the next ready thread
+void yield() {
+    uint64_t rflags = disable_interrupts();
+    schedule();
+    restore_interrupts(rflags);
+}
+
+// Stops the running thread until wake_thread is called on it
+// It returns immediately if wake_thread has been called since the last block_thread
+void block_thread() {
+    uint64_t  rflags = disable_interrupts();
+    thread_t* thread = get_current_thread();
+
+    spin_lock(&thread->lock);
+    if (thread->wakeup_pending) {
+        thread->wakeup_pending = false;
+        spin_unlock(&thread->lock);
+        restore_interrupts(rflags);
+        return;
+    }
+
+    // the lock is released by finish_switch, when the thread's stack is not in use anymore
+    thread->state = THREAD_BLOCKED;
+    schedule();
+    restore_interrupts(rflags);
+}
+
+// The thread is queued on the cpu it last ran on
+void wake_thread(thread_t* thread) {
+    uint64_t rflags = spin_lock_irqsave(&thread->lock);
+
+    if (thread->state == THREAD_BLOCKED) {
+        thread->state = THREAD_READY;
+        enqueue(thread->cpu, thread);
+    }
+    else thread->wakeup_pending = true;
+
+    spin_unlock_irqrestore(&thread->lock, rflags);
+}
+
+// Queues a new thread, or one that is not in a run queue, on the cpu it last ran on
+void make_thread_ready(thread_t* thread) {
+    uint64_t rflags = disable_interrupts();
+    thread->state   = THREAD_READY;
+    enqueue(thread->cpu, thread);
+    restore_interrupts(rflags);
+}
+
+// Runs on the next thread right after the switch (new threads call it from thread_start)
+// The previous thread is only queued now, so no cpu can pick it while its stack is in use
+void finish_switch() {
+    cpu_t*    cpu      = get_running_cpu();
+    thread_t* previous = cpu->previous_thread;
+
+    cpu->previous_thread = NULL;
+    if (previous == cpu->idle_thread) return;
+
+    if (previous->state == THREAD_READY) enqueue(cpu->id, previous);
+    else if (previous->state == THREAD_BLOCKED) spin_unlock(&previous->lock);
+    else if (previous->state == THREAD_DEAD) release_thread(previous);
+}
+
+
+static inline void enqueue(uint32_t cpu, thread_t* thread) {
+    run_queue_t* queue = &run_queues[cpu];
+    thread->next       = NULL;
+
+    spin_lock(&queue->lock);
+    if (queue->tail == NULL) queue->head = thread;
+    else queue->tail->next = thread;
+    queue->tail = thread;
+    __atomic_store_n(&queue->length, queue->length + 1, __ATOMIC_RELAXED);
+    spin_unlock(&queue->lock);
+}
+
+static inline thread_t* dequeue(uint32_t cpu) {
+    run_queue_t* queue = &run_queues[cpu];
+
+    // the length is read without the lock, so idle cpus do not bounce the lock's cache line
+    if (__atomic_load_n(&queue->length, __ATOMIC_RELAXED) == 0) return NULL;
+
+    spin_lock(&queue->lock);
+    thread_t* thread = queue->head;
+    if (thread != NULL) {
+        queue->head = thread->next;
+        if (queue->head == NULL) queue->tail = NULL;
+        __atomic_store_n(&queue->length, queue->length - 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&queue->lock);
+
+    return thread;
+}
+
+// Takes the oldest ready thread of the first cpu (after this one) that has one
+static inline thread_t* steal(uint32_t cpu) {
+    size_t cpus_number = get_cpus_number();
+
+    for (size_t i = 1; i < cpus_number; i++) {
+        thread_t* thread = dequeue((cpu + i) % cpus_number);
+        if (thread != NULL) {
+            DEBUG("Cpu %d stole thread %d from cpu %d\n", cpu, thread->id, thread->cpu);
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+// The idle thread is left as soon as a thread is ready, the others when their slice is over
+static inline void handle_tick(interrupt_frame_t* frame) {
+    (void)frame;
+    cpu_t* cpu = get_running_cpu();
+    if (cpu->thread == NULL) return;
+
+    if (cpu->thread == cpu->idle_thread || cpu->ticks - cpu->slice_start >= SCHEDULER_TIME_SLICE)
+        schedule();
+}
@@ -0,0 +1,19 @@
+#ifndef SCHED_SCHEDULER_H
+#define SCHED_SCHEDULER_H
+
+#include "thread.h"
+
+
+// A thread runs for at most SCHEDULER_TIME_SLICE timer ticks before it is preempted
+#define SCHEDULER_TIME_SLICE 10
+
+
+void init_scheduler();
+void run_scheduler() __attribute__((noreturn));
+void schedule();
+void yield();
+void block_thread();
+void wake_thread(thread_t* thread);
+void make_thread_ready(thread_t* thread);
+
+#endif
@@ -0,0 +1,43 @@
+; Kernel thread context switch
+; only the callee-saved registers are saved, the caller of switch_context saves the others
+
+global switch_context
+global thread_start
+
+section .text
+bits 64
+
+extern finish_switch
+extern exit_thread
+
+; void switch_context(uint64_t* rsp, uint64_t next_rsp)
+; saves the registers on the current stack, stores the stack pointer in *rsp
+; and restores the registers saved on the next thread's stack
+switch_context:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; New threads start here (see create_thread), r12 holds the entry function and r13 its argument
+thread_start:
+    call finish_switch
+    sti
+
+    mov rdi, r13
+    call r12
+
+    call exit_thread
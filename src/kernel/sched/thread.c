@@ -0,0 +1,108 @@
+#include "thread.h"
+#include "../cpu/cpu.h"
+#include "../cpu/percpu.h"
+#include "../lib/malloc.h"
+#include "../log.h"
+#include "../mm/vma/vmalloc.h"
+#include "scheduler.h"
+#include <stddef.h>
+
+
+static inline thread_t* allocate_thread();
+
+// Defined in switch.asm
+extern void thread_start();
+
+
+// Dead threads keep their stack and are reused by create_thread
+static thread_t*  free_threads;
+static spinlock_t free_threads_lock = SPINLOCK_INIT;
+static uint32_t   next_thread_id;
+
+
+// The thread is queued on the running cpu, the scheduler may move it to another cpu
+// It runs entry(argument) with interrupts enabled and exits when entry returns
+thread_t* create_thread(thread_entry_t entry, void* argument) {
+    thread_t* thread = allocate_thread();
+    if (thread == NULL) return NULL;
+
+    // the first switch_context to the thread pops these registers and returns to thread_start
+    uint64_t* stack = thread->stack_top;
+    *--stack        = (uint64_t)thread_start;
+    *--stack        = 0;                  // rbp
+    *--stack        = 0;                  // rbx
+    *--stack        = (uint64_t)entry;    // r12
+    *--stack        = (uint64_t)argument; // r13
+    *--stack        = 0;                  // r14
+    *--stack        = 0;                  // r15
+    thread->rsp     = (uint64_t)stack;
+
+    thread->id             = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+    thread->cpu            = get_cpu_id();
+    thread->state          = THREAD_READY;
+    thread->wakeup_pending = false;
+    thread->lock           = (spinlock_t)SPINLOCK_INIT;
+
+    DEBUG("Thread %d created (stack top = %p)\n", thread->id, thread->stack_top);
+    make_thread_ready(thread);
+    return thread;
+}
+
+// Wraps the context running on stack_top, it runs when the cpu has nothing else to do
+thread_t* create_idle_thread(void* stack_top) {
+    thread_t* thread = malloc(sizeof(thread_t));
+    if (thread == NULL) PANIC("Cannot allocate the idle thread");
+
+    *thread = (thread_t){
+        .stack_top = stack_top,
+        .id        = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED),
+        .cpu       = get_cpu_id(),
+        .state     = THREAD_RUNNING,
+        .lock      = SPINLOCK_INIT,
+    };
+    return thread;
+}
+
+// Also called when the entry function of the thread returns
+void exit_thread() {
+    disable_interrupts();
+    get_current_thread()->state = THREAD_DEAD;
+    schedule();
+
+    PANIC("Dead thread %d was scheduled\n", get_current_thread()->id);
+}
+
+// Read with a single instruction, so it is right even if the thread is moved to another cpu
+thread_t* get_current_thread() {
+    thread_t* thread;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(thread) : "i"(offsetof(cpu_t, thread)));
+    return thread;
+}
+
+// Called by the scheduler once it does not run on the dead thread's stack anymore
+void release_thread(thread_t* thread) {
+    spin_lock(&free_threads_lock);
+    thread->next = free_threads;
+    free_threads = thread;
+    spin_unlock(&free_threads_lock);
+}
+
+
+static inline thread_t* allocate_thread() {
+    uint64_t  rflags = spin_lock_irqsave(&free_threads_lock);
+    thread_t* thread = free_threads;
+    if (thread != NULL) free_threads = thread->next;
+    spin_unlock_irqrestore(&free_threads_lock, rflags);
+
+    if (thread != NULL) return thread;
+
+    thread = malloc(sizeof(thread_t));
+    if (thread == NULL) return NULL;
+
+    thread->stack_top = allocate_kernel_stack();
+    if (thread->stack_top == NULL) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
@@ -0,0 +1,37 @@
+#ifndef SCHED_THREAD_H
+#define SCHED_THREAD_H
+
+#include "../sync/spinlock.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+typedef void (*thread_entry_t)(void* argument);
+
+typedef enum {
+    THREAD_READY,   // in a run queue (or being moved to one)
+    THREAD_RUNNING, // running on thread->cpu
+    THREAD_BLOCKED, // waiting for wake_thread
+    THREAD_DEAD,    // its stack is reused once the scheduler has switched away from it
+} thread_state_t;
+
+// A kernel thread, its registers are saved on its own stack when it is not running
+typedef struct thread_t {
+    uint64_t         rsp; // saved by switch_context (see switch.asm)
+    void*            stack_top;
+    uint32_t         id;
+    uint32_t         cpu; // the cpu it last ran on, it is queued on its run queue
+    thread_state_t   state;
+    bool             wakeup_pending; // wake_thread was called before block_thread
+    spinlock_t       lock;           // protects blocking and waking up
+    struct thread_t* next;           // run queue or free list link
+} thread_t;
+
+
+thread_t* create_thread(thread_entry_t entry, void* argument);
+thread_t* create_idle_thread(void* stack_top);
+void      exit_thread() __attribute__((noreturn));
+thread_t* get_current_thread();
+void      release_thread(thread_t* thread);
+
+#endif
@@ -0,0 +1,70 @@
+#include "selftest.h"
+#include "../lib/sort.h"
+#include "../log.h"
+#include "../mm/frame/allocator.h"
+#include "../mm/paging/page.h"
+
+
+// The churn allocates and frees FRAME_CHURN_ROUNDS batches of FRAME_CHURN_BATCH frames (1Mi)
+#define FRAME_CHURN_ROUNDS 4096
+#define FRAME_CHURN_BATCH  256
+
+// Orders checked by the contiguous allocations (up to 1MiB blocks)
+#define FRAME_TEST_MAX_ORDER 8
+
+static inline void check_batch(const void* frames[], size_t size);
+static inline int  compare_frames(const void* a, const void* b);
+
+
+// Checks that frames are unique and aligned, that they all come back, and times the churn
+// Nothing else should allocate frames while it runs, the free frames are compared at the end
+void test_frame_allocator() {
+    const void* frames[FRAME_CHURN_BATCH];
+    size_t      free_frames = get_free_frames();
+
+    for (size_t i = 0; i < FRAME_CHURN_BATCH; i++) frames[i] = allocate_frame();
+    check_batch(frames, FRAME_CHURN_BATCH);
+    for (size_t i = 0; i < FRAME_CHURN_BATCH; i++) deallocate_frame(frames[i]);
+
+    for (size_t order = 0; order <= FRAME_TEST_MAX_ORDER; order++) {
+        const void* block = allocate_frames(order);
+        if (((size_t)block & (((size_t)PAGE_SIZE << order) - 1)) != 0)
+            PANIC("Block %p of order %d is not aligned\n", block, order);
+        deallocate_frames(block, order);
+    }
+
+    uint64_t start = start_benchmark();
+    for (size_t round = 0; round < FRAME_CHURN_ROUNDS; round++) {
+        for (size_t i = 0; i < FRAME_CHURN_BATCH; i++) frames[i] = allocate_frame();
+        for (size_t i = 0; i < FRAME_CHURN_BATCH; i++) deallocate_frame(frames[i]);
+    }
+    report("frame alloc+free", FRAME_CHURN_ROUNDS * FRAME_CHURN_BATCH, stop_benchmark(start));
+
+    start = start_benchmark();
+    for (size_t round = 0; round < FRAME_CHURN_ROUNDS; round++) {
+        const void* block = allocate_frames(FRAME_TEST_MAX_ORDER);
+        deallocate_frames(block, FRAME_TEST_MAX_ORDER);
+    }
+    report("frame order 8 alloc+free", FRAME_CHURN_ROUNDS, stop_benchmark(start));
+
+    if (get_free_frames() != free_frames)
+        PANIC("Frame leak (%d free frames, %d before)\n", get_free_frames(), free_frames);
+}
+
+
+// The frames are sorted, so a frame handed out twice ends up next to itself
+static inline void check_batch(const void* frames[], size_t size) {
+    qsort(frames, size, sizeof(const void*), compare_frames);
+
+    for (size_t i = 0; i < size; i++) {
+        if (((size_t)frames[i] & (PAGE_SIZE - 1)) != 0)
+            PANIC("Frame %p is not aligned\n", frames[i]);
+        if (i > 0 && frames[i] == frames[i - 1]) PANIC("Frame %p was allocated twice\n", frames[i]);
+    }
+}
+
+static inline int compare_frames(const void* a, const void* b) {
+    size_t first  = *(const size_t*)a;
+    size_t second = *(const size_t*)b;
+    return first < second ? -1 : first > second;
+}
@@ -0,0 +1,216 @@
+#include "selftest.h"
+#include "../cpu/smp.h"
+#include "../lib/malloc.h"
+#include "../lib/mem.h"
+#include "../log.h"
+#include "../mm/heap/allocator.h"
+#include "../mm/heap/slab.h"
+
+
+// The benchmarks keep HEAP_BENCH_LIVE objects allocated and replace a random one on every pair
+#define HEAP_BENCH_PAIRS (1 << 20)
+#define HEAP_BENCH_LIVE  64
+
+// Size and rounds of the zeroed allocation benchmark
+#define ZEROED_BENCH_SIZE   (64 * 0x400) // 64KiB
+#define ZEROED_BENCH_ROUNDS 1024
+
+// Every thread of the scaling benchmarks runs HEAP_SCALING_PAIRS pairs, with 1, 2, 4... threads
+// The small sizes go to the per-cpu slabs, the big ones (above SLAB_MAX_SIZE) to the per-cpu arenas
+#define HEAP_SCALING_PAIRS (64 * 0x400)
+
+// Blocks allocated by the self-test thread and freed by threads that may run on other cpus
+// Half of them are slab objects, the other half heap blocks
+#define HEAP_REMOTE_BLOCKS     4096
+#define HEAP_REMOTE_SMALL_SIZE 64
+#define HEAP_REMOTE_BIG_SIZE   (2 * SLAB_MAX_SIZE)
+
+// Blocks freed by the remote free threads, each one takes the next block
+typedef struct {
+    void** blocks;
+    size_t next;
+} remote_frees_t;
+
+typedef void* (*allocate_t)(size_t size);
+typedef void (*deallocate_t)(void* address);
+
+static inline void     check_objects(size_t size);
+static inline void     churn(
+    allocate_t allocate, deallocate_t deallocate, size_t pairs, size_t base
+);
+static inline void     check_zeroed(size_t size);
+static inline void     churn_small_objects(void* argument);
+static inline void     churn_big_blocks(void* argument);
+static inline void     free_remote_blocks(void* argument);
+static inline uint64_t next_random(uint64_t* state);
+
+
+// Names of the scaling results, for 1, 2, 4... threads
+static const char* small_scaling_names[] = {
+    "malloc+free <= 2KiB (1 thread)",
+    "malloc+free <= 2KiB (2 threads)",
+    "malloc+free <= 2KiB (4 threads)",
+    "malloc+free <= 2KiB (8 threads)",
+    "malloc+free <= 2KiB (16 threads)",
+};
+static const char* big_scaling_names[] = {
+    "malloc+free > 2KiB (1 thread)",
+    "malloc+free > 2KiB (2 threads)",
+    "malloc+free > 2KiB (4 threads)",
+    "malloc+free > 2KiB (8 threads)",
+    "malloc+free > 2KiB (16 threads)",
+};
+
+
+// Checks every slab size class and compares small allocations with and without the slabs
+void test_slab_allocator() {
+    for (size_t size = SLAB_MIN_SIZE; size <= SLAB_MAX_SIZE; size *= 2) {
+        check_objects(size);
+        check_objects(size - 1);
+    }
+
+    uint64_t start = start_benchmark();
+    churn(malloc, free, HEAP_BENCH_PAIRS, 0);
+    report("malloc+free (slab)", HEAP_BENCH_PAIRS, stop_benchmark(start));
+
+    start = start_benchmark();
+    churn(allocate, deallocate, HEAP_BENCH_PAIRS, 0);
+    report("allocate+deallocate (heap)", HEAP_BENCH_PAIRS, stop_benchmark(start));
+}
+
+// Checks that allocate_zeroed clears reused blocks, and compares it with allocate and memset
+// The heap gives back its free tail, so every round maps the block again
+void test_zeroed_allocations() {
+    // the small block stays mapped and is reused, the big one is unmapped and mapped again
+    check_zeroed(HEAP_GROW_SIZE);
+    check_zeroed(ZEROED_BENCH_SIZE);
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < ZEROED_BENCH_ROUNDS; i++) deallocate(allocate(ZEROED_BENCH_SIZE));
+    report("allocate 64KiB", ZEROED_BENCH_ROUNDS, stop_benchmark(start));
+
+    start = start_benchmark();
+    for (size_t i = 0; i < ZEROED_BENCH_ROUNDS; i++) {
+        uint8_t* address = allocate(ZEROED_BENCH_SIZE);
+        memset(address, 0, ZEROED_BENCH_SIZE);
+        deallocate(address);
+    }
+    report("allocate 64KiB + memset", ZEROED_BENCH_ROUNDS, stop_benchmark(start));
+
+    start = start_benchmark();
+    for (size_t i = 0; i < ZEROED_BENCH_ROUNDS; i++) deallocate(allocate_zeroed(ZEROED_BENCH_SIZE));
+    report("allocate_zeroed 64KiB", ZEROED_BENCH_ROUNDS, stop_benchmark(start));
+}
+
+// Times malloc and free of slab and heap sizes with more and more threads, each cpu has its own
+// slabs and arena so the throughput should grow with the threads
+// Then times the frees of blocks allocated by another cpu, they go through the owner's remote list
+void test_heap_scaling() {
+    size_t cpus_number = get_cpus_number();
+
+    for (size_t threads = 1, i = 0; threads <= cpus_number; threads *= 2, i++) {
+        uint64_t start  = start_benchmark();
+        uint64_t cycles = run_threads(threads, churn_small_objects, NULL);
+        stop_benchmark(start);
+        report(small_scaling_names[i], threads * HEAP_SCALING_PAIRS, cycles);
+
+        start  = start_benchmark();
+        cycles = run_threads(threads, churn_big_blocks, NULL);
+        stop_benchmark(start);
+        report(big_scaling_names[i], threads * HEAP_SCALING_PAIRS, cycles);
+    }
+
+    remote_frees_t remote_frees = {.blocks = malloc(HEAP_REMOTE_BLOCKS * sizeof(void*))};
+    if (remote_frees.blocks == NULL) PANIC("Cannot allocate the remote free test array\n");
+    for (size_t i = 0; i < HEAP_REMOTE_BLOCKS; i++) {
+        remote_frees.blocks[i] = malloc(i % 2 == 0 ? HEAP_REMOTE_SMALL_SIZE : HEAP_REMOTE_BIG_SIZE);
+        if (remote_frees.blocks[i] == NULL) PANIC("Cannot allocate remote free test blocks\n");
+    }
+
+    uint64_t start  = start_benchmark();
+    uint64_t cycles = run_threads(cpus_number, free_remote_blocks, &remote_frees);
+    stop_benchmark(start);
+    report("free (any cpu)", HEAP_REMOTE_BLOCKS, cycles);
+
+    // the owner takes the remote blocks back when it next allocates or frees
+    for (size_t i = 0; i < HEAP_REMOTE_BLOCKS; i++)
+        remote_frees.blocks[i] = malloc(i % 2 == 0 ? HEAP_REMOTE_SMALL_SIZE : HEAP_REMOTE_BIG_SIZE);
+    for (size_t i = 0; i < HEAP_REMOTE_BLOCKS; i++) free(remote_frees.blocks[i]);
+    free(remote_frees.blocks);
+}
+
+
+// Two objects of the same size must not overlap, and must be found as slab objects
+static inline void check_objects(size_t size) {
+    uint8_t* first  = malloc(size);
+    uint8_t* second = malloc(size);
+    if (first == NULL || second == NULL) PANIC("Cannot allocate %d bytes\n", size);
+    if (!is_slab_address(first) || !is_slab_address(second))
+        PANIC("Objects of %d bytes are not slab objects\n", size);
+
+    memset(first, 0x5a, size);
+    memset(second, 0x3c, size);
+    for (size_t i = 0; i < size; i++)
+        if (first[i] != 0x5a) PANIC("Objects %p and %p overlap\n", first, second);
+
+    free(second);
+    free(first);
+}
+
+// Runs allocation and deallocation pairs, the sizes go from base + 1 to base + SLAB_MAX_SIZE
+static inline void churn(allocate_t allocate, deallocate_t deallocate, size_t pairs, size_t base) {
+    void*    objects[HEAP_BENCH_LIVE];
+    uint64_t state = 1;
+
+    for (size_t i = 0; i < HEAP_BENCH_LIVE; i++)
+        objects[i] = allocate(base + next_random(&state) % SLAB_MAX_SIZE + 1);
+
+    for (size_t i = 0; i < pairs; i++) {
+        size_t index = next_random(&state) % HEAP_BENCH_LIVE;
+        deallocate(objects[index]);
+        objects[index] = allocate(base + next_random(&state) % SLAB_MAX_SIZE + 1);
+    }
+
+    for (size_t i = 0; i < HEAP_BENCH_LIVE; i++) deallocate(objects[i]);
+}
+
+static inline void churn_small_objects(void* argument) {
+    (void)argument;
+    churn(malloc, free, HEAP_SCALING_PAIRS, 0);
+}
+
+static inline void churn_big_blocks(void* argument) {
+    (void)argument;
+    churn(malloc, free, HEAP_SCALING_PAIRS, SLAB_MAX_SIZE);
+}
+
+static inline void free_remote_blocks(void* argument) {
+    remote_frees_t* remote_frees = argument;
+
+    size_t index;
+    while ((index = __atomic_fetch_add(&remote_frees->next, 1, __ATOMIC_RELAXED))
+           < HEAP_REMOTE_BLOCKS)
+        free(remote_frees->blocks[index]);
+}
+
+// A block is dirtied and freed, the zeroed block allocated next must not see the old bytes
+static inline void check_zeroed(size_t size) {
+    uint8_t* address = allocate(size);
+    if (address == NULL) PANIC("Cannot allocate %d bytes\n", size);
+    memset(address, 0x5a, size);
+    deallocate(address);
+
+    address = allocate_zeroed(size);
+    if (address == NULL) PANIC("Cannot allocate %d bytes\n", size);
+    for (size_t i = 0; i < size; i++)
+        if (address[i] != 0) PANIC("Byte %d of zeroed block %p is not 0\n", i, address);
+    deallocate(address);
+}
+
+// xorshift, every benchmark starts from the same state so they all get the same sizes
+static inline uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
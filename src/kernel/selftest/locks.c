@@ -0,0 +1,90 @@
+#include "selftest.h"
+#include "../cpu/smp.h"
+#include "../log.h"
+#include "../sync/mcslock.h"
+#include "../sync/spinlock.h"
+#include "../sync/ticketlock.h"
+
+
+// Every thread takes the lock LOCK_ROUNDS times and increments a counter while holding it
+#define LOCK_ROUNDS 20000
+
+typedef enum {
+    SPINLOCK,
+    TICKET_LOCK,
+    MCS_LOCK,
+} lock_type_t;
+
+// Shared by the threads of a run
+typedef struct {
+    lock_type_t   type;
+    spinlock_t    spinlock;
+    ticket_lock_t ticket_lock;
+    mcs_lock_t    mcs_lock;
+    size_t        counter; // only changed with the lock held
+} lock_test_t;
+
+static inline void time_lock(const char* name, lock_type_t type, size_t threads);
+static inline void take_lock(void* argument);
+
+
+// Checks that the locks exclude each other and compares them with one thread and with a thread
+// for each cpu, the interrupt disabling variants are used so a holder is never preempted
+void test_locks() {
+    size_t cpus_number = get_cpus_number();
+
+    time_lock("spinlock (1 thread)", SPINLOCK, 1);
+    time_lock("ticket lock (1 thread)", TICKET_LOCK, 1);
+    time_lock("MCS lock (1 thread)", MCS_LOCK, 1);
+    time_lock("spinlock (1 thread per cpu)", SPINLOCK, cpus_number);
+    time_lock("ticket lock (1 thread per cpu)", TICKET_LOCK, cpus_number);
+    time_lock("MCS lock (1 thread per cpu)", MCS_LOCK, cpus_number);
+}
+
+
+static inline void time_lock(const char* name, lock_type_t type, size_t threads) {
+    lock_test_t test = {
+        .type        = type,
+        .spinlock    = SPINLOCK_INIT,
+        .ticket_lock = TICKET_LOCK_INIT,
+        .mcs_lock    = MCS_LOCK_INIT,
+    };
+
+    // the threads are timed from the moment they all run, not from their creation
+    uint64_t start  = start_benchmark();
+    uint64_t cycles = run_threads(threads, take_lock, &test);
+    stop_benchmark(start);
+
+    if (test.counter != threads * LOCK_ROUNDS)
+        PANIC("%s: counter is %d instead of %d\n", name, test.counter, threads * LOCK_ROUNDS);
+    report(name, threads * LOCK_ROUNDS, cycles);
+}
+
+static inline void take_lock(void* argument) {
+    lock_test_t* test = argument;
+
+    for (size_t round = 0; round < LOCK_ROUNDS; round++) {
+        uint64_t   rflags;
+        mcs_node_t node;
+
+        switch (test->type) {
+        case SPINLOCK:
+            rflags = spin_lock_irqsave(&test->spinlock);
+            test->counter++;
+            spin_unlock_irqrestore(&test->spinlock, rflags);
+            break;
+
+        case TICKET_LOCK:
+            rflags = ticket_lock_irqsave(&test->ticket_lock);
+            test->counter++;
+            ticket_unlock_irqrestore(&test->ticket_lock, rflags);
+            break;
+
+        case MCS_LOCK:
+            rflags = mcs_lock_irqsave(&test->mcs_lock, &node);
+            test->counter++;
+            mcs_unlock_irqrestore(&test->mcs_lock, &node, rflags);
+            break;
+        }
+    }
+}
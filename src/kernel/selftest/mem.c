@@ -0,0 +1,233 @@
+#include "selftest.h"
+#include "../lib/mem.h"
+#include "../log.h"
+#include "../mm/paging/page.h"
+#include "../mm/vma/vmalloc.h"
+#include <stdint.h>
+
+
+// Every length up to MEM_CHECK_LENGTH is checked, with every alignment of both buffers
+// It goes past the length at which the string instructions are used
+#define MEM_CHECK_LENGTH    300
+#define MEM_CHECK_OFFSETS   8
+#define MEM_CHECK_GUARD     16
+#define MEM_CHECK_PATTERN   0x11
+#define MEM_CHECK_SET_VALUE 0x5a
+
+// The benchmarks process MEM_BENCH_BYTES for every size, from 16B to 4MiB (x16 each time)
+#define MEM_BENCH_MIN_SIZE 16
+#define MEM_BENCH_MAX_SIZE (4 * 0x100000)
+#define MEM_BENCH_BYTES    (8 * 0x100000)
+
+// The page benchmarks go through PAGE_BENCH_SIZE bytes, more than most L2 caches hold
+// A warm PAGE_BENCH_HOT_SIZE buffer is read again afterwards, to see what the stores evicted
+#define PAGE_BENCH_SIZE     (4 * 0x100000)
+#define PAGE_BENCH_HOT_SIZE (64 * 0x400)
+#define CACHE_LINE_SIZE     64
+
+typedef void (*zero_t)(uint8_t* page);
+typedef void (*copy_t)(uint8_t* destination, const uint8_t* source);
+
+static inline void     check_copy(uint8_t* destination, uint8_t* source, size_t length);
+static inline void     check_set(uint8_t* destination, size_t length);
+static inline void     check_move(uint8_t* buffer, size_t length, size_t distance);
+static inline void     check_unchanged(const uint8_t* start, const uint8_t* end);
+static inline void     fill(uint8_t* buffer, size_t length, uint8_t first);
+static inline void     copy_bytes(void* destination, const void* source, size_t length);
+static inline void     check_page(const uint8_t* page, uint8_t first);
+static inline void     zero_with_memset(uint8_t* page);
+static inline void     zero_with_zero_page(uint8_t* page);
+static inline void     copy_with_memcpy(uint8_t* destination, const uint8_t* source);
+static inline void     copy_with_copy_page(uint8_t* destination, const uint8_t* source);
+static inline void     time_zeroing(const char* name, zero_t zero, uint8_t* pages, uint8_t* hot);
+static inline void     time_copying(const char* name, copy_t copy, uint8_t* pages, uint8_t* hot);
+static inline uint64_t read_lines(const uint8_t* buffer, size_t size);
+
+
+// Compares the mem functions with byte loops for every length, alignment and overlap
+// Then times them from 16B to 4MiB, the byte loop is how they were written before
+void test_mem_functions() {
+    uint8_t* source      = vmalloc(MEM_BENCH_MAX_SIZE);
+    uint8_t* destination = vmalloc(MEM_BENCH_MAX_SIZE);
+    if (source == NULL || destination == NULL) PANIC("Cannot allocate the mem test buffers\n");
+
+    for (size_t length = 0; length <= MEM_CHECK_LENGTH; length++) {
+        for (size_t offset = 0; offset < MEM_CHECK_OFFSETS; offset++) {
+            check_set(destination + MEM_CHECK_GUARD + offset, length);
+            check_move(destination + MEM_CHECK_GUARD, length, offset + 1);
+
+            for (size_t source_offset = 0; source_offset < MEM_CHECK_OFFSETS; source_offset++)
+                check_copy(
+                    destination + MEM_CHECK_GUARD + offset, source + source_offset, length
+                );
+        }
+    }
+
+    fill(source, MEM_BENCH_MAX_SIZE, 0);
+    for (size_t size = MEM_BENCH_MIN_SIZE; size <= MEM_BENCH_MAX_SIZE; size *= 16) {
+        size_t rounds = MEM_BENCH_BYTES / size;
+
+        uint64_t start = start_benchmark();
+        for (size_t i = 0; i < rounds; i++) memset(destination, 0, size);
+        report_bandwidth("memset", size, MEM_BENCH_BYTES, stop_benchmark(start));
+
+        start = start_benchmark();
+        for (size_t i = 0; i < rounds; i++) memcpy(destination, source, size);
+        report_bandwidth("memcpy", size, MEM_BENCH_BYTES, stop_benchmark(start));
+
+        start = start_benchmark();
+        for (size_t i = 0; i < rounds; i++) memmove(destination + 1, destination, size - 1);
+        report_bandwidth("memmove (overlapping)", size, MEM_BENCH_BYTES, stop_benchmark(start));
+
+        start = start_benchmark();
+        for (size_t i = 0; i < rounds; i++) copy_bytes(destination, source, size);
+        report_bandwidth("byte loop copy", size, MEM_BENCH_BYTES, stop_benchmark(start));
+    }
+
+    vfree(destination);
+    vfree(source);
+}
+
+// Checks that zero_page and copy_page only touch their page, then compares them with memset and
+// memcpy: the non-temporal stores bypass the cache, so the hot buffer should stay cached
+void test_page_functions() {
+    uint8_t* pages = vmalloc(PAGE_BENCH_SIZE);
+    uint8_t* hot   = vmalloc(PAGE_BENCH_HOT_SIZE);
+    if (pages == NULL || hot == NULL) PANIC("Cannot allocate the page test buffers\n");
+
+    fill(pages, 3 * PAGE_SIZE, 1);
+    zero_page(pages + PAGE_SIZE);
+    check_page(pages, 1);
+    check_page(pages + PAGE_SIZE, 0);
+    check_page(pages + 2 * PAGE_SIZE, 1); // the filled bytes wrap at every page
+
+    fill(pages + 3 * PAGE_SIZE, PAGE_SIZE, 2);
+    copy_page(pages + PAGE_SIZE, pages + 3 * PAGE_SIZE);
+    check_page(pages, 1);
+    check_page(pages + PAGE_SIZE, 2);
+    check_page(pages + 2 * PAGE_SIZE, 1);
+
+    time_zeroing("memset", zero_with_memset, pages, hot);
+    time_zeroing("zero_page", zero_with_zero_page, pages, hot);
+    time_copying("memcpy", copy_with_memcpy, pages, hot);
+    time_copying("copy_page", copy_with_copy_page, pages, hot);
+
+    vfree(hot);
+    vfree(pages);
+}
+
+
+// The bytes around the copy must not change
+static inline void check_copy(uint8_t* destination, uint8_t* source, size_t length) {
+    fill(source, length, 1);
+    memset(destination - MEM_CHECK_GUARD, MEM_CHECK_PATTERN, length + 2 * MEM_CHECK_GUARD);
+
+    if (memcpy(destination, source, length) != destination) PANIC("memcpy return value\n");
+    for (size_t i = 0; i < length; i++)
+        if (destination[i] != source[i]) PANIC("memcpy of %d bytes at %p\n", length, destination);
+
+    check_unchanged(destination - MEM_CHECK_GUARD, destination);
+    check_unchanged(destination + length, destination + length + MEM_CHECK_GUARD);
+}
+
+static inline void check_set(uint8_t* destination, size_t length) {
+    memset(destination - MEM_CHECK_GUARD, MEM_CHECK_PATTERN, length + 2 * MEM_CHECK_GUARD);
+
+    if (memset(destination, MEM_CHECK_SET_VALUE, length) != destination)
+        PANIC("memset return value\n");
+    for (size_t i = 0; i < length; i++)
+        if (destination[i] != MEM_CHECK_SET_VALUE)
+            PANIC("memset of %d bytes at %p\n", length, destination);
+
+    check_unchanged(destination - MEM_CHECK_GUARD, destination);
+    check_unchanged(destination + length, destination + length + MEM_CHECK_GUARD);
+}
+
+// Moves the bytes distance bytes forward, then back where they were
+static inline void check_move(uint8_t* buffer, size_t length, size_t distance) {
+    fill(buffer, length, 1);
+    memmove(buffer + distance, buffer, length);
+    for (size_t i = 0; i < length; i++)
+        if (buffer[distance + i] != (uint8_t)(i + 1))
+            PANIC("memmove of %d bytes forward by %d\n", length, distance);
+
+    memmove(buffer, buffer + distance, length);
+    for (size_t i = 0; i < length; i++)
+        if (buffer[i] != (uint8_t)(i + 1))
+            PANIC("memmove of %d bytes backward by %d\n", length, distance);
+}
+
+static inline void check_unchanged(const uint8_t* start, const uint8_t* end) {
+    for (const uint8_t* byte = start; byte < end; byte++)
+        if (*byte != MEM_CHECK_PATTERN) PANIC("Byte %p was overwritten\n", byte);
+}
+
+// The bytes count up from first, so a byte copied to the wrong place is noticed
+static inline void fill(uint8_t* buffer, size_t length, uint8_t first) {
+    for (size_t i = 0; i < length; i++) buffer[i] = (uint8_t)(first + i);
+}
+
+static inline void copy_bytes(void* destination, const void* source, size_t length) {
+    uint8_t*       dest = destination;
+    const uint8_t* src  = source;
+    while (length-- > 0) *dest++ = *src++;
+}
+
+// The page has to hold the bytes written by fill, or only zeroes if first is 0
+static inline void check_page(const uint8_t* page, uint8_t first) {
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        uint8_t expected = first == 0 ? 0 : (uint8_t)(first + i);
+        if (page[i] != expected) PANIC("Byte %d of page %p is wrong\n", i, page);
+    }
+}
+
+static inline void zero_with_memset(uint8_t* page) { memset(page, 0, PAGE_SIZE); }
+static inline void zero_with_zero_page(uint8_t* page) { zero_page(page); }
+
+static inline void copy_with_memcpy(uint8_t* destination, const uint8_t* source) {
+    memcpy(destination, source, PAGE_SIZE);
+}
+
+static inline void copy_with_copy_page(uint8_t* destination, const uint8_t* source) {
+    copy_page(destination, source);
+}
+
+// Times the zeroing of the pages, then the reads of the hot buffer (warmed before the zeroing)
+static inline void time_zeroing(const char* name, zero_t zero, uint8_t* pages, uint8_t* hot) {
+    size_t   pages_number = PAGE_BENCH_SIZE / PAGE_SIZE;
+    size_t   lines        = PAGE_BENCH_HOT_SIZE / CACHE_LINE_SIZE;
+
+    read_lines(hot, PAGE_BENCH_HOT_SIZE); // warms the hot buffer
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < pages_number; i++) zero(pages + i * PAGE_SIZE);
+    report_bandwidth(name, PAGE_SIZE, PAGE_BENCH_SIZE, stop_benchmark(start));
+
+    uint64_t cycles = read_lines(hot, PAGE_BENCH_HOT_SIZE);
+    LOG("Hot buffer read after %s: %u cycles/line\n", name, (unsigned int)(cycles / lines));
+}
+
+// Copies the first half of the pages to the second one
+static inline void time_copying(const char* name, copy_t copy, uint8_t* pages, uint8_t* hot) {
+    size_t   pages_number = PAGE_BENCH_SIZE / PAGE_SIZE / 2;
+    size_t   lines        = PAGE_BENCH_HOT_SIZE / CACHE_LINE_SIZE;
+
+    read_lines(hot, PAGE_BENCH_HOT_SIZE); // warms the hot buffer
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < pages_number; i++)
+        copy(pages + (pages_number + i) * PAGE_SIZE, pages + i * PAGE_SIZE);
+    report_bandwidth(name, PAGE_SIZE, PAGE_BENCH_SIZE / 2, stop_benchmark(start));
+
+    uint64_t cycles = read_lines(hot, PAGE_BENCH_HOT_SIZE);
+    LOG("Hot buffer read after %s: %u cycles/line\n", name, (unsigned int)(cycles / lines));
+}
+
+// Reads a byte of every cache line and returns the cycles it took
+static inline uint64_t read_lines(const uint8_t* buffer, size_t size) {
+    const volatile uint8_t* bytes = buffer;
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < size; i += CACHE_LINE_SIZE) (void)bytes[i];
+    return stop_benchmark(start);
+}
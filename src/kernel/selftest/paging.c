@@ -0,0 +1,347 @@
+#include "selftest.h"
+#include "../cpu/cpu.h"
+#include "../cpu/timer.h"
+#include "../log.h"
+#include "../mm/frame/allocator.h"
+#include "../mm/paging/addrspace.h"
+#include "../mm/paging/page.h"
+#include "../mm/paging/paging.h"
+#include "../mm/vma/vmalloc.h"
+#include <stdint.h>
+
+
+// The stride benchmarks read a byte of every page of STRIDE_SIZE bytes, STRIDE_ROUNDS times
+// With 4KiB pages that is more entries than the TLB holds, the direct map only needs a few
+#define STRIDE_ORDER  12 // 16MiB
+#define STRIDE_SIZE   ((size_t)PAGE_SIZE << STRIDE_ORDER)
+#define STRIDE_ROUNDS 16
+
+// After every switch or flush KERNEL_TOUCH_PAGES pages of the kernel image are read
+#define SWITCH_ROUNDS      4096
+#define KERNEL_TOUCH_PAGES 32
+
+#define CR4_PGE_BIT 0x80
+
+// The copy on write test maps COW_TEST_PAGES pages in the lower half of a new address space
+#define COW_TEST_ADDRESS ((uint64_t*)0x400000000) // 16GiB
+#define COW_TEST_PAGES   256
+#define COW_TEST_FLAGS   (PAGE_FLAG_WRITABLE | PAGE_FLAG_NO_EXECUTE)
+#define COW_CLONE_ROUNDS 256
+#define COW_WORDS        (PAGE_SIZE / sizeof(uint64_t)) // words in a page
+
+// The huge page tests map 2MiB pages from HUGE_TEST_ADDRESS, in the lower half of a test space
+#define HUGE_TEST_ADDRESS ((uint8_t*)0x800000000) // 32GiB
+#define HUGE_TEST_ORDER   9                       // 2MiB of frames
+#define HUGE_TEST_PAGES   (PAGE_SIZE_2MIB / PAGE_SIZE)
+#define HUGE_MAP_ROUNDS   256
+
+// vmalloc maps and vfree unmaps VMALLOC_BENCH_SIZE bytes VMALLOC_BENCH_ROUNDS times
+#define VMALLOC_BENCH_SIZE   (4 * 0x100000)
+#define VMALLOC_BENCH_ROUNDS 64
+
+static inline void     check_direct_map(const void* frame);
+static inline uint64_t read_pages(const uint8_t* buffer);
+static inline void     touch_kernel_pages();
+static inline void     write_pages(const address_space_t* address_space, uint64_t value);
+static inline void     check_pages(const address_space_t* address_space, uint64_t value);
+static inline void     check_references(const address_space_t* address_space, size_t expected);
+static inline void     check_huge_page(const uint8_t* frames, size_t unmapped_page);
+static inline void     keep_frame(const void* frame);
+static inline void     keep_frames(const void* frame, size_t order);
+
+
+// Defined in boot.asm, saved when the boot code started and when it called kernel_main
+extern uint64_t boot_tsc;
+extern uint64_t kernel_main_tsc;
+
+// Mapped with the kernel sections, like the kernel code
+static uint8_t kernel_pages[KERNEL_TOUCH_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+
+// Prints the time taken by the boot code, checks the direct map, then compares reads through the
+// direct map (huge pages) with reads through vmalloc (4KiB pages)
+void test_huge_pages() {
+    uint64_t boot_cycles = kernel_main_tsc - boot_tsc;
+    LOG(
+        "Boot code: %u cycles, %u us\n",
+        (unsigned int)boot_cycles,
+        (unsigned int)(tsc_to_ns(boot_cycles) / 1000)
+    );
+
+    const uint8_t* frames = allocate_frames(STRIDE_ORDER);
+    for (size_t offset = 0; offset < STRIDE_SIZE; offset += PAGE_SIZE_2MIB)
+        check_direct_map(frames + offset);
+
+    uint8_t* pages = vmalloc(STRIDE_SIZE);
+    if (pages == NULL) PANIC("Cannot allocate the stride test buffer\n");
+    if (get_physical_address(pages) == (void*)-1) PANIC("vmalloc area %p is not mapped\n", pages);
+
+    size_t reads = STRIDE_ROUNDS * (STRIDE_SIZE / PAGE_SIZE);
+    report("page stride read (direct map)", reads, read_pages(PHYS_TO_VIRT(frames)));
+    report("page stride read (vmalloc)", reads, read_pages(pages));
+
+    vfree(pages);
+    deallocate_frames(frames, STRIDE_ORDER);
+}
+
+// Times address space switches, and compares the flushes that keep the global kernel entries with
+// the ones that drop them, with the kernel pages read after each one
+// Interrupts stay disabled, so the thread keeps the cpu while the new address space is loaded
+void test_global_pages() {
+    if (has_global_pages() && (read_cr4() & CR4_PGE_BIT) == 0)
+        PANIC("Global pages are supported but not enabled\n");
+
+    address_space_t        address_space = create_address_space();
+    const address_space_t* kernel        = get_kernel_address_space();
+    uint64_t               rflags        = disable_interrupts();
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < SWITCH_ROUNDS; i++) {
+        switch_address_space(&address_space);
+        touch_kernel_pages();
+        switch_address_space(kernel);
+        touch_kernel_pages();
+    }
+    uint64_t switch_cycles = stop_benchmark(start);
+
+    start = start_benchmark();
+    for (size_t i = 0; i < SWITCH_ROUNDS; i++) {
+        flush_tlb();
+        touch_kernel_pages();
+    }
+    uint64_t flush_cycles = stop_benchmark(start);
+
+    start = start_benchmark();
+    for (size_t i = 0; i < SWITCH_ROUNDS; i++) {
+        flush_tlb_all();
+        touch_kernel_pages();
+    }
+    uint64_t flush_all_cycles = stop_benchmark(start);
+
+    restore_interrupts(rflags);
+    destroy_address_space(&address_space);
+
+    report("address space switch + kernel reads", 2 * SWITCH_ROUNDS, switch_cycles);
+    report("flush_tlb + kernel reads", SWITCH_ROUNDS, flush_cycles);
+    report("flush_tlb_all + kernel reads", SWITCH_ROUNDS, flush_all_cycles);
+}
+
+// Checks that a clone shares the frames until one of the address spaces writes to them, and that
+// nothing leaks, then times clones and copy on write faults
+// Interrupts are disabled while an address space other than the kernel one is loaded
+void test_copy_on_write() {
+    size_t          free_frames = get_free_frames();
+    address_space_t parent      = create_address_space();
+    map_range_in(
+        PHYS_TO_VIRT(parent.table4),
+        COW_TEST_ADDRESS,
+        MAP_NEW_FRAMES,
+        COW_TEST_PAGES * PAGE_SIZE,
+        COW_TEST_FLAGS,
+        allocate_frame
+    );
+    write_pages(&parent, 1);
+
+    address_space_t child = clone_address_space(&parent);
+    check_references(&parent, 2);
+
+    // the child gets its own copies, the parent then owns the old frames alone
+    uint64_t rflags = disable_interrupts();
+    switch_address_space(&child);
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < COW_TEST_PAGES; i++) COW_TEST_ADDRESS[i * COW_WORDS] = 2 + i;
+    uint64_t fault_cycles = stop_benchmark(start);
+    switch_address_space(get_kernel_address_space());
+    restore_interrupts(rflags);
+
+    check_pages(&child, 2);
+    check_pages(&parent, 1);
+    check_references(&parent, 1);
+    check_references(&child, 1);
+
+    // the parent takes its frames over without copying them
+    write_pages(&parent, 3);
+    check_pages(&child, 2);
+    destroy_address_space(&child);
+
+    start = start_benchmark();
+    for (size_t i = 0; i < COW_CLONE_ROUNDS; i++) {
+        child = clone_address_space(&parent);
+        destroy_address_space(&child);
+    }
+    uint64_t clone_cycles = stop_benchmark(start);
+
+    check_references(&parent, 1);
+    destroy_address_space(&parent);
+    if (get_free_frames() != free_frames)
+        PANIC("Frame leak (%d free frames, %d before)\n", get_free_frames(), free_frames);
+
+    report("copy on write fault", COW_TEST_PAGES, fault_cycles);
+    report("clone + destroy (256 pages)", COW_CLONE_ROUNDS, clone_cycles);
+}
+
+// Checks that a 2MiB page reaches its frames, and that unmapping one of its 4KiB pages splits it
+// without changing the others, then compares mapping 2MiB with a huge page and with 4KiB pages
+// Interrupts are disabled while the test address space is loaded
+void test_huge_page_mapping() {
+    size_t          free_frames   = get_free_frames();
+    address_space_t address_space = create_address_space();
+    const uint8_t*  frames        = allocate_frames(HUGE_TEST_ORDER);
+    page_t          page          = {.fields.address = (size_t)HUGE_TEST_ADDRESS / PAGE_SIZE};
+
+    // every page holds its index, written through the direct map
+    for (size_t i = 0; i < HUGE_TEST_PAGES; i++)
+        *(uint64_t*)PHYS_TO_VIRT(frames + i * PAGE_SIZE) = i;
+
+    uint64_t rflags = disable_interrupts();
+    switch_address_space(&address_space);
+
+    map_huge_page_to_frame(page, PAGE_SIZE_2MIB, COW_TEST_FLAGS, frames, allocate_frame);
+    check_huge_page(frames, HUGE_TEST_PAGES);
+    unmap_page((page_t){.fields.address = page.fields.address + 1}, deallocate_frame, true);
+    check_huge_page(frames, 1);
+    unmap_range(HUGE_TEST_ADDRESS, PAGE_SIZE_2MIB, deallocate_frame, false);
+
+    // the next 2MiB have no table1 yet, the ones after them get one with the first map_range
+    page_t huge_page = {.fields.address = page.fields.address + HUGE_TEST_PAGES};
+    frames           = allocate_frames(HUGE_TEST_ORDER);
+
+    uint64_t start = start_benchmark();
+    for (size_t i = 0; i < HUGE_MAP_ROUNDS; i++) {
+        map_huge_page_to_frame(huge_page, PAGE_SIZE_2MIB, COW_TEST_FLAGS, frames, allocate_frame);
+        unmap_huge_page(huge_page, PAGE_SIZE_2MIB, keep_frames, true);
+    }
+    uint64_t huge_cycles = stop_benchmark(start);
+
+    uint8_t* range = HUGE_TEST_ADDRESS + 2 * PAGE_SIZE_2MIB;
+    start          = start_benchmark();
+    for (size_t i = 0; i < HUGE_MAP_ROUNDS; i++) {
+        map_range(range, frames, PAGE_SIZE_2MIB, COW_TEST_FLAGS, allocate_frame);
+        unmap_range(range, PAGE_SIZE_2MIB, keep_frame, true);
+    }
+    uint64_t range_cycles = stop_benchmark(start);
+
+    switch_address_space(get_kernel_address_space());
+    restore_interrupts(rflags);
+
+    deallocate_frames(frames, HUGE_TEST_ORDER);
+    destroy_address_space(&address_space);
+    if (get_free_frames() != free_frames)
+        PANIC("Frame leak (%d free frames, %d before)\n", get_free_frames(), free_frames);
+
+    report("map+unmap 2MiB (huge page)", HUGE_MAP_ROUNDS, huge_cycles);
+    report("map+unmap 2MiB (4KiB pages)", HUGE_MAP_ROUNDS, range_cycles);
+}
+
+// Checks that every vmalloc page is mapped to its own frame, then times big vmallocs and kernel
+// stacks, their pages are mapped with one walk per table1
+void test_vmalloc() {
+    uint8_t* area = vmalloc(VMALLOC_BENCH_SIZE);
+    if (area == NULL) PANIC("Cannot allocate the vmalloc test area\n");
+
+    for (size_t offset = 0; offset < VMALLOC_BENCH_SIZE; offset += PAGE_SIZE) {
+        const void* frame = get_physical_address(area + offset);
+        if (frame == (void*)-1) PANIC("vmalloc page %p is not mapped\n", area + offset);
+        *(uint64_t*)(area + offset) = offset;
+    }
+    for (size_t offset = 0; offset < VMALLOC_BENCH_SIZE; offset += PAGE_SIZE)
+        if (*(uint64_t*)(area + offset) != offset) PANIC("vmalloc pages share a frame\n");
+    vfree(area);
+
+    // the page tables created by the first vmalloc are kept, the next ones reuse them
+    size_t   free_frames = get_free_frames();
+    uint64_t start       = start_benchmark();
+    for (size_t i = 0; i < VMALLOC_BENCH_ROUNDS; i++) vfree(vmalloc(VMALLOC_BENCH_SIZE));
+    report("vmalloc+vfree 4MiB", VMALLOC_BENCH_ROUNDS, stop_benchmark(start));
+
+    start = start_benchmark();
+    for (size_t i = 0; i < VMALLOC_BENCH_ROUNDS; i++)
+        deallocate_kernel_stack(allocate_kernel_stack());
+    report("kernel stack allocate+deallocate", VMALLOC_BENCH_ROUNDS, stop_benchmark(start));
+
+    if (get_free_frames() != free_frames)
+        PANIC("Frame leak (%d free frames, %d before)\n", get_free_frames(), free_frames);
+}
+
+
+// The direct map has to reach the frame at PHYS_OFFSET, with the same bytes
+static inline void check_direct_map(const void* frame) {
+    uint8_t* virtual = PHYS_TO_VIRT(frame);
+    if (get_physical_address(virtual) != frame)
+        PANIC("Direct map address %p is not mapped to %p\n", virtual, frame);
+
+    *(volatile uint8_t*)virtual = 0x5a;
+    if (*(volatile uint8_t*)virtual != 0x5a) PANIC("Cannot write frame %p\n", frame);
+}
+
+static inline void touch_kernel_pages() {
+    const volatile uint8_t* bytes = kernel_pages;
+    for (size_t i = 0; i < KERNEL_TOUCH_PAGES; i++) (void)bytes[i * PAGE_SIZE];
+}
+
+// Writes value + page index to the first word of every test page
+static inline void write_pages(const address_space_t* address_space, uint64_t value) {
+    uint64_t rflags = disable_interrupts();
+    switch_address_space(address_space);
+
+    for (size_t i = 0; i < COW_TEST_PAGES; i++) COW_TEST_ADDRESS[i * COW_WORDS] = value + i;
+
+    switch_address_space(get_kernel_address_space());
+    restore_interrupts(rflags);
+}
+
+static inline void check_pages(const address_space_t* address_space, uint64_t value) {
+    uint64_t rflags = disable_interrupts();
+    switch_address_space(address_space);
+
+    for (size_t i = 0; i < COW_TEST_PAGES; i++)
+        if (COW_TEST_ADDRESS[i * COW_WORDS] != value + i)
+            PANIC("Page %d of table4 %p was changed\n", i, address_space->table4);
+
+    switch_address_space(get_kernel_address_space());
+    restore_interrupts(rflags);
+}
+
+static inline void check_references(const address_space_t* address_space, size_t expected) {
+    uint64_t rflags = disable_interrupts();
+    switch_address_space(address_space);
+
+    for (size_t i = 0; i < COW_TEST_PAGES; i++) {
+        const void* frame      = get_physical_address(COW_TEST_ADDRESS + i * COW_WORDS);
+        size_t      references = get_frame_references(frame);
+        if (references != expected)
+            PANIC("Frame %p has %d references instead of %d\n", frame, references, expected);
+    }
+
+    switch_address_space(get_kernel_address_space());
+    restore_interrupts(rflags);
+}
+
+// Every page of HUGE_TEST_ADDRESS has to reach its frame and hold its index, except unmapped_page
+static inline void check_huge_page(const uint8_t* frames, size_t unmapped_page) {
+    for (size_t i = 0; i < HUGE_TEST_PAGES; i++) {
+        uint8_t*    virtual  = HUGE_TEST_ADDRESS + i * PAGE_SIZE;
+        const void* expected = i == unmapped_page ? (void*)-1 : frames + i * PAGE_SIZE;
+        if (get_physical_address(virtual) != expected)
+            PANIC("Page %p is not mapped to %p\n", virtual, expected);
+        if (i != unmapped_page && *(uint64_t*)virtual != i) PANIC("Page %p was changed\n", virtual);
+    }
+}
+
+// The benchmarks map the same frames again and again, they are freed at the end
+static inline void keep_frame(const void* frame) { (void)frame; }
+
+static inline void keep_frames(const void* frame, size_t order) {
+    (void)frame;
+    (void)order;
+}
+
+// Reads a byte of every page and returns the cycles it took
+static inline uint64_t read_pages(const uint8_t* buffer) {
+    const volatile uint8_t* bytes = buffer;
+
+    uint64_t start = start_benchmark();
+    for (size_t round = 0; round < STRIDE_ROUNDS; round++)
+        for (size_t offset = 0; offset < STRIDE_SIZE; offset += PAGE_SIZE) (void)bytes[offset];
+    return stop_benchmark(start);
+}
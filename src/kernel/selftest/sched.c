@@ -0,0 +1,98 @@
+#include "selftest.h"
+#include "../cpu/cpu.h"
+#include "../cpu/smp.h"
+#include "../log.h"
+#include "../sched/scheduler.h"
+
+
+// Every pair of threads passes the turn back and forth PING_PONG_ROUNDS times
+// A thread woken up for an idle cpu waits for its next tick, so a round can take 2 ticks
+#define PING_PONG_ROUNDS 1000
+
+// Every yielding thread gives the cpu away YIELD_ROUNDS times
+#define YIELD_ROUNDS 10000
+
+// Two threads blocking and waking each other up
+typedef struct {
+    thread_t* threads[2];
+    uint32_t  turn; // index of the thread that runs next
+} ping_pong_pair_t;
+
+typedef struct {
+    ping_pong_pair_t pairs[MAX_CPUS];
+    uint32_t         next_thread; // gives every thread its side of a pair
+    uint64_t         used_cpus;   // one bit for each cpu that ran a test thread
+} ping_pong_t;
+
+static inline uint64_t run_ping_pong(size_t pairs_number, uint64_t* used_cpus);
+static inline void     ping_pong(void* argument);
+static inline void     yield_loop(void* argument);
+static inline uint32_t count_cpus(uint64_t cpus);
+
+
+// Times block_thread and wake_thread between pairs of threads, first a single pair (the latency
+// of a round trip), then a pair for each cpu (the throughput, if the cpus steal the threads)
+// Then times yield with more threads than cpus
+void test_scheduler() {
+    size_t cpus_number = get_cpus_number();
+
+    uint64_t used_cpus;
+
+    uint64_t cycles = run_ping_pong(1, &used_cpus);
+    report("ping-pong round trip (1 pair)", PING_PONG_ROUNDS, cycles);
+    LOG("Ping-pong threads ran on %d cpus\n", count_cpus(used_cpus));
+
+    cycles = run_ping_pong(cpus_number, &used_cpus);
+    report("ping-pong round trip (1 pair per cpu)", cpus_number * PING_PONG_ROUNDS, cycles);
+    LOG("Ping-pong threads ran on %d of %d cpus\n", count_cpus(used_cpus), cpus_number);
+
+    uint64_t start = start_benchmark();
+    cycles         = run_threads(2 * cpus_number, yield_loop, NULL);
+    stop_benchmark(start);
+    report("yield (2 threads per cpu)", 2 * cpus_number * YIELD_ROUNDS, cycles);
+}
+
+
+// Returns the cycles taken by the rounds, used_cpus gets the cpus that ran the threads
+static inline uint64_t run_ping_pong(size_t pairs_number, uint64_t* used_cpus) {
+    ping_pong_t state = {0};
+
+    uint64_t start  = start_benchmark();
+    uint64_t cycles = run_threads(2 * pairs_number, ping_pong, &state);
+    stop_benchmark(start);
+
+    *used_cpus = state.used_cpus;
+    return cycles;
+}
+
+// The turn is checked after every wake up, block_thread can return early
+static inline void ping_pong(void* argument) {
+    ping_pong_t*      state = argument;
+    uint32_t          index = __atomic_fetch_add(&state->next_thread, 1, __ATOMIC_RELAXED);
+    ping_pong_pair_t* pair  = &state->pairs[index / 2];
+    uint32_t          side  = index % 2;
+
+    __atomic_store_n(&pair->threads[side], get_current_thread(), __ATOMIC_RELEASE);
+    thread_t* partner;
+    while ((partner = __atomic_load_n(&pair->threads[1 - side], __ATOMIC_ACQUIRE)) == NULL) yield();
+
+    for (size_t round = 0; round < PING_PONG_ROUNDS; round++) {
+        while (__atomic_load_n(&pair->turn, __ATOMIC_ACQUIRE) != side) block_thread();
+
+        __atomic_or_fetch(&state->used_cpus, 1ull << get_cpu_id(), __ATOMIC_RELAXED);
+        __atomic_store_n(&pair->turn, 1 - side, __ATOMIC_RELEASE);
+        wake_thread(partner);
+    }
+}
+
+static inline void yield_loop(void* argument) {
+    (void)argument;
+    for (size_t round = 0; round < YIELD_ROUNDS; round++) yield();
+}
+
+// popcount would need libgcc, the kernel is not linked with it
+static inline uint32_t count_cpus(uint64_t cpus) {
+    uint32_t count = 0;
+    for (; cpus != 0; cpus &= cpus - 1) count++;
+    return count;
+}
@@ -0,0 +1,131 @@
+#include "selftest.h"
+#include "../cpu/cpu.h"
+#include "../cpu/timer.h"
+#include "../log.h"
+#include "../sched/scheduler.h"
+
+
+// Threads started by run_threads, they wait for each other before calling entry
+// The last one to start reads the TSC, the last one to return reads it again and wakes the waiter
+typedef struct {
+    thread_entry_t entry;
+    void*          argument;
+    size_t         threads;
+    size_t         ready;
+    size_t         finished;
+    size_t         running; // the group can be freed when it is 0
+    uint64_t       start;
+    uint64_t       end;
+    thread_t*      waiter;
+} thread_group_t;
+
+static inline void run_selftests(void* argument);
+static inline void run_group_thread(void* argument);
+
+
+// The debug messages of the timed paths would be printed and timed too
+bool debug_muted;
+
+
+// Runs the self-tests in a new thread, the scheduler and the timer have to be initialized
+// The other cpus should be started before, some tests run on all of them
+void start_selftests() {
+    if (create_thread(run_selftests, NULL) == NULL) PANIC("Cannot create the self-test thread\n");
+}
+
+// Runs entry(argument) in new threads and waits for all of them to return
+// The threads start on the running cpu, the idle cpus take them from its run queue
+// Returns the cycles from the moment all the threads run to the moment the last one returns (the
+// TSCs of the cpus are expected to be synchronized)
+uint64_t run_threads(size_t number, thread_entry_t entry, void* argument) {
+    thread_group_t group = {
+        .entry    = entry,
+        .argument = argument,
+        .threads  = number,
+        .running  = number,
+        .waiter   = get_current_thread(),
+    };
+
+    for (size_t i = 0; i < number; i++)
+        if (create_thread(run_group_thread, &group) == NULL) PANIC("Cannot create test thread\n");
+
+    // a wake up left by another test can return early, so the counter is checked again
+    while (__atomic_load_n(&group.running, __ATOMIC_ACQUIRE) != 0) block_thread();
+    return group.end - group.start;
+}
+
+// Mutes the debug messages and returns the TSC
+uint64_t start_benchmark() {
+    __atomic_store_n(&debug_muted, true, __ATOMIC_RELAXED);
+    return read_tsc();
+}
+
+// Returns the cycles since start_benchmark and prints the debug messages again
+uint64_t stop_benchmark(uint64_t start) {
+    uint64_t cycles = read_tsc() - start;
+    __atomic_store_n(&debug_muted, false, __ATOMIC_RELAXED);
+    return cycles;
+}
+
+// Prints the cost of one operation, in cycles and nanoseconds, and the operations per second
+void report(const char* name, size_t operations, uint64_t cycles) {
+    if (operations == 0 || cycles == 0) return;
+
+    LOG(
+        "%s: %u cycles/op, %u ns/op, %u op/s\n",
+        name,
+        (unsigned int)(cycles / operations),
+        (unsigned int)(tsc_to_ns(cycles) / operations),
+        (unsigned int)(operations * get_tsc_frequency() / cycles)
+    );
+}
+
+// Prints the MiB per second of a benchmark that processed bytes, size bytes at a time
+void report_bandwidth(const char* name, size_t size, uint64_t bytes, uint64_t cycles) {
+    if (cycles == 0) return;
+
+    LOG(
+        "%s (%u bytes): %u MiB/s\n",
+        name,
+        (unsigned int)size,
+        (unsigned int)(bytes * get_tsc_frequency() / cycles >> 20)
+    );
+}
+
+
+static inline void run_selftests(void* argument) {
+    (void)argument;
+    LOG("Running the self-tests\n");
+
+    test_frame_allocator();
+    test_slab_allocator();
+    test_zeroed_allocations();
+    test_mem_functions();
+    test_page_functions();
+    test_huge_pages();
+    test_global_pages();
+    test_huge_page_mapping();
+    test_copy_on_write();
+    test_vmalloc();
+    test_scheduler();
+    test_locks();
+    test_heap_scaling();
+
+    LOG("Self-tests passed!\n");
+}
+
+// The group is on the waiter's stack, it is gone once the counter is 0
+static inline void run_group_thread(void* argument) {
+    thread_group_t* group  = argument;
+    thread_t*       waiter = group->waiter;
+
+    if (__atomic_add_fetch(&group->ready, 1, __ATOMIC_ACQ_REL) == group->threads)
+        __atomic_store_n(&group->start, read_tsc(), __ATOMIC_RELEASE);
+    while (__atomic_load_n(&group->ready, __ATOMIC_ACQUIRE) != group->threads) cpu_relax();
+
+    group->entry(group->argument);
+
+    if (__atomic_add_fetch(&group->finished, 1, __ATOMIC_ACQ_REL) == group->threads)
+        group->end = read_tsc();
+    if (__atomic_sub_fetch(&group->running, 1, __ATOMIC_ACQ_REL) == 0) wake_thread(waiter);
+}
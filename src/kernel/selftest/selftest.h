@@ -0,0 +1,34 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include "../sched/thread.h"
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The self-tests check the kernel subsystems and time their hot paths, they run in debug builds
+// A failed check panics, the numbers are printed with LOG
+
+
+void     start_selftests();
+uint64_t run_threads(size_t number, thread_entry_t entry, void* argument);
+uint64_t start_benchmark();
+uint64_t stop_benchmark(uint64_t start);
+void     report(const char* name, size_t operations, uint64_t cycles);
+void     report_bandwidth(const char* name, size_t size, uint64_t bytes, uint64_t cycles);
+
+void test_frame_allocator();
+void test_slab_allocator();
+void test_zeroed_allocations();
+void test_heap_scaling();
+void test_mem_functions();
+void test_page_functions();
+void test_huge_pages();
+void test_global_pages();
+void test_huge_page_mapping();
+void test_copy_on_write();
+void test_vmalloc();
+void test_scheduler();
+void test_locks();
+
+#endif
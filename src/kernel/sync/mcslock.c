@@ -0,0 +1,58 @@
+#include "mcslock.h"
+#include "../cpu/cpu.h"
+#include <stddef.h>
+
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next   = NULL;
+    node->locked = true;
+
+    mcs_node_t* previous = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (previous == NULL) return;
+
+    // the previous waiter clears locked when it releases the lock
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) cpu_relax();
+}
+
+// Returns false instead of waiting if the lock is taken
+bool mcs_try_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* expected = NULL;
+    node->next           = NULL;
+    node->locked         = false;
+
+    return __atomic_compare_exchange_n(
+        &lock->tail, &expected, node, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    );
+}
+
+// node has to be the one passed to mcs_lock
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        // no waiters, the lock becomes free
+        mcs_node_t* expected = node;
+        if (__atomic_compare_exchange_n(
+                &lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+            ))
+            return;
+
+        // a waiter swapped the tail but has not linked itself yet
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) cpu_relax();
+    }
+
+    __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
+
+// Interrupts stay disabled until mcs_unlock_irqrestore, see spin_lock_irqsave
+uint64_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    uint64_t rflags = disable_interrupts();
+    mcs_lock(lock, node);
+    return rflags;
+}
+
+void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint64_t rflags) {
+    mcs_unlock(lock, node);
+    restore_interrupts(rflags);
+}
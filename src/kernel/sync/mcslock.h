@@ -0,0 +1,30 @@
+#ifndef SYNC_MCSLOCK_H
+#define SYNC_MCSLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Every cpu waiting for the lock is queued with its own node and spins on it, so the lock hand
+// over only touches the cache line of the next waiter
+// The node is owned by the caller (usually on its stack) until the lock is released
+typedef struct mcs_node_t {
+    struct mcs_node_t* next;
+    bool               locked;
+} mcs_node_t;
+
+// FIFO like the ticket lock, it scales better when many cpus wait for a long critical section
+typedef struct {
+    mcs_node_t* tail; // last waiter, or NULL if the lock is free
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT {.tail = NULL}
+
+
+void     mcs_lock(mcs_lock_t* lock, mcs_node_t* node);
+bool     mcs_try_lock(mcs_lock_t* lock, mcs_node_t* node);
+void     mcs_unlock(mcs_lock_t* lock, mcs_node_t* node);
+uint64_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node);
+void     mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint64_t rflags);
+
+#endif
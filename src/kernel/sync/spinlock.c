@@ -0,0 +1,30 @@
+#include "spinlock.h"
+#include "../cpu/cpu.h"
+
+
+void spin_lock(spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, true, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) cpu_relax();
+}
+
+// Returns false instead of waiting if the lock is taken
+bool spin_try_lock(spinlock_t* lock) {
+    return !__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)
+        && !__atomic_exchange_n(&lock->locked, true, __ATOMIC_ACQUIRE);
+}
+
+void spin_unlock(spinlock_t* lock) { __atomic_store_n(&lock->locked, false, __ATOMIC_RELEASE); }
+
+// Disables interrupts before taking the lock, so an interrupt handler on the same cpu cannot
+// try to take it again while it is held
+// Returns the flags to pass to spin_unlock_irqrestore
+uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t rflags = disable_interrupts();
+    spin_lock(lock);
+    return rflags;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint64_t rflags) {
+    spin_unlock(lock);
+    restore_interrupts(rflags);
+}
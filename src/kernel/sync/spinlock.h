@@ -0,0 +1,23 @@
+#ifndef SYNC_SPINLOCK_H
+#define SYNC_SPINLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Test and test-and-set lock: waiters spin on a plain read, so the cache line is only written
+// when the lock looks free
+typedef struct {
+    bool locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {.locked = false}
+
+
+void     spin_lock(spinlock_t* lock);
+bool     spin_try_lock(spinlock_t* lock);
+void     spin_unlock(spinlock_t* lock);
+uint64_t spin_lock_irqsave(spinlock_t* lock);
+void     spin_unlock_irqrestore(spinlock_t* lock, uint64_t rflags);
+
+#endif
@@ -0,0 +1,33 @@
+#include "ticketlock.h"
+#include "../cpu/cpu.h"
+
+
+void ticket_lock(ticket_lock_t* lock) {
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket) cpu_relax();
+}
+
+// Returns false instead of waiting if the lock is taken or other cpus are waiting for it
+bool ticket_try_lock(ticket_lock_t* lock) {
+    uint32_t ticket = __atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(
+        &lock->next, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    );
+}
+
+// Only the holder writes serving, so it does not need an atomic increment
+void ticket_unlock(ticket_lock_t* lock) {
+    __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+}
+
+// Interrupts stay disabled until ticket_unlock_irqrestore, see spin_lock_irqsave
+uint64_t ticket_lock_irqsave(ticket_lock_t* lock) {
+    uint64_t rflags = disable_interrupts();
+    ticket_lock(lock);
+    return rflags;
+}
+
+void ticket_unlock_irqrestore(ticket_lock_t* lock, uint64_t rflags) {
+    ticket_unlock(lock);
+    restore_interrupts(rflags);
+}
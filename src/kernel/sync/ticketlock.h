@@ -0,0 +1,24 @@
+#ifndef SYNC_TICKETLOCK_H
+#define SYNC_TICKETLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Fair lock: cpus take a ticket and get the lock in the order they asked for it
+// No cpu can starve, but every waiter spins on the same cache line
+typedef struct {
+    uint32_t next;    // ticket given to the next cpu asking for the lock
+    uint32_t serving; // ticket of the cpu holding the lock
+} ticket_lock_t;
+
+#define TICKET_LOCK_INIT {.next = 0, .serving = 0}
+
+
+void     ticket_lock(ticket_lock_t* lock);
+bool     ticket_try_lock(ticket_lock_t* lock);
+void     ticket_unlock(ticket_lock_t* lock);
+uint64_t ticket_lock_irqsave(ticket_lock_t* lock);
+void     ticket_unlock_irqrestore(ticket_lock_t* lock, uint64_t rflags);
+
+#endif